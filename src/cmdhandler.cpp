@@ -22,193 +22,379 @@
 #include "redisservant.h"
 #include "redis-proxy-config.h"
 
-struct MGetCommandContext
+//Keys of a multi-key command that go to one group, sent as one command.
+//Large batches are split to bound the size of one backend command
+struct KeyBatch
 {
+    RedisServantGroup* group;
     int keyCount;
-    int returnCount;
-    ClientPacket* subs[1024];
-    ClientPacket* packet;
-};
-
-struct MSetCommandContext
-{
-    int keyvalCount;
-    int succeedCount;
-    ClientPacket* packet;
+    ClientPacket* sub;
 };
 
-struct DelCommandContext
+//MGET, MSET and DEL over keys of several groups. The keys are batched per
+//group and the replies are merged in the order of the keys
+struct MultiKeyCommandContext
 {
+    int commandType;
     int keyCount;
     int returnCount;
-    int integer;
-    ClientPacket* subs[1024];
+    Vector<KeyBatch> batches;
+    Vector<int> keyBatches;         //Batch of each key, in request order
     ClientPacket* packet;
 };
 
-void onGetPacketFinished(ClientPacket*, void* arg)
+enum { MaxBatchKeys = 512 };
+
+//Appends the element of a reply at offset as reply segments and returns
+//the offset of the next one. An element received in several chunks takes
+//a segment per chunk
+static int appendReplyElement(ClientPacket* packet, const IOBuffer& reply, int offset)
 {
-    MGetCommandContext* mgetcontext = (MGetCommandContext*)arg;
-    ++mgetcontext->returnCount;
-    if (mgetcontext->returnCount == mgetcontext->keyCount) {
-        for (int i = 0; i < mgetcontext->keyCount; ++i) {
-            mgetcontext->packet->sendBuff.append(mgetcontext->subs[i]->sendBuff);
-            delete mgetcontext->subs[i];
+    RedisProtoFrameScanner scanner;
+    IOSegment segs[16];
+    while (!scanner.isFinished()) {
+        int count = reply.segments(offset, segs, 16);
+        if (count == 0) {
+            break;
+        }
+        for (int i = 0; i < count && !scanner.isFinished(); ++i) {
+            int len = scanner.scan(segs[i].data, segs[i].size);
+            if (len < 0) {
+                return reply.size();
+            }
+            packet->appendReplySegment(segs[i].data, len);
+            offset += len;
         }
-        mgetcontext->packet->setFinishedState(ClientPacket::RequestFinished);
-        delete mgetcontext;
     }
+    return offset;
 }
 
-void onSetPacketFinished(ClientPacket* packet, void* arg)
+//Scatters the elements of the per-group MGET replies into the key order.
+//The elements are referenced in the sub packets, nothing is copied
+static bool mergeMGetReplies(MultiKeyCommandContext* context)
 {
-    MSetCommandContext* msetcontext = (MSetCommandContext*)arg;
-    ++msetcontext->succeedCount;
-    if (msetcontext->succeedCount == msetcontext->keyvalCount) {
-        msetcontext->packet->sendBuff.append("+OK\r\n");
-        msetcontext->packet->setFinishedState(ClientPacket::RequestFinished);
-        delete msetcontext;
-    }
-    delete packet;
+    ClientPacket* packet = context->packet;
+    Vector<int> cursors;
+    for (int i = 0; i < context->batches.size(); ++i) {
+        ClientPacket* sub = context->batches.at(i).sub;
+        RedisProtoParseResult& r = sub->sendParseResult;
+        if (sub->finishedState != ClientPacket::RequestFinished ||
+                r.type != RedisProtoParseResult::MultiBulk) {
+            return false;
+        }
+        //The reply is a framed array, only its header is read
+        char header[32];
+        int start = sub->sendBufferOffset - r.protoBuffLen;
+        int size = sub->sendBuff.copy(start, header, sizeof(header) - 1);
+        header[size] = '\0';
+        char* end = strchr(header, '\n');
+        if (end == NULL || atoi(header + 1) != context->batches.at(i).keyCount) {
+            return false;
+        }
+        cursors.append(start + (int)(end - header) + 1);
+    }
+
+    packet->sendBuff.appendFormatString("*%d\r\n", context->keyCount);
+    for (int i = 0; i < context->keyCount; ++i) {
+        int index = context->keyBatches.at(i);
+        int& cursor = cursors.at(index);
+        cursor = appendReplyElement(packet, context->batches.at(index).sub->sendBuff, cursor);
+    }
+    for (int i = 0; i < context->batches.size(); ++i) {
+        packet->holdReplyPacket(context->batches.at(i).sub);
+    }
+    return true;
 }
 
-void onDelPacketFinished(ClientPacket* packet, void* arg)
+static bool mergeMSetReplies(MultiKeyCommandContext* context)
 {
-    DelCommandContext* delcontext = (DelCommandContext*)arg;
-    ++delcontext->returnCount;
-    delcontext->integer += packet->sendParseResult.integer;
-    if (delcontext->returnCount == delcontext->keyCount) {
-        delcontext->packet->sendBuff.appendFormatString(":%d\r\n", delcontext->integer);
-        delcontext->packet->setFinishedState(ClientPacket::RequestFinished);
-        delete delcontext;
-    }
-    delete packet;
+    for (int i = 0; i < context->batches.size(); ++i) {
+        ClientPacket* sub = context->batches.at(i).sub;
+        if (sub->finishedState != ClientPacket::RequestFinished ||
+                sub->sendParseResult.type != RedisProtoParseResult::Status) {
+            return false;
+        }
+    }
+    context->packet->appendReplySegment("+OK\r\n", 5);
+    return true;
 }
 
+static bool mergeDelReplies(MultiKeyCommandContext* context)
+{
+    int integer = 0;
+    for (int i = 0; i < context->batches.size(); ++i) {
+        ClientPacket* sub = context->batches.at(i).sub;
+        if (sub->finishedState != ClientPacket::RequestFinished ||
+                sub->sendParseResult.type != RedisProtoParseResult::Integer) {
+            return false;
+        }
+        integer += sub->sendParseResult.integer;
+    }
+    context->packet->sendBuff.appendFormatString(":%d\r\n", integer);
+    return true;
+}
 
-void onStandardKeyCommand(ClientPacket* packet, void*)
+void onKeyBatchFinished(ClientPacket*, void* arg)
+{
+    MultiKeyCommandContext* context = (MultiKeyCommandContext*)arg;
+    ++context->returnCount;
+    if (context->returnCount != context->batches.size()) {
+        return;
+    }
+
+    bool ok = false;
+    switch (context->commandType) {
+    case RedisCommand::MGET:
+        ok = mergeMGetReplies(context);
+        break;
+    case RedisCommand::MSET:
+        ok = mergeMSetReplies(context);
+        break;
+    case RedisCommand::DEL:
+        ok = mergeDelReplies(context);
+        break;
+    default:
+        break;
+    }
+
+    //A shed or timed out part fails the whole command the same way
+    ClientPacket::State state = ok ? ClientPacket::RequestFinished : ClientPacket::RequestError;
+    for (int i = 0; !ok && i < context->batches.size(); ++i) {
+        int subState = context->batches.at(i).sub->finishedState;
+        if (subState == ClientPacket::RequestRejected || subState == ClientPacket::RequestTimeout) {
+            state = (ClientPacket::State)subState;
+        }
+    }
+
+    //MGET replies now belong to the client packet
+    if (!ok || context->commandType != RedisCommand::MGET) {
+        for (int i = 0; i < context->batches.size(); ++i) {
+            delete context->batches.at(i).sub;
+        }
+    }
+    ClientPacket* packet = context->packet;
+    delete context;
+    packet->setFinishedState(state);
+}
+
+//Batch requests are assembled from pieces. Small arguments are copied to
+//the recvBuff of the batch, larger ones are referenced in the client's
+//buffer, which stays as it is until the reply is written. Pieces of own
+//bytes are recorded with no address until recvBuff is complete
+enum { MinReferenceSize = 512 };
+
+static void appendOwnRequestBytes(ClientPacket* sub, int size)
 {
-    char* key = packet->recvParseResult.tokens[1].s;
-    int len = packet->recvParseResult.tokens[1].len;
-    packet->proxy()->handleClientPacket(key, len, packet);
+    Vector<IOSegment>& segments = sub->requestSegments;
+    if (!segments.isEmpty() && segments.at(segments.size() - 1).data == NULL) {
+        segments.at(segments.size() - 1).size += size;
+        return;
+    }
+    IOSegment seg;
+    seg.data = NULL;
+    seg.size = size;
+    segments.append(seg);
 }
 
-void onMGetCommand(ClientPacket* packet, void*)
+static void appendRequestToken(ClientPacket* sub, const Token& token)
 {
-    RedisProtoParseResult& r = packet->recvParseResult;
-    int keyCount = r.tokenCount - 1;
-    if (keyCount <= 0) {
-        packet->setFinishedState(ClientPacket::WrongNumberOfArguments);
+    int offset = sub->recvBuff.size();
+    sub->recvBuff.appendFormatString("$%d\r\n", token.len);
+    if (token.len < MinReferenceSize) {
+        sub->recvBuff.append(token.s, token.len);
+        sub->recvBuff.append("\r\n", 2);
+        appendOwnRequestBytes(sub, sub->recvBuff.size() - offset);
         return;
     }
+    appendOwnRequestBytes(sub, sub->recvBuff.size() - offset);
+    //A bulk argument is followed by its CRLF in the client's buffer
+    IOSegment seg;
+    seg.data = token.s;
+    seg.size = token.len + 2;
+    sub->requestSegments.append(seg);
+}
 
-    if (keyCount == 1) {
-        char* key = r.tokens[0].s;
-        int len = r.tokens[0].len;
-        packet->proxy()->handleClientPacket(key, len, packet);
-    } else {
-        MGetCommandContext* mgetcontext = new MGetCommandContext;
-        mgetcontext->keyCount = keyCount;
-        mgetcontext->returnCount = 0;
-        mgetcontext->packet = packet;
-        packet->sendBuff.appendFormatString("*%d\r\n", keyCount);
-        for (int i = 1; i < r.tokenCount; ++i) {
-            char* key = r.tokens[i].s;
-            int len = r.tokens[i].len;
-
-            ClientPacket* get = new ClientPacket;
-            get->eventLoop = packet->eventLoop;
-            get->commandType = RedisCommand::GET;
-            get->finished_func = onGetPacketFinished;
-            get->finished_arg = mgetcontext;
-            get->recvBuff.appendFormatString("*2\r\n$3\r\nGET\r\n$%d\r\n", len);
-            get->recvBuff.append(key, len);
-            get->recvBuff.append("\r\n");
-            mgetcontext->subs[i-1] = get;
-            get->parseRecvBuffer();
-            packet->proxy()->handleClientPacket(key, len, get);
+static void finishRequestSegments(ClientPacket* sub)
+{
+    RedisProtoParseResult& request = sub->recvParseResult;
+    char* own = sub->recvBuff.data();
+    int offset = 0;
+    int size = 0;
+    for (int i = 0; i < sub->requestSegments.size(); ++i) {
+        IOSegment& seg = sub->requestSegments.at(i);
+        if (seg.data == NULL) {
+            seg.data = own + offset;
+            offset += seg.size;
         }
+        size += seg.size;
     }
+    request.protoBuff = NULL;
+    request.protoBuffLen = size;
+    sub->recvBufferOffset = sub->recvBuff.size();
 }
 
-void onMSetCommand(ClientPacket* packet, void*)
+//Sends the keys (every keyStep-th token from the first key, each with its
+//keyStep-1 arguments) batched per group. Keys of a single group need no
+//batching, the request goes to that group as it is
+void onMultiKeyCommand(ClientPacket* packet, void*)
 {
     RedisProtoParseResult& r = packet->recvParseResult;
-    int keyvalCount = (r.tokenCount - 1) / 2;
-    if (keyvalCount <= 0) {
+    RedisProxy* proxy = packet->proxy();
+    const RedisCommand* command = packet->command;
+    int first = command->firstKey;
+    int step = command->keyStep;
+    int keyCount = (r.tokenCount - first) / step;
+    if (keyCount <= 0 || (r.tokenCount - first) % step != 0) {
         packet->setFinishedState(ClientPacket::WrongNumberOfArguments);
         return;
     }
 
-    if (keyvalCount == 1) {
-        char* key = r.tokens[0].s;
-        int len = r.tokens[0].len;
-        packet->proxy()->handleClientPacket(key, len, packet);
-    } else {
-        MSetCommandContext* msetcontext = new MSetCommandContext;
-        msetcontext->keyvalCount = keyvalCount;
-        msetcontext->succeedCount = 0;
-        msetcontext->packet = packet;
-
-        for (int i = 1; i < r.tokenCount; i += 2) {
-            char* key = r.tokens[i].s;
-            int len = r.tokens[i].len;
-
-            char* val = r.tokens[i+1].s;
-            int vallen = r.tokens[i+1].len;
-
-            ClientPacket* set = new ClientPacket;
-            set->finished_func = onSetPacketFinished;
-            set->finished_arg = msetcontext;
-            set->eventLoop = packet->eventLoop;
-            set->commandType = RedisCommand::SET;
-            set->recvBuff.appendFormatString("*3\r\n$3\r\nSET\r\n$%d\r\n", len);
-            set->recvBuff.append(key, len);
-            set->recvBuff.append("\r\n");
-            set->recvBuff.appendFormatString("$%d\r\n", vallen);
-            set->recvBuff.append(val, vallen);
-            set->recvBuff.append("\r\n");
-            set->parseRecvBuffer();
-            packet->proxy()->handleClientPacket(key, len, set);
+    MultiKeyCommandContext* context = new MultiKeyCommandContext;
+    context->commandType = packet->commandType;
+    context->keyCount = keyCount;
+    context->returnCount = 0;
+    context->packet = packet;
+    context->keyBatches.resize(keyCount);
+
+    RedisServantGroup* firstGroup = NULL;
+    bool singleGroup = true;
+    bool migrating = false;
+    for (int i = 0; i < keyCount; ++i) {
+        Token& key = r.tokens[first + i * step];
+        RedisServantGroup* source;
+        RedisServantGroup* group = proxy->mapToGroup(key.s, key.len, &source);
+        if (group == NULL) {
+            delete context;
+            packet->setFinishedState(ClientPacket::RequestError);
+            return;
         }
+        if (i == 0) {
+            firstGroup = group;
+        } else if (group != firstGroup) {
+            singleGroup = false;
+        }
+
+        //A key of a migrating hash value is moved before its request is
+        //sent, so it is batched alone
+        RedisServantGroup* batchGroup = group;
+        int index = context->batches.size() - 1;
+        if (source) {
+            migrating = true;
+            batchGroup = NULL;
+            index = -1;
+        }
+        while (index >= 0) {
+            KeyBatch& batch = context->batches.at(index);
+            if (batch.group == batchGroup) {
+                break;
+            }
+            --index;
+        }
+        if (index < 0 || context->batches.at(index).keyCount == MaxBatchKeys) {
+            KeyBatch batch;
+            batch.group = batchGroup;
+            batch.keyCount = 0;
+            batch.sub = NULL;
+            context->batches.append(batch);
+            index = context->batches.size() - 1;
+        }
+        ++context->batches.at(index).keyCount;
+        context->keyBatches.append(index);
+    }
+
+    if (singleGroup && (!migrating || keyCount == 1)) {
+        delete context;
+        proxy->handleClientPacket(r.tokens[first].s, r.tokens[first].len, packet);
+        return;
+    }
+
+    for (int i = 0; i < context->batches.size(); ++i) {
+        KeyBatch& batch = context->batches.at(i);
+        ClientPacket* sub = new ClientPacket;
+        sub->server = packet->server;
+        sub->eventLoop = packet->eventLoop;
+        sub->commandType = packet->commandType;
+        sub->command = packet->command;
+        sub->finished_func = onKeyBatchFinished;
+        sub->finished_arg = context;
+        sub->pipeline = packet->pipeline;
+        RedisProtoParseResult& request = sub->recvParseResult;
+        request.type = RedisProtoParseResult::MultiBulk;
+        request.reserveTokens(first + batch.keyCount * step);
+        request.tokens[0] = r.tokens[0];
+        request.tokenCount = 1;
+        sub->recvBuff.appendFormatString("*%d\r\n$%d\r\n%s\r\n",
+            first + batch.keyCount * step, command->len, command->name);
+        appendOwnRequestBytes(sub, sub->recvBuff.size());
+        for (int j = 1; j < first; ++j) {
+            request.tokens[request.tokenCount++] = r.tokens[j];
+            appendRequestToken(sub, r.tokens[j]);
+        }
+        batch.sub = sub;
+    }
+    for (int i = 0; i < keyCount; ++i) {
+        ClientPacket* sub = context->batches.at(context->keyBatches.at(i)).sub;
+        RedisProtoParseResult& request = sub->recvParseResult;
+        for (int j = 0; j < step; ++j) {
+            Token& token = r.tokens[first + i * step + j];
+            request.tokens[request.tokenCount++] = token;
+            appendRequestToken(sub, token);
+        }
+    }
+
+    //The context is released by the last finished batch
+    int count = context->batches.size();
+    for (int i = 0; i < count; ++i) {
+        ClientPacket* sub = context->batches.at(i).sub;
+        RedisProtoParseResult& request = sub->recvParseResult;
+        finishRequestSegments(sub);
+        proxy->handleClientPacket(request.tokens[first].s, request.tokens[first].len, sub);
     }
 }
 
-void onDelCommand(ClientPacket* packet, void*)
+
+//Commands over several keys that redis runs as one (RPOPLPUSH, SINTER...)
+//go to the group of their keys as they are. Hash tags keep related keys
+//in one group, keys of several groups are refused
+void onSameGroupCommand(ClientPacket* packet, void*)
 {
     RedisProtoParseResult& r = packet->recvParseResult;
-    int keyCount = r.tokenCount - 1;
-    if (keyCount <= 0) {
+    RedisProxy* proxy = packet->proxy();
+    const RedisCommand* command = packet->command;
+    int first = command->firstKey;
+    int last = command->lastKeyIndex(r.tokenCount);
+    int step = command->keyStep;
+    if (last < first || (r.tokenCount - first) % step != 0) {
         packet->setFinishedState(ClientPacket::WrongNumberOfArguments);
         return;
     }
-    if (keyCount == 1) {
-        char* key = r.tokens[0].s;
-        int len = r.tokens[0].len;
-        packet->proxy()->handleClientPacket(key, len, packet);
-    } else {
-        DelCommandContext* delcontext = new DelCommandContext;
-        delcontext->keyCount = keyCount;
-        delcontext->returnCount = 0;
-        delcontext->integer = 0;
-        delcontext->packet = packet;
-        for (int i = 1; i < r.tokenCount; ++i) {
-            char* key = r.tokens[i].s;
-            int len = r.tokens[i].len;
-
-            ClientPacket* del = new ClientPacket;
-            del->eventLoop = packet->eventLoop;
-            del->finished_func = onDelPacketFinished;
-            del->finished_arg = delcontext;
-            del->commandType = RedisCommand::DEL;
-            del->eventLoop = packet->eventLoop;
-            del->recvBuff.appendFormatString("*2\r\n$3\r\nDEL\r\n$%d\r\n", len);
-            del->recvBuff.append(key, len);
-            del->recvBuff.append("\r\n");
-            del->parseRecvBuffer();
-            packet->proxy()->handleClientPacket(key, len, del);
+
+    RedisServantGroup* source;
+    RedisServantGroup* group = proxy->mapToGroup(r.tokens[first].s, r.tokens[first].len, &source);
+    for (int i = first + step; i <= last; i += step) {
+        RedisServantGroup* keySource;
+        if (proxy->mapToGroup(r.tokens[i].s, r.tokens[i].len, &keySource) != group) {
+            packet->sendBuff.append("-CROSSGROUP Keys in request don't belong to the same group\r\n");
+            packet->setFinishedState(ClientPacket::RequestFinished);
+            return;
+        }
+        if (keySource) {
+            source = keySource;
         }
     }
+    //Keys are moved one at a time, the command would see some of them
+    if (source) {
+        packet->sendBuff.append("-TRYAGAIN Keys in request are being migrated\r\n");
+        packet->setFinishedState(ClientPacket::RequestFinished);
+        return;
+    }
+    proxy->handleClientPacket(r.tokens[first].s, r.tokens[first].len, packet);
+}
+
+void onStandardKeyCommand(ClientPacket* packet, void*)
+{
+    Token& key = packet->recvParseResult.tokens[packet->command->firstKey];
+    packet->proxy()->handleClientPacket(key.s, key.len, packet);
 }
 
 void onPingCommand(ClientPacket* packet, void*)
@@ -245,6 +431,15 @@ void onShowCommand(ClientPacket* packet, void*)
     packet->setFinishedState(ClientPacket::RequestFinished);
 }
 
+//Copies a token to a C string, longer tokens are cut at the buffer size
+static const char* tokenString(const Token& token, char* buf, int size)
+{
+    int len = (token.len < size - 1) ? token.len : size - 1;
+    memcpy(buf, token.s, len);
+    buf[len] = 0;
+    return buf;
+}
+
 void onHashMapping(ClientPacket* packet, void*)
 {
     RedisProtoParseResult& request = packet->recvParseResult;
@@ -255,12 +450,10 @@ void onHashMapping(ClientPacket* packet, void*)
     }
 
     RedisProxy* proxy = packet->proxy();
-    char hashValueStr[1024] = {0};
-    char groupName[1024] = {0};
-    strncpy(hashValueStr, request.tokens[1].s, request.tokens[1].len);
-    strncpy(groupName, request.tokens[2].s, request.tokens[2].len);
-
-    int hashValue = atoi(hashValueStr);
+    char buf[64];
+    int hashValue = atoi(tokenString(request.tokens[1], buf, sizeof(buf)));
+    char groupName[1024];
+    tokenString(request.tokens[2], groupName, sizeof(groupName));
     RedisServantGroup* group = proxy->group(groupName);
     if (!group) {
         packet->sendBuff.append("-Group is not exists\r\n");
@@ -268,7 +461,9 @@ void onHashMapping(ClientPacket* packet, void*)
         return;
     }
 
-    if (proxy->setGroupMappingValue(hashValue, group)) {
+    if (hashValue == proxy->routingTable()->migratingHashValue()) {
+        packet->sendBuff.append("-Hash value is being migrated\r\n");
+    } else if (proxy->setGroupMappingValue(hashValue, group)) {
         packet->sendBuff.append("+OK\r\n");
         CRedisProxyCfg::instance()->saveProxyLastState(proxy);
     } else {
@@ -288,8 +483,8 @@ void onAddKeyMapping(ClientPacket* packet, void*)
 
     RedisProxy* proxy = packet->proxy();
 
-    char groupName[1024] = {0};
-    strncpy(groupName, request.tokens[1].s, request.tokens[1].len);
+    char groupName[1024];
+    tokenString(request.tokens[1], groupName, sizeof(groupName));
     RedisServantGroup* group = proxy->group(groupName);
     if (!group) {
         packet->sendBuff.append("-Group is not exists\r\n");
@@ -297,11 +492,13 @@ void onAddKeyMapping(ClientPacket* packet, void*)
         return;
     }
 
+    RoutingTable* table = proxy->beginRoutingUpdate();
     for (int i = 2; i < request.tokenCount; ++i) {
         const char* key = request.tokens[i].s;
         int keyLen = request.tokens[i].len;
-        proxy->addGroupKeyMapping(key, keyLen, group);
+        table->addKeyMapping(key, keyLen, group);
     }
+    proxy->endRoutingUpdate(table);
 
     packet->sendBuff.append("+OK\r\n");
     packet->setFinishedState(ClientPacket::RequestFinished);
@@ -318,11 +515,13 @@ void onDelKeyMapping(ClientPacket* packet, void*)
     }
 
     RedisProxy* proxy = packet->proxy();
+    RoutingTable* table = proxy->beginRoutingUpdate();
     for (int i = 1; i < request.tokenCount; ++i) {
         const char* key = request.tokens[i].s;
         int keyLen = request.tokens[i].len;
-        proxy->removeGroupKeyMapping(key, keyLen);
+        table->removeKeyMapping(key, keyLen);
     }
+    proxy->endRoutingUpdate(table);
 
     packet->sendBuff.append("+OK\r\n");
     packet->setFinishedState(ClientPacket::RequestFinished);
@@ -332,24 +531,38 @@ void onDelKeyMapping(ClientPacket* packet, void*)
 void onShowMapping(ClientPacket* packet, void*)
 {
     RedisProxy* proxy = packet->proxy();
+    const RoutingTable* table = proxy->routingTable();
     packet->sendBuff.append("+\n");
 
-    packet->sendBuff.append("[HASH MAPPING]\n");
+    packet->sendBuff.appendFormatString("[HASH MAPPING] %s\n",
+                                        RedisProxy::hashStrategyName(proxy->hashStrategy()));
     packet->sendBuff.appendFormatString("%-15s %-15s\n", "HASH_VALUE", "GROUP_NAME");
-    for (int i = 0; i < proxy->maxHashValue(); ++i) {
-        packet->sendBuff.appendFormatString("%-15d %-15s\n",
-                                            i, proxy->hashForGroup(i)->groupName());
+    //Consecutive hash values of a group are shown as one range
+    char range[32];
+    for (int i = 0; i < proxy->maxHashValue(); ) {
+        RedisServantGroup* group = table->hashForGroup(i);
+        int last = i;
+        while (last + 1 < proxy->maxHashValue() && table->hashForGroup(last + 1) == group) {
+            ++last;
+        }
+        if (last == i) {
+            sprintf(range, "%d", i);
+        } else {
+            sprintf(range, "%d-%d", i, last);
+        }
+        packet->sendBuff.appendFormatString("%-15s %-15s\n", range, group ? group->groupName() : "-");
+        i = last + 1;
     }
     packet->sendBuff.append("\n");
     packet->sendBuff.append("[KEY MAPPING]\n");
     packet->sendBuff.appendFormatString("%-4s %-15s KEYS\n", "ID", "NAME");
 
-    StringMap<RedisServantGroup*>& keyMapping = proxy->keyMapping();
+    const StringMap<RedisServantGroup*>& keyMapping = table->keyMapping();
     for (int j = 0; j < proxy->groupCount(); ++j) {
         RedisServantGroup* group = proxy->group(j);
         packet->sendBuff.appendFormatString("%-4d %-15s ", group->groupId(), group->groupName());
 
-        StringMap<RedisServantGroup*>::iterator it = keyMapping.begin();
+        StringMap<RedisServantGroup*>::const_iterator it = keyMapping.begin();
         for (; it != keyMapping.end(); ++it) {
             if (it->second == group) {
                 String key = it->first;
@@ -364,40 +577,149 @@ void onShowMapping(ClientPacket* packet, void*)
     packet->setFinishedState(ClientPacket::RequestFinished);
 }
 
+static void appendPoolInfo(IOBuffer& sendbuf, RedisServantGroup* group, RedisServant* servant)
+{
+    char buf[64];
+    sprintf(buf, "%s:%d", servant->redisAddress().ip(), servant->redisAddress().port());
+    int poolSize = servant->connectionNums();
+    int active = servant->activeConnectionNums();
+    RedisConnectStats stats = servant->connectStats();
+    double connectMs = 0;
+    if (stats.succeeded > 0) {
+        connectMs = (double)stats.totalTime / stats.succeeded / 1000;
+    }
+    double latencyMs = servant->latency(EventLoop::monotonicTime()) / 1000;
+    sendbuf.appendFormatString("%-10s %-20s %-10s %-8d %-10d %-12d %-8d %-8.2f %-8d %-8d %-8.3f\n",
+                               group->groupName(),
+                               buf,
+                               servant->isMultiplexed() ? "MULTIPLEX" : "POOL",
+                               active,
+                               poolSize - active,
+                               poolSize,
+                               servant->pendingRequestNums(),
+                               connectMs,
+                               stats.failed,
+                               servant->outstandingRequests(),
+                               latencyMs);
+}
+
 void onPoolInfo(ClientPacket* packet, void*)
 {
     RedisProxy* proxy = packet->proxy();
     IOBuffer& sendbuf = packet->sendBuff;
     sendbuf.append("+", 1);
-    sendbuf.appendFormatString("%-10s %-20s %-8s %-10s %-12s\n",
-                               "GROUP", "HOST", "ACTIVE", "UNACTIVE", "POOLSIZE");
+    sendbuf.appendFormatString("%-10s %-20s %-10s %-8s %-10s %-12s %-8s %-8s %-8s %-8s %-8s\n",
+                               "GROUP", "HOST", "MODE", "ACTIVE", "UNACTIVE", "POOLSIZE",
+                               "PENDING", "CONNMS", "CONNFAIL", "INFLIGHT", "LATMS");
     for (int i = 0; i < proxy->groupCount(); ++i) {
         RedisServantGroup* group = proxy->group(i);
         for (int m = 0; m < group->masterCount(); ++m) {
-            RedisServant* servant = group->master(m);
-            RedisConnectionPool* pool = servant->connectionPool();
-            char buf[64];
-            sprintf(buf, "%s:%d", servant->redisAddress().ip(), servant->redisAddress().port());
-            sendbuf.appendFormatString("%-10s %-20s %-8d %-10d %-12d\n",
-                                       group->groupName(),
-                                       buf,
-                                       pool->activeConnectionNums(),
-                                       pool->unActiveConnectionNums(),
-                                       pool->capacity());
+            appendPoolInfo(sendbuf, group, group->master(m));
         }
         for (int s = 0; s < group->slaveCount(); ++s) {
-            RedisServant* servant = group->slave(s);
-            RedisConnectionPool* pool = servant->connectionPool();
-            char buf[64];
-            sprintf(buf, "%s:%d", servant->redisAddress().ip(), servant->redisAddress().port());
-            sendbuf.appendFormatString("%-10s %-20s %-8d %-10d %-12d\n",
-                                       group->groupName(),
-                                       buf,
-                                       pool->activeConnectionNums(),
-                                       pool->unActiveConnectionNums(),
-                                       pool->capacity());
+            appendPoolInfo(sendbuf, group, group->slave(s));
+        }
+    }
+    sendbuf.append("\r\n", 2);
+    packet->setFinishedState(ClientPacket::RequestFinished);
+}
+
+void onHotKeyCache(ClientPacket* packet, void*)
+{
+    HotKeyCache* cache = packet->proxy()->hotKeyCache();
+    IOBuffer& sendbuf = packet->sendBuff;
+    if (!cache) {
+        sendbuf.append("+Hot key cache is disabled\r\n");
+        packet->setFinishedState(ClientPacket::RequestFinished);
+        return;
+    }
+
+    HotKeyCache::Stats stats = cache->stats();
+    sendbuf.append("+", 1);
+    sendbuf.appendFormatString("%-12s %-12s %-8s %-8s %-10s %-10s\n",
+                               "MAXMEMORY", "MEMORY", "KEYS", "TTL", "THRESHOLD", "HOTKEYS");
+    sendbuf.appendFormatString("%-12lld %-12lld %-8d %-8d %-10d %-10d\n",
+                               cache->maxMemory(), stats.memory, stats.keys,
+                               cache->ttl(), cache->hotThreshold(), cache->hotKeyCount());
+    sendbuf.appendFormatString("%-12s %-12s %-12s %-14s %-12s\n",
+                               "HITS", "MISSES", "STORES", "INVALIDATIONS", "EVICTIONS");
+    sendbuf.appendFormatString("%-12llu %-12llu %-12llu %-14llu %-12llu\n",
+                               stats.hits, stats.misses, stats.stores,
+                               stats.invalidations, stats.evictions);
+    sendbuf.append("\r\n", 2);
+    packet->setFinishedState(ClientPacket::RequestFinished);
+}
+
+void onMigrateHash(ClientPacket* packet, void*)
+{
+    RedisProtoParseResult& request = packet->recvParseResult;
+    if (request.tokenCount != 3 && request.tokenCount != 4) {
+        packet->sendBuff.append("+Usage:\nMIGRATEHASH [hash value] [group name] [keys per second]\n\r\n");
+        packet->setFinishedState(ClientPacket::RequestFinished);
+        return;
+    }
+
+    RedisProxy* proxy = packet->proxy();
+    char buf[64];
+    int hashValue = atoi(tokenString(request.tokens[1], buf, sizeof(buf)));
+    int keysPerSecond = HashMigrator::DefaultKeysPerSecond;
+    if (request.tokenCount == 4) {
+        keysPerSecond = atoi(tokenString(request.tokens[3], buf, sizeof(buf)));
+    }
+
+    char groupName[1024];
+    tokenString(request.tokens[2], groupName, sizeof(groupName));
+    RedisServantGroup* group = proxy->group(groupName);
+    IOBuffer& sendbuf = packet->sendBuff;
+    if (!group) {
+        sendbuf.append("-Group is not exists\r\n");
+    } else if (hashValue < 0 || hashValue >= proxy->maxHashValue() || !proxy->hashForGroup(hashValue)) {
+        sendbuf.append("-Invalid hash value\r\n");
+    } else if (keysPerSecond <= 0 || keysPerSecond > HashMigrator::MaxKeysPerSecond) {
+        sendbuf.append("-Invalid keys per second\r\n");
+    } else {
+        switch (proxy->hashMigrator()->start(hashValue, group, keysPerSecond)) {
+        case HashMigrator::Busy:
+            sendbuf.append("-Another hash value is being migrated\r\n");
+            break;
+        case HashMigrator::SameGroup:
+            sendbuf.append("-Hash value is already mapped to the group\r\n");
+            break;
+        default:
+            sendbuf.append("+OK\r\n");
+            CRedisProxyCfg::instance()->saveProxyLastState(proxy);
+            break;
         }
     }
+    packet->setFinishedState(ClientPacket::RequestFinished);
+}
+
+void onMigrateInfo(ClientPacket* packet, void*)
+{
+    HashMigrator::Progress progress = packet->proxy()->hashMigrator()->progress();
+    IOBuffer& sendbuf = packet->sendBuff;
+    if (progress.state == HashMigrator::Idle) {
+        sendbuf.append("+No hash value has been migrated\r\n");
+        packet->setFinishedState(ClientPacket::RequestFinished);
+        return;
+    }
+
+    time_t end = (progress.state == HashMigrator::Finished) ? progress.finishTime : time(NULL);
+    sendbuf.append("+", 1);
+    sendbuf.appendFormatString("%-10s %-12s %-15s %-15s %-10s %-10s\n",
+                               "STATE", "HASH_VALUE", "SOURCE", "TARGET", "KEYS/SEC", "SECONDS");
+    sendbuf.appendFormatString("%-10s %-12d %-15s %-15s %-10d %-10d\n",
+                               progress.state == HashMigrator::Running ? "running" : "finished",
+                               progress.hashValue, progress.source->groupName(),
+                               progress.target->groupName(), progress.keysPerSecond,
+                               (int)(end - progress.startTime));
+    sendbuf.appendFormatString("%-8s %-20s %-12s %-12s %-12s %-12s %-12s %-12s\n",
+                               "PASSES", "CURSOR", "SCANNED", "MOVED", "ONREQUEST",
+                               "MISSING", "FAILED", "SCANERRORS");
+    sendbuf.appendFormatString("%-8d %-20llu %-12llu %-12llu %-12llu %-12llu %-12llu %-12llu\n",
+                               progress.passes, progress.cursor, progress.scannedKeys,
+                               progress.movedKeys, progress.keysMovedOnRequest,
+                               progress.missingKeys, progress.failedKeys, progress.scanErrors);
     sendbuf.append("\r\n", 2);
     packet->setFinishedState(ClientPacket::RequestFinished);
 }
@@ -24,16 +24,14 @@
 
 void onStandardKeyCommand(ClientPacket*, void*);
 
-void onDelCommand(ClientPacket*, void*);
+void onMultiKeyCommand(ClientPacket*, void*);
+
+void onSameGroupCommand(ClientPacket*, void*);
 
 void onPingCommand(ClientPacket*, void*);
 
 void onShowCommand(ClientPacket*, void*);
 
-void onMGetCommand(ClientPacket*, void*);
-
-void onMSetCommand(ClientPacket*, void*);
-
 void onHashMapping(ClientPacket* packet, void*);
 
 void onAddKeyMapping(ClientPacket* packet, void*);
@@ -44,6 +42,12 @@ void onShowMapping(ClientPacket* packet, void*);
 
 void onPoolInfo(ClientPacket* packet, void*);
 
+void onHotKeyCache(ClientPacket* packet, void*);
+
+void onMigrateHash(ClientPacket* packet, void*);
+
+void onMigrateInfo(ClientPacket* packet, void*);
+
 void onShutDown(ClientPacket* packet, void*);
 
 #endif
@@ -17,101 +17,206 @@
 * under the License.
 */
 
+#include <string.h>
+
 #include "util/logger.h"
 #include "cmdhandler.h"
 #include "redisproxy.h"
 #include "command.h"
 
-static RedisCommand _redisCommand[] = {
-    {"APPEND", 6, RedisCommand::APPEND, onStandardKeyCommand, NULL},
-    {"BITCOUNT", 8, RedisCommand::BITCOUNT, onStandardKeyCommand, NULL},
-    {"BITPOS", 6, RedisCommand::BITPOS, onStandardKeyCommand, NULL},
-    {"DUMP", 4, RedisCommand::DUMP, onStandardKeyCommand, NULL},
-    {"DEL", 3, RedisCommand::DEL, onDelCommand, NULL},
-    {"DECR", 4, RedisCommand::DECR, onStandardKeyCommand, NULL},
-    {"DECRBY", 6, RedisCommand::DECRBY, onStandardKeyCommand, NULL},
-    {"EXPIREAT", 8, RedisCommand::EXPIREAT, onStandardKeyCommand, NULL},
-    {"EXISTS", 6, RedisCommand::EXISTS, onStandardKeyCommand, NULL},
-    {"EXPIRE", 6, RedisCommand::EXPIRE, onStandardKeyCommand, NULL},
-    {"GET", 3, RedisCommand::GET, onStandardKeyCommand, NULL},
-    {"GETBIT", 6, RedisCommand::GETBIT, onStandardKeyCommand, NULL},
-    {"GETRANGE", 8, RedisCommand::GETRANGE, onStandardKeyCommand, NULL},
-    {"GETSET", 6, RedisCommand::GETSET, onStandardKeyCommand, NULL},
-    {"HSET", 4, RedisCommand::HSET, onStandardKeyCommand, NULL},
-    {"HSETNX", 6, RedisCommand::HSETNX, onStandardKeyCommand, NULL},
-    {"HMSET", 5, RedisCommand::HMSET, onStandardKeyCommand, NULL},
-    {"HGET", 4, RedisCommand::HGET, onStandardKeyCommand, NULL},
-    {"HMGET", 5, RedisCommand::HMGET, onStandardKeyCommand, NULL},
-    {"HINCRBY", 7, RedisCommand::HINCRBY, onStandardKeyCommand, NULL},
-    {"HEXISTS", 7, RedisCommand::HEXISTS, onStandardKeyCommand, NULL},
-    {"HLEN", 4, RedisCommand::HLEN, onStandardKeyCommand, NULL},
-    {"HDEL", 4, RedisCommand::HDEL, onStandardKeyCommand, NULL},
-    {"HKEYS", 5, RedisCommand::HKEYS, onStandardKeyCommand, NULL},
-    {"HVALS", 5, RedisCommand::HVALS, onStandardKeyCommand, NULL},
-    {"HGETALL", 7, RedisCommand::HGETALL, onStandardKeyCommand, NULL},
-    {"HINCRBYFLOAT", 12, RedisCommand::HINCRBYFLOAT, onStandardKeyCommand, NULL},
-    {"INCR", 4, RedisCommand::INCR, onStandardKeyCommand, NULL},
-    {"INCRBY", 6, RedisCommand::INCRBY, onStandardKeyCommand, NULL},
-    {"INCRBYFLOAT", 11, RedisCommand::INCRBYFLOAT, onStandardKeyCommand,  NULL},
-
-    {"LPUSH", 5, RedisCommand::LPUSH, onStandardKeyCommand, NULL},
-    {"LPUSHX", 6, RedisCommand::LPUSHX, onStandardKeyCommand, NULL},
-    {"LPOP", 4, RedisCommand::LPOP, onStandardKeyCommand, NULL},
-    {"LRANGE", 6, RedisCommand::LRANGE, onStandardKeyCommand, NULL},
-    {"LREM", 4, RedisCommand::LREM, onStandardKeyCommand, NULL},
-    {"LINDEX", 5, RedisCommand::LINDEX, onStandardKeyCommand, NULL},
-    {"LINSERT", 7, RedisCommand::LINSERT, onStandardKeyCommand, NULL},
-    {"LLEN", 4, RedisCommand::LLEN, onStandardKeyCommand, NULL},
-    {"LSET", 4, RedisCommand::LSET, onStandardKeyCommand, NULL},
-    {"LTRIM", 5, RedisCommand::LTRIM, onStandardKeyCommand, NULL},
-
-    {"MGET", 4, RedisCommand::MGET, onMGetCommand, NULL},
-    {"MSET", 4, RedisCommand::MSET, onMSetCommand, NULL},
-
-    {"PSETEX", 6, RedisCommand::PSETEX, onStandardKeyCommand, NULL},
-    {"PERSIST", 7, RedisCommand::PERSIST, onStandardKeyCommand, NULL},
-    {"PEXPIRE", 7, RedisCommand::PEXPIRE, onStandardKeyCommand, NULL},
-    {"PEXPIREAT", 9, RedisCommand::PEXPIREAT, onStandardKeyCommand, NULL},
-    {"PTTL", 4, RedisCommand::PTTL, onStandardKeyCommand, NULL},
-    {"PING", 4, RedisCommand::PING, onPingCommand, NULL},
-
-    {"RESTORE", 7, RedisCommand::RESTORE, onStandardKeyCommand, NULL},
-    {"RPOP", 4, RedisCommand::RPOP, onStandardKeyCommand, NULL},
-    {"RPUSH", 5, RedisCommand::RPUSH, onStandardKeyCommand, NULL},
-    {"RPUSHX", 6, RedisCommand::RPUSHX, onStandardKeyCommand, NULL},
-
-    {"SADD", 4, RedisCommand::SADD, onStandardKeyCommand, NULL},
-    {"SMEMBERS", 8, RedisCommand::SMEMBERS, onStandardKeyCommand, NULL},
-    {"SREM", 4, RedisCommand::SREM, onStandardKeyCommand, NULL},
-    {"SPOP", 4, RedisCommand::SPOP, onStandardKeyCommand, NULL},
-    {"SCARD", 5, RedisCommand::SCARD, onStandardKeyCommand, NULL},
-    {"SISMEMBER", 9, RedisCommand::SISMEMBER, onStandardKeyCommand, NULL},
-    {"SRANDMEMBER", 11, RedisCommand::SRANDMEMBER, onStandardKeyCommand, NULL},
-
-    {"SETBIT", 6, RedisCommand::SETBIT, onStandardKeyCommand, NULL},
-    {"SETRANGE", 8, RedisCommand::SETRANGE, onStandardKeyCommand, NULL},
-    {"STRLEN", 6, RedisCommand::STRLEN, onStandardKeyCommand, NULL},
-    {"SET", 3, RedisCommand::SET, onStandardKeyCommand, NULL},
-    {"SETEX", 5, RedisCommand::SETEX, onStandardKeyCommand, NULL},
-    {"SETNX", 5, RedisCommand::SETNX, onStandardKeyCommand, NULL},
-
-    {"TTL", 3, RedisCommand::TTL, onStandardKeyCommand, NULL},
-    {"TYPE", 4, RedisCommand::TYPE, onStandardKeyCommand, NULL},
-
-    {"ZADD", 4, RedisCommand::ZADD, onStandardKeyCommand, NULL},
-    {"ZRANGE", 6, RedisCommand::ZRANGE, onStandardKeyCommand, NULL},
-    {"ZREM", 4, RedisCommand::ZREM, onStandardKeyCommand, NULL},
-    {"ZINCRBY", 7, RedisCommand::ZINCRBY, onStandardKeyCommand, NULL},
-    {"ZRANK", 5, RedisCommand::ZRANK, onStandardKeyCommand, NULL},
-    {"ZREVRANK", 8, RedisCommand::ZREVRANK, onStandardKeyCommand, NULL},
-    {"ZREVRANGE", 9, RedisCommand::ZREVRANGE, onStandardKeyCommand, NULL},
-    {"ZRANGEBYSCORE", 13, RedisCommand::ZRANGEBYSCORE, onStandardKeyCommand, NULL},
-    {"ZCOUNT", 6, RedisCommand::ZCOUNT, onStandardKeyCommand, NULL},
-    {"ZCARD", 5, RedisCommand::ZCARD, onStandardKeyCommand, NULL},
-    {"ZREMRANGEBYRANK", 15, RedisCommand::ZREMRANGEBYRANK, onStandardKeyCommand, NULL},
-    {"ZREMRANGEBYSCORE", 16, RedisCommand::ZREMRANGEBYSCORE, onStandardKeyCommand, NULL},
-
-    {"SHOWCMD", 7, -1, onShowCommand, NULL}
+//Metadata of the supported commands, indexed by type
+static const RedisCommand _redisCommand[] = {
+    {"APPEND", 6, RedisCommand::APPEND, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"BITCOUNT", 8, RedisCommand::BITCOUNT, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -2, RedisCommand::ReplySmall},
+    {"BITPOS", 6, RedisCommand::BITPOS, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"DUMP", 4, RedisCommand::DUMP, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplyValue},
+    {"DEL", 3, RedisCommand::DEL, onMultiKeyCommand, NULL,
+        RedisCommand::Write|RedisCommand::MultiKey, 1, -1, 1, -2, RedisCommand::ReplySmall},
+    {"DECR", 4, RedisCommand::DECR, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"DECRBY", 6, RedisCommand::DECRBY, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"EXPIREAT", 8, RedisCommand::EXPIREAT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"EXISTS", 6, RedisCommand::EXISTS, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -2, RedisCommand::ReplySmall},
+    {"EXPIRE", 6, RedisCommand::EXPIRE, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"GET", 3, RedisCommand::GET, onStandardKeyCommand, NULL,
+        RedisCommand::Read|RedisCommand::Cacheable, 1, 1, 1, 2, RedisCommand::ReplyValue},
+    {"GETBIT", 6, RedisCommand::GETBIT, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"GETRANGE", 8, RedisCommand::GETRANGE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 4, RedisCommand::ReplyValue},
+    {"GETSET", 6, RedisCommand::GETSET, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplyValue},
+    {"HSET", 4, RedisCommand::HSET, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -4, RedisCommand::ReplySmall},
+    {"HSETNX", 6, RedisCommand::HSETNX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"HMSET", 5, RedisCommand::HMSET, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -4, RedisCommand::ReplySmall},
+    {"HGET", 4, RedisCommand::HGET, onStandardKeyCommand, NULL,
+        RedisCommand::Read|RedisCommand::Cacheable, 1, 1, 1, 3, RedisCommand::ReplyValue},
+    {"HMGET", 5, RedisCommand::HMGET, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -3, RedisCommand::ReplyPerArgument},
+    {"HINCRBY", 7, RedisCommand::HINCRBY, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"HEXISTS", 7, RedisCommand::HEXISTS, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"HLEN", 4, RedisCommand::HLEN, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"HDEL", 4, RedisCommand::HDEL, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"HKEYS", 5, RedisCommand::HKEYS, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplyCollection},
+    {"HVALS", 5, RedisCommand::HVALS, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplyCollection},
+    {"HGETALL", 7, RedisCommand::HGETALL, onStandardKeyCommand, NULL,
+        RedisCommand::Read|RedisCommand::Cacheable, 1, 1, 1, 2, RedisCommand::ReplyCollection},
+    {"HINCRBYFLOAT", 12, RedisCommand::HINCRBYFLOAT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplyValue},
+    {"INCR", 4, RedisCommand::INCR, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"INCRBY", 6, RedisCommand::INCRBY, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"INCRBYFLOAT", 11, RedisCommand::INCRBYFLOAT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplyValue},
+
+    {"LPUSH", 5, RedisCommand::LPUSH, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"LPUSHX", 6, RedisCommand::LPUSHX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"LPOP", 4, RedisCommand::LPOP, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -2, RedisCommand::ReplyValue},
+    {"LRANGE", 6, RedisCommand::LRANGE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 4, RedisCommand::ReplyCollection},
+    {"LREM", 4, RedisCommand::LREM, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"LINDEX", 6, RedisCommand::LINDEX, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplyValue},
+    {"LINSERT", 7, RedisCommand::LINSERT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 5, RedisCommand::ReplySmall},
+    {"LLEN", 4, RedisCommand::LLEN, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"LSET", 4, RedisCommand::LSET, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"LTRIM", 5, RedisCommand::LTRIM, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+
+    {"MGET", 4, RedisCommand::MGET, onMultiKeyCommand, NULL,
+        RedisCommand::Read|RedisCommand::MultiKey, 1, -1, 1, -2, RedisCommand::ReplyPerArgument},
+    {"MSET", 4, RedisCommand::MSET, onMultiKeyCommand, NULL,
+        RedisCommand::Write|RedisCommand::MultiKey, 1, -1, 2, -3, RedisCommand::ReplySmall},
+    {"MSETNX", 6, RedisCommand::MSETNX, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, -1, 2, -3, RedisCommand::ReplySmall},
+
+    {"PSETEX", 6, RedisCommand::PSETEX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"PERSIST", 7, RedisCommand::PERSIST, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"PEXPIRE", 7, RedisCommand::PEXPIRE, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"PEXPIREAT", 9, RedisCommand::PEXPIREAT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"PTTL", 4, RedisCommand::PTTL, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"PING", 4, RedisCommand::PING, onPingCommand, NULL,
+        RedisCommand::Read, 0, 0, 0, -1, RedisCommand::ReplySmall},
+
+    {"RESTORE", 7, RedisCommand::RESTORE, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -4, RedisCommand::ReplySmall},
+    {"RENAME", 6, RedisCommand::RENAME, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, 2, 1, 3, RedisCommand::ReplySmall},
+    {"RENAMENX", 8, RedisCommand::RENAMENX, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, 2, 1, 3, RedisCommand::ReplySmall},
+    {"RPOP", 4, RedisCommand::RPOP, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -2, RedisCommand::ReplyValue},
+    {"RPOPLPUSH", 9, RedisCommand::RPOPLPUSH, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, 2, 1, 3, RedisCommand::ReplyValue},
+    {"RPUSH", 5, RedisCommand::RPUSH, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"RPUSHX", 6, RedisCommand::RPUSHX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+
+    {"SADD", 4, RedisCommand::SADD, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"SMEMBERS", 8, RedisCommand::SMEMBERS, onStandardKeyCommand, NULL,
+        RedisCommand::Read|RedisCommand::Cacheable, 1, 1, 1, 2, RedisCommand::ReplyCollection},
+    {"SREM", 4, RedisCommand::SREM, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"SPOP", 4, RedisCommand::SPOP, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -2, RedisCommand::ReplyValue},
+    {"SCARD", 5, RedisCommand::SCARD, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"SISMEMBER", 9, RedisCommand::SISMEMBER, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"SRANDMEMBER", 11, RedisCommand::SRANDMEMBER, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -2, RedisCommand::ReplyValue},
+    {"SMOVE", 5, RedisCommand::SMOVE, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, 2, 1, 4, RedisCommand::ReplySmall},
+    {"SINTER", 6, RedisCommand::SINTER, onSameGroupCommand, NULL,
+        RedisCommand::Read|RedisCommand::SameGroup, 1, -1, 1, -2, RedisCommand::ReplyCollection},
+    {"SINTERSTORE", 11, RedisCommand::SINTERSTORE, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, -1, 1, -3, RedisCommand::ReplySmall},
+    {"SUNION", 6, RedisCommand::SUNION, onSameGroupCommand, NULL,
+        RedisCommand::Read|RedisCommand::SameGroup, 1, -1, 1, -2, RedisCommand::ReplyCollection},
+    {"SUNIONSTORE", 11, RedisCommand::SUNIONSTORE, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, -1, 1, -3, RedisCommand::ReplySmall},
+    {"SDIFF", 5, RedisCommand::SDIFF, onSameGroupCommand, NULL,
+        RedisCommand::Read|RedisCommand::SameGroup, 1, -1, 1, -2, RedisCommand::ReplyCollection},
+    {"SDIFFSTORE", 10, RedisCommand::SDIFFSTORE, onSameGroupCommand, NULL,
+        RedisCommand::Write|RedisCommand::SameGroup, 1, -1, 1, -3, RedisCommand::ReplySmall},
+
+    {"SETBIT", 6, RedisCommand::SETBIT, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"SETRANGE", 8, RedisCommand::SETRANGE, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"STRLEN", 6, RedisCommand::STRLEN, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"SET", 3, RedisCommand::SET, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"SETEX", 5, RedisCommand::SETEX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"SETNX", 5, RedisCommand::SETNX, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 3, RedisCommand::ReplySmall},
+
+    {"TTL", 3, RedisCommand::TTL, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"TYPE", 4, RedisCommand::TYPE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+
+    {"ZADD", 4, RedisCommand::ZADD, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -4, RedisCommand::ReplySmall},
+    {"ZRANGE", 6, RedisCommand::ZRANGE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -4, RedisCommand::ReplyCollection},
+    {"ZREM", 4, RedisCommand::ZREM, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, -3, RedisCommand::ReplySmall},
+    {"ZINCRBY", 7, RedisCommand::ZINCRBY, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplyValue},
+    {"ZRANK", 5, RedisCommand::ZRANK, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"ZREVRANK", 8, RedisCommand::ZREVRANK, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 3, RedisCommand::ReplySmall},
+    {"ZREVRANGE", 9, RedisCommand::ZREVRANGE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -4, RedisCommand::ReplyCollection},
+    {"ZRANGEBYSCORE", 13, RedisCommand::ZRANGEBYSCORE, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, -4, RedisCommand::ReplyCollection},
+    {"ZCOUNT", 6, RedisCommand::ZCOUNT, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"ZCARD", 5, RedisCommand::ZCARD, onStandardKeyCommand, NULL,
+        RedisCommand::Read, 1, 1, 1, 2, RedisCommand::ReplySmall},
+    {"ZREMRANGEBYRANK", 15, RedisCommand::ZREMRANGEBYRANK, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+    {"ZREMRANGEBYSCORE", 16, RedisCommand::ZREMRANGEBYSCORE, onStandardKeyCommand, NULL,
+        RedisCommand::Write, 1, 1, 1, 4, RedisCommand::ReplySmall},
+
+    {"SHOWCMD", 7, -1, onShowCommand, NULL,
+        RedisCommand::Read, 0, 0, 0, 1, RedisCommand::ReplySmall}
 };
 
 const char *RedisCommand::commandName(int type)
@@ -122,8 +227,45 @@ const char *RedisCommand::commandName(int type)
     return "";
 }
 
+const RedisCommand* RedisCommand::command(int type)
+{
+    if (type >= 0 && type < RedisCommand::CMD_COUNT) {
+        return &_redisCommand[type];
+    }
+    return NULL;
+}
+
+//FNV-1a over the name with the letters folded to lower case, so both
+//cases hash alike without converting the name first
+static inline unsigned int commandHash(const char* s, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)(s[i] | 0x20)) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+//Compares a request name with an upper case command name
+static inline bool commandNameEqual(const char* name, const char* s, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        char c = s[i];
+        if (c >= 'a' && c <= 'z') {
+            c += ('A' - 'a');
+        }
+        if (c != name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 RedisCommandTable::RedisCommandTable(void)
 {
+    m_index = NULL;
+    m_indexMask = 0;
+    m_seed = 0;
     registerCommand(_redisCommand, sizeof(_redisCommand) / sizeof(RedisCommand));
 }
 
@@ -133,6 +275,7 @@ RedisCommandTable::~RedisCommandTable(void)
     for (; it != m_cmds.end(); ++it) {
         delete *it;
     }
+    delete []m_index;
 }
 
 RedisCommandTable* RedisCommandTable::instance(void)
@@ -144,42 +287,88 @@ RedisCommandTable* RedisCommandTable::instance(void)
     return table;
 }
 
-int RedisCommandTable::registerCommand(RedisCommand *cmd, int cnt)
+int RedisCommandTable::registerCommand(const RedisCommand *cmd, int cnt)
 {
     int succeed = 0;
     for (int i = 0; i < cnt; ++i) {
-        char* name = cmd[i].name;
-        int len = cmd[i].len;
+        if (findCommand(cmd[i].name, cmd[i].len)) {
+            Logger::log(Logger::Warning, "command %s is already registered", cmd[i].name);
+            continue;
+        }
 
-        for (int j = 0; j < len; ++j) {
+        RedisCommand* val = new RedisCommand(cmd[i]);
+        char* name = val->name;
+        for (int j = 0; j < val->len; ++j) {
             if (name[j] >= 'a' && name[j] <= 'z') {
                 name[j] += ('A' - 'a');
             }
         }
-
-        RedisCommand* val = new RedisCommand(cmd[i]);
         m_cmds.push_back(val);
-        m_cmdMap.insert(StringMap<RedisCommand*>::value_type(String(name, len, true), val));
         ++succeed;
     }
+    //Commands are registered before the proxy serves requests
+    buildIndex();
     return succeed;
 }
 
-void RedisCommandTable::execCommand(char *cmd, int len, ClientPacket *packet)
+void RedisCommandTable::buildIndex(void)
 {
-    //to upper
-    for (int i = 0; i < len; ++i) {
-        if (cmd[i] >= 'a' && cmd[i] <= 'z') {
-            cmd[i] += ('A' - 'a');
+    //A table eight times the command count makes a seed without collision
+    //quick to find
+    unsigned int size = 64;
+    while (size < m_cmds.size() * 8) {
+        size <<= 1;
+    }
+    RedisCommand** index = new RedisCommand*[size];
+    unsigned int seed = 0;
+    for (;; ++seed) {
+        memset(index, 0, sizeof(RedisCommand*) * size);
+        bool collision = false;
+        std::list<RedisCommand*>::iterator it = m_cmds.begin();
+        for (; it != m_cmds.end(); ++it) {
+            RedisCommand* cmd = *it;
+            unsigned int slot = commandHash(cmd->name, cmd->len, seed) & (size - 1);
+            if (index[slot]) {
+                collision = true;
+                break;
+            }
+            index[slot] = cmd;
+        }
+        if (!collision) {
+            break;
         }
     }
 
-    StringMap<RedisCommand*>::iterator it = m_cmdMap.find(String(cmd, len));
-    if (it != m_cmdMap.end()) {
-        RedisCommand* command = it->second;
-        packet->commandType = command->type;
-        command->proc(packet, command->arg);
-    } else {
+    delete []m_index;
+    m_index = index;
+    m_indexMask = size - 1;
+    m_seed = seed;
+}
+
+const RedisCommand* RedisCommandTable::findCommand(const char* cmd, int len) const
+{
+    if (!m_index) {
+        return NULL;
+    }
+    const RedisCommand* command = m_index[commandHash(cmd, len, m_seed) & m_indexMask];
+    if (command && command->len == len && commandNameEqual(command->name, cmd, len)) {
+        return command;
+    }
+    return NULL;
+}
+
+void RedisCommandTable::execCommand(const char *cmd, int len, ClientPacket *packet)
+{
+    const RedisCommand* command = findCommand(cmd, len);
+    if (!command) {
         packet->setFinishedState(ClientPacket::ProtoNotSupport);
+        return;
+    }
+    packet->commandType = command->type;
+    packet->command = command;
+    if (!command->checkArity(packet->recvParseResult.tokenCount)) {
+        packet->setFinishedState(ClientPacket::WrongNumberOfArguments);
+        return;
     }
+    command->proc(packet, command->arg);
 }
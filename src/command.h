@@ -38,10 +38,11 @@ public:
         HEXISTS, HLEN, HDEL, HKEYS, HVALS, HGETALL, HINCRBYFLOAT,
         INCR, INCRBY, INCRBYFLOAT,
         LPUSH, LPUSHX, LPOP, LRANGE, LREM, LINDEX, LINSERT, LLEN, LSET, LTRIM,
-        MGET, MSET,
+        MGET, MSET, MSETNX,
         PSETEX, PERSIST, PEXPIRE, PEXPIREAT, PTTL, PING,
-        RESTORE, RPOP, RPUSH, RPUSHX,
+        RESTORE, RENAME, RENAMENX, RPOP, RPOPLPUSH, RPUSH, RPUSHX,
         SADD, SMEMBERS, SREM, SPOP, SCARD, SISMEMBER, SRANDMEMBER,
+        SMOVE, SINTER, SINTERSTORE, SUNION, SUNIONSTORE, SDIFF, SDIFFSTORE,
         SETBIT, SETRANGE, STRLEN, SET, SETEX, SETNX,
         TTL, TYPE,
         ZADD, ZRANGE, ZREM, ZINCRBY, ZRANK, ZREVRANK, ZREVRANGE,
@@ -50,9 +51,38 @@ public:
     enum {
         CMD_COUNT = ZREMRANGEBYSCORE+1
     };
+    enum Flag {
+        Read = 0x01,        //Does not change the data
+        Write = 0x02,       //Changes the data
+        MultiKey = 0x04,    //Keys may belong to different groups
+        Cacheable = 0x08,   //The reply may be kept by the hot key cache
+        SameGroup = 0x10    //Keys must belong to one group
+    };
+    //Expected size of the reply
+    enum ReplyCost {
+        ReplySmall,         //Status, error or integer
+        ReplyValue,         //One value
+        ReplyPerArgument,   //One value per argument
+        ReplyCollection     //A whole collection or range
+    };
 
 public:
     static const char* commandName(int type);
+    static const RedisCommand* command(int type);
+
+    bool isRead(void) const { return (flags & Read) != 0; }
+    bool isWrite(void) const { return (flags & Write) != 0; }
+    bool isMultiKey(void) const { return (flags & MultiKey) != 0; }
+    bool isCacheable(void) const { return (flags & Cacheable) != 0; }
+    bool isSameGroup(void) const { return (flags & SameGroup) != 0; }
+    //Token index of the last key of a request with tokenCount tokens
+    int lastKeyIndex(int tokenCount) const {
+        return (lastKey < 0 ? tokenCount + lastKey : lastKey);
+    }
+    //Checks the token count of a request, including the command name
+    bool checkArity(int tokenCount) const {
+        return (arity >= 0 ? (arity == 0 || tokenCount == arity) : tokenCount >= -arity);
+    }
 
 public:
     char name[32];
@@ -60,6 +90,12 @@ public:
     int type;
     void (*proc)(ClientPacket*, void*);
     void* arg;
+    int flags;                  //Flag bits
+    int firstKey;               //Token index of the first key, 0 if none
+    int lastKey;                //Token index of the last key, -N for N-th from the end
+    int keyStep;                //Tokens from one key to the next
+    int arity;                  //Token count, -N for at least N, 0 for unchecked
+    int replyCost;              //Expected reply size
 };
 
 class RedisCommandTable
@@ -71,13 +107,23 @@ private:
 public:
     static RedisCommandTable* instance(void);
 
-    int registerCommand(RedisCommand* cmd, int cnt);
-    void execCommand(char* cmd, int len, ClientPacket* packet);
+    int registerCommand(const RedisCommand* cmd, int cnt);
+    void execCommand(const char* cmd, int len, ClientPacket* packet);
+
+    //Finds a command by name ignoring case, NULL if unknown
+    const RedisCommand* findCommand(const char* cmd, int len) const;
 
     const std::list<RedisCommand*>& commands(void) const { return m_cmds; }
 
 private:
-    StringMap<RedisCommand*> m_cmdMap;
+    void buildIndex(void);
+
+private:
+    //Perfect hash over the registered names: every command owns one slot
+    //of m_index, found with the seed that gives no collision
+    RedisCommand** m_index;
+    unsigned int m_indexMask;
+    unsigned int m_seed;
     std::list<RedisCommand*> m_cmds;
 };
 
@@ -17,8 +17,11 @@
 * under the License.
 */
 
+#include <time.h>
+
 #include "util/logger.h"
 #include "eventloop.h"
+#include "timingwheel.h"
 
 Event::Event(void)
 {
@@ -50,6 +53,11 @@ void Event::active(int timeout)
     }
 }
 
+void Event::trigger(short flags)
+{
+    event_active(&m_event, flags, 0);
+}
+
 void Event::remove(void)
 {
     event_del(&m_event);
@@ -68,11 +76,14 @@ EventLoop::EventLoop(void)
 #endif
         b = true;
     }
+    m_index = -1;
     m_event_loop = event_base_new();
+    m_timingWheel = new TimingWheel(this);
 }
 
 EventLoop::~EventLoop(void)
 {
+    delete m_timingWheel;
     if (m_event_loop) {
         event_base_free(m_event_loop);
     }
@@ -87,6 +98,17 @@ void EventLoop::exec(void)
     }
 }
 
+long long EventLoop::monotonicTime(void)
+{
+#ifdef WIN32
+    return (long long)GetTickCount64() * 1000;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 void EventLoop::exit(int timeout)
 {
     if (m_event_loop) {
@@ -155,6 +177,7 @@ void EventLoopThreadPool::start(int size)
     Logger::log(Logger::Message, "Create the thread pool...");
     m_threads = new EventLoopThread[m_size];
     for (int i = 0; i < m_size; ++i) {
+        m_threads[i].eventLoop()->setIndex(i);
         m_threads[i].start();
     }
 
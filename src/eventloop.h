@@ -28,6 +28,7 @@
 #include "util/thread.h"
 
 class EventLoop;
+class TimingWheel;
 class Event
 {
 public:
@@ -43,6 +44,9 @@ public:
     //Active
     void active(int timeout_msec = -1);
 
+    //Run the callback on the next loop iteration without waiting for I/O
+    void trigger(short flags = 0);
+
     //Remove event from event loop
     void remove(void);
 
@@ -61,8 +65,20 @@ public:
     void exec(void);
     void exit(int timeout = -1);
 
+    //Position in the thread pool, -1 if the loop is not a pool thread
+    int index(void) const { return m_index; }
+    void setIndex(int index) { m_index = index; }
+
+    //Monotonic clock in microseconds, only meaningful as a difference
+    static long long monotonicTime(void);
+
+    //Timeouts of the requests and clients served by the loop
+    TimingWheel* timingWheel(void) const { return m_timingWheel; }
+
 private:
+    int m_index;
     event_base* m_event_loop;
+    TimingWheel* m_timingWheel;
     friend class Event;
     EventLoop(const EventLoop&);
     EventLoop& operator=(const EventLoop&);
@@ -0,0 +1,418 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util/logger.h"
+#include "redisproxy.h"
+#include "redisservant.h"
+#include "redisservantgroup.h"
+#include "redis-proxy-config.h"
+#include "hashmigrator.h"
+
+enum {
+    KeyMoved = 0,
+    KeyMissing,
+    KeyFailed
+};
+
+//MIGRATE replies +OK once the key is on the target, +NOKEY if the source
+//doesn't have it
+static int migrateResult(ClientPacket* packet)
+{
+    RedisProtoParseResult& r = packet->sendParseResult;
+    if (packet->finishedState != ClientPacket::RequestFinished ||
+            r.type != RedisProtoParseResult::Status) {
+        return KeyFailed;
+    }
+    if (r.tokens[0].len == 5 && strncasecmp(r.tokens[0].s, "NOKEY", 5) == 0) {
+        return KeyMissing;
+    }
+    return KeyMoved;
+}
+
+static void logMigrateError(ClientPacket* packet, int hashValue)
+{
+    Token& key = packet->recvParseResult.tokens[3];
+    RedisProtoParseResult& r = packet->sendParseResult;
+    if (packet->finishedState == ClientPacket::RequestFinished &&
+            r.type == RedisProtoParseResult::Error) {
+        Logger::log(Logger::Warning, "Failed to move the key '%.*s' of hash value %d: %.*s",
+                    key.len, key.s, hashValue, r.tokens[0].len, r.tokens[0].s);
+    } else {
+        Logger::log(Logger::Warning, "Failed to move the key '%.*s' of hash value %d",
+                    key.len, key.s, hashValue);
+    }
+}
+
+//A request waiting for its key to be moved
+struct KeyMove
+{
+    HashMigrator* migrator;
+    RedisServantGroup* target;
+    ClientPacket* packet;
+};
+
+HashMigrator::HashMigrator(void)
+{
+    m_proxy = NULL;
+    memset(&m_progress, 0, sizeof(m_progress));
+    m_progress.state = Idle;
+    m_progress.hashValue = -1;
+    m_loop = NULL;
+    m_credit = 0;
+    m_pendingRequests = 0;
+    m_scanFinished = false;
+    m_failedInPass = 0;
+    m_nextKey = 0;
+}
+
+HashMigrator::~HashMigrator(void)
+{
+    if (m_loop) {
+        m_timer.remove();
+    }
+}
+
+HashMigrator::StartResult HashMigrator::start(int hashValue, RedisServantGroup* target, int keysPerSecond)
+{
+    m_mutex.lock();
+    if (m_progress.state == Running) {
+        m_mutex.unlock();
+        return Busy;
+    }
+
+    //The source is read under the routing update, a HASHMAPPING may have
+    //moved the hash value since the caller looked
+    RoutingTable* table = m_proxy->beginRoutingUpdate();
+    RedisServantGroup* source = table->hashForGroup(hashValue);
+    if (source == target) {
+        m_proxy->endRoutingUpdate(table);
+        m_mutex.unlock();
+        return SameGroup;
+    }
+    table->setHashForGroup(hashValue, target);
+    table->setMigration(hashValue, source);
+    m_proxy->endRoutingUpdate(table);
+
+    memset(&m_progress, 0, sizeof(m_progress));
+    m_progress.state = Running;
+    m_progress.hashValue = hashValue;
+    m_progress.source = source;
+    m_progress.target = target;
+    m_progress.keysPerSecond = keysPerSecond;
+    m_progress.startTime = time(NULL);
+    m_credit = 0;
+    m_pendingRequests = 0;
+    m_scanFinished = true;
+    m_failedInPass = 0;
+    m_scanKeys.reset();
+    m_nextKey = 0;
+
+    //The work is done by a loop that has connections to the groups
+    EventLoopThreadPool* pool = m_proxy->eventLoopThreadPool();
+    if (pool && pool->size() > 0) {
+        m_loop = pool->thread(0)->eventLoop();
+    } else {
+        m_loop = m_proxy->eventLoop();
+    }
+    m_timer.set(m_loop, -1, EV_PERSIST, onTimer, this);
+    m_timer.active(TickInterval);
+    m_mutex.unlock();
+
+    Logger::log(Logger::Message, "Start moving hash value %d from group '%s' to '%s', %d key(s) per second",
+                hashValue, source->groupName(), target->groupName(), keysPerSecond);
+    return Started;
+}
+
+HashMigrator::Progress HashMigrator::progress(void)
+{
+    m_mutex.lock();
+    Progress progress = m_progress;
+    m_mutex.unlock();
+    progress.keysMovedOnRequest = __atomic_load_n(&m_progress.keysMovedOnRequest, __ATOMIC_RELAXED);
+    return progress;
+}
+
+RedisServant* HashMigrator::activeMaster(RedisServantGroup* group)
+{
+    for (int i = 0; i < group->masterCount(); ++i) {
+        if (group->master(i)->isActived()) {
+            return group->master(i);
+        }
+    }
+    return NULL;
+}
+
+ClientPacket* HashMigrator::createMigratePacket(EventLoop* loop, const char* key, int len,
+                                                RedisServant* target)
+{
+    ClientPacket* packet = new ClientPacket;
+    packet->server = m_proxy;
+    packet->eventLoop = loop;
+
+    const HostAddress& addr = target->redisAddress();
+    char port[16];
+    char timeout[16];
+    int portLen = sprintf(port, "%d", addr.port());
+    int timeoutLen = sprintf(timeout, "%d", (int)MigrateTimeout);
+    IOBuffer& buf = packet->recvBuff;
+    buf.appendFormatString("*7\r\n$7\r\nMIGRATE\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n$%d\r\n",
+                           (int)strlen(addr.ip()), addr.ip(), portLen, port, len);
+    buf.append(key, len);
+    //The source copy always wins: nothing is written to the target before
+    //the key has left the source
+    buf.appendFormatString("\r\n$1\r\n0\r\n$%d\r\n%s\r\n$7\r\nREPLACE\r\n", timeoutLen, timeout);
+    packet->recvParser.parse(buf.data(), buf.size(), &packet->recvParseResult);
+    return packet;
+}
+
+void HashMigrator::moveKeyAndHandle(const char* key, int len, RedisServantGroup* source,
+                                    RedisServantGroup* target, ClientPacket* packet)
+{
+    RedisServant* master = activeMaster(target);
+    if (!master) {
+        m_proxy->sendToGroup(target, packet);
+        return;
+    }
+
+    KeyMove* move = new KeyMove;
+    move->migrator = this;
+    move->target = target;
+    move->packet = packet;
+    ClientPacket* sub = createMigratePacket(packet->eventLoop, key, len, master);
+    sub->finished_func = onKeyMoved;
+    sub->finished_arg = move;
+    //The move takes the place of the request in its pipeline, requests
+    //behind it on the same key are moved and sent after it
+    sub->pipeline = packet->pipeline;
+    m_proxy->sendToGroup(source, sub);
+}
+
+void HashMigrator::onKeyMoved(ClientPacket* sub, void* arg)
+{
+    KeyMove* move = (KeyMove*)arg;
+    HashMigrator* migrator = move->migrator;
+    switch (migrateResult(sub)) {
+    case KeyMoved:
+        __atomic_add_fetch(&migrator->m_progress.keysMovedOnRequest, 1, __ATOMIC_RELAXED);
+        break;
+    case KeyFailed:
+        //The request goes to the target anyway, as it would without the
+        //source
+        logMigrateError(sub, migrator->m_progress.hashValue);
+        break;
+    default:
+        break;
+    }
+    migrator->m_proxy->sendToGroup(move->target, move->packet);
+    delete sub;
+    delete move;
+}
+
+void HashMigrator::onTimer(socket_t, short, void* arg)
+{
+    HashMigrator* migrator = (HashMigrator*)arg;
+    //A step starts once the requests of the last one are answered
+    if (migrator->m_pendingRequests > 0) {
+        return;
+    }
+
+    if (migrator->m_nextKey < migrator->m_scanKeys.tokenCount) {
+        migrator->migrateNextKeys();
+    } else if (!migrator->m_scanFinished) {
+        migrator->scanNextKeys();
+    } else if (migrator->m_progress.passes == 0 || migrator->m_failedInPass > 0) {
+        //Keys that failed to move are found by another scan
+        migrator->m_mutex.lock();
+        ++migrator->m_progress.passes;
+        migrator->m_progress.cursor = 0;
+        migrator->m_mutex.unlock();
+        migrator->m_failedInPass = 0;
+        migrator->m_scanFinished = false;
+        migrator->scanNextKeys();
+    } else {
+        migrator->finish();
+    }
+}
+
+void HashMigrator::scanNextKeys(void)
+{
+    ClientPacket* packet = new ClientPacket;
+    packet->server = m_proxy;
+    packet->eventLoop = m_loop;
+    packet->finished_func = onScanFinished;
+    packet->finished_arg = this;
+
+    char cursor[32];
+    char count[16];
+    int cursorLen = sprintf(cursor, "%llu", m_progress.cursor);
+    int countLen = sprintf(count, "%d", (int)ScanCount);
+    IOBuffer& buf = packet->recvBuff;
+    buf.appendFormatString("*4\r\n$4\r\nSCAN\r\n$%d\r\n%s\r\n$5\r\nCOUNT\r\n$%d\r\n%s\r\n",
+                           cursorLen, cursor, countLen, count);
+    packet->recvParser.parse(buf.data(), buf.size(), &packet->recvParseResult);
+
+    ++m_pendingRequests;
+    m_proxy->sendToGroup(m_progress.source, packet);
+}
+
+void HashMigrator::onScanFinished(ClientPacket* packet, void* arg)
+{
+    HashMigrator* migrator = (HashMigrator*)arg;
+    --migrator->m_pendingRequests;
+    if (!migrator->readScanReply(packet)) {
+        //The same cursor is asked again
+        migrator->m_mutex.lock();
+        ++migrator->m_progress.scanErrors;
+        migrator->m_mutex.unlock();
+        Logger::log(Logger::Warning, "Failed to scan the group '%s' for hash value %d",
+                    migrator->m_progress.source->groupName(), migrator->m_progress.hashValue);
+    }
+    delete packet;
+}
+
+//The reply holds the next cursor and the keys. The keys are kept as the
+//tokens of a copy of the reply, those of other hash values are dropped
+bool HashMigrator::readScanReply(ClientPacket* packet)
+{
+    if (packet->finishedState != ClientPacket::RequestFinished) {
+        return false;
+    }
+
+    m_scanReply.clear();
+    m_scanReply.append(packet->sendBuff);
+    char* s = m_scanReply.data();
+    char* end = s + m_scanReply.size();
+    if (end - s < 5 || memcmp(s, "*2\r\n$", 5) != 0) {
+        return false;
+    }
+    int cursorLen = atoi(s + 5);
+    char* p = (char*)memchr(s + 5, '\n', end - s - 5);
+    if (!p || cursorLen <= 0 || end - p - 1 < cursorLen + 2) {
+        return false;
+    }
+    ++p;
+    unsigned long long cursor = strtoull(p, NULL, 10);
+    p += cursorLen + 2;
+
+    m_scanKeys.reset();
+    if (RedisProto::parse(p, (int)(end - p), &m_scanKeys) != RedisProto::ProtoOK ||
+            m_scanKeys.type != RedisProtoParseResult::MultiBulk) {
+        m_scanKeys.reset();
+        return false;
+    }
+
+    const RoutingTable* table = m_proxy->routingTable();
+    int scanned = m_scanKeys.tokenCount;
+    int count = 0;
+    for (int i = 0; i < scanned; ++i) {
+        Token& key = m_scanKeys.tokens[i];
+        if (m_proxy->hashValue(key.s, key.len) == m_progress.hashValue &&
+                table->keyForGroup(key.s, key.len) == NULL) {
+            m_scanKeys.tokens[count++] = key;
+        }
+    }
+    m_scanKeys.tokenCount = count;
+    m_nextKey = 0;
+    if (cursor == 0) {
+        m_scanFinished = true;
+    }
+
+    m_mutex.lock();
+    m_progress.cursor = cursor;
+    m_progress.scannedKeys += scanned;
+    m_mutex.unlock();
+    return true;
+}
+
+void HashMigrator::migrateNextKeys(void)
+{
+    //Each step may move the keys of its interval, a rate below a key per
+    //step moves one every few steps
+    m_credit += m_progress.keysPerSecond * TickInterval;
+    int count = m_credit / 1000;
+    m_credit -= count * 1000;
+
+    RedisServant* target = activeMaster(m_progress.target);
+    while (m_nextKey < m_scanKeys.tokenCount && count > 0) {
+        Token& key = m_scanKeys.tokens[m_nextKey++];
+        --count;
+        if (!target) {
+            m_mutex.lock();
+            ++m_progress.failedKeys;
+            m_mutex.unlock();
+            ++m_failedInPass;
+            continue;
+        }
+        ClientPacket* packet = createMigratePacket(m_loop, key.s, key.len, target);
+        packet->finished_func = onMigrateFinished;
+        packet->finished_arg = this;
+        ++m_pendingRequests;
+        m_proxy->sendToGroup(m_progress.source, packet);
+    }
+}
+
+void HashMigrator::onMigrateFinished(ClientPacket* packet, void* arg)
+{
+    HashMigrator* migrator = (HashMigrator*)arg;
+    --migrator->m_pendingRequests;
+    int result = migrateResult(packet);
+    migrator->m_mutex.lock();
+    switch (result) {
+    case KeyMoved:
+        ++migrator->m_progress.movedKeys;
+        break;
+    case KeyMissing:
+        ++migrator->m_progress.missingKeys;
+        break;
+    default:
+        ++migrator->m_progress.failedKeys;
+        break;
+    }
+    migrator->m_mutex.unlock();
+    if (result == KeyFailed) {
+        ++migrator->m_failedInPass;
+        logMigrateError(packet, migrator->m_progress.hashValue);
+    }
+    delete packet;
+}
+
+void HashMigrator::finish(void)
+{
+    m_timer.remove();
+    RoutingTable* table = m_proxy->beginRoutingUpdate();
+    table->clearMigration();
+    m_proxy->endRoutingUpdate(table);
+    m_scanReply.clear();
+    m_scanKeys.clear();
+
+    m_mutex.lock();
+    m_progress.state = Finished;
+    m_progress.finishTime = time(NULL);
+    m_mutex.unlock();
+    Logger::log(Logger::Message, "Hash value %d has been moved to group '%s', %llu key(s) moved",
+                m_progress.hashValue, m_progress.target->groupName(),
+                m_progress.movedKeys + __atomic_load_n(&m_progress.keysMovedOnRequest, __ATOMIC_RELAXED));
+    //The saved state no longer names the source
+    CRedisProxyCfg::instance()->saveProxyLastState(m_proxy);
+}
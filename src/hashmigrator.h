@@ -0,0 +1,136 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#ifndef HASHMIGRATOR_H
+#define HASHMIGRATOR_H
+
+#include <time.h>
+
+#include "util/locker.h"
+#include "eventloop.h"
+#include "redisproto.h"
+
+class ClientPacket;
+class RedisProxy;
+class RedisServant;
+class RedisServantGroup;
+
+//Moves the keys of one hash value to another group while the proxy runs.
+//The hash value is mapped to the target at once and keeps the old group as
+//its migration source. A request on one of its keys first asks the source
+//to MIGRATE the key, then goes to the target, so a key is always read and
+//written where it is. In the background the source is SCANned and its
+//keys of the hash value are MIGRATEd at a limited rate. When a whole scan
+//moved every key found, the source is dropped from the routing table.
+//The saved state keeps the source until then, a proxy restarted in the
+//middle starts the migration over.
+//Keys written to the source behind the proxy (by another proxy or by a
+//client of redis) during the migration are not looked after
+class HashMigrator
+{
+public:
+    enum State {
+        Idle = 0,
+        Running,
+        Finished
+    };
+
+    enum {
+        DefaultKeysPerSecond = 1000,
+        MaxKeysPerSecond = 1000000,     //Keeps the credit of a step in an int
+        ScanCount = 1000,           //Keys asked per SCAN
+        TickInterval = 100,         //Milliseconds between two steps
+        MigrateTimeout = 5000       //Milliseconds redis waits for the target
+    };
+
+    enum StartResult {
+        Started = 0,
+        Busy,                       //Another hash value is being migrated
+        SameGroup                   //The hash value is already in the target
+    };
+
+    struct Progress
+    {
+        int state;
+        int hashValue;
+        RedisServantGroup* source;
+        RedisServantGroup* target;
+        int keysPerSecond;
+        time_t startTime;
+        time_t finishTime;
+        int passes;                 //Scans of the source started
+        unsigned long long cursor;
+        unsigned long long scannedKeys;
+        unsigned long long movedKeys;
+        unsigned long long missingKeys;     //Gone before they were moved
+        unsigned long long failedKeys;
+        unsigned long long scanErrors;
+        unsigned long long keysMovedOnRequest;
+    };
+
+    HashMigrator(void);
+    ~HashMigrator(void);
+
+    void setProxy(RedisProxy* p) { m_proxy = p; }
+    RedisProxy* proxy(void) const { return m_proxy; }
+
+    //Maps the hash value to the target and starts moving its keys. Fails
+    //if a migration is running or the hash value is already in the target
+    StartResult start(int hashValue, RedisServantGroup* target, int keysPerSecond);
+    Progress progress(void);
+
+    //Sends the request to the group once its key has been moved there
+    //from the migration source
+    void moveKeyAndHandle(const char* key, int len, RedisServantGroup* source,
+                          RedisServantGroup* target, ClientPacket* packet);
+
+private:
+    void scanNextKeys(void);
+    void migrateNextKeys(void);
+    bool readScanReply(ClientPacket* packet);
+    void finish(void);
+    ClientPacket* createMigratePacket(EventLoop* loop, const char* key, int len,
+                                      RedisServant* target);
+    static RedisServant* activeMaster(RedisServantGroup* group);
+    static void onTimer(socket_t, short, void* arg);
+    static void onScanFinished(ClientPacket* packet, void* arg);
+    static void onMigrateFinished(ClientPacket* packet, void* arg);
+    static void onKeyMoved(ClientPacket* packet, void* arg);
+
+private:
+    RedisProxy* m_proxy;
+    Mutex m_mutex;                  //Guards m_progress
+    Progress m_progress;
+    EventLoop* m_loop;              //Loop the background work runs in
+    Event m_timer;
+    int m_credit;                   //Thousandths of keys that may be moved
+    int m_pendingRequests;          //SCAN or MIGRATE requests in flight
+    bool m_scanFinished;
+    unsigned long long m_failedInPass;
+    IOBuffer m_scanReply;           //Keys of the last SCAN reply
+    RedisProtoParseResult m_scanKeys;
+    int m_nextKey;
+
+private:
+    HashMigrator(const HashMigrator&);
+    HashMigrator& operator =(const HashMigrator&);
+};
+
+#endif
@@ -0,0 +1,437 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#include <limits.h>
+
+#include "eventloop.h"
+#include "redisproxy.h"
+#include "hotkeycache.h"
+
+//A reply of one command on the key. The arguments after the key are kept
+//to tell apart the replies of HGET on different fields
+struct HotKeyCache::CachedReply
+{
+    CachedReply* next;
+    int commandType;
+    int argsSize;           //Arguments after the key, each behind its length
+    int replySize;
+    long long expireTime;   //Milliseconds
+    char* data;             //Arguments followed by the reply
+};
+
+struct HotKeyCache::CacheEntry
+{
+    const String* key;      //Key of the map node
+    CachedReply* replies;
+    CacheEntry* prev;       //LRU list, the most recently used first
+    CacheEntry* next;
+    int memory;
+};
+
+struct HotKeyCache::Shard
+{
+    SpinLocker lock;
+    StringMap<CacheEntry*> entries;
+    CacheEntry* head;
+    CacheEntry* tail;
+    long long memory;
+    long long maxMemory;
+    //Reads counted in the current second, for the detection of hot keys
+    long long windowStart;
+    unsigned int sketch[SketchDepth][SketchWidth];
+    //Bumped by each write on a key of the slot. A reply read before the
+    //write finished is not stored
+    unsigned int generations[GenerationSlots];
+    Stats stats;
+};
+
+static const unsigned int SketchSeeds[HotKeyCache::SketchDepth] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+};
+
+static int argumentsSize(const RedisProtoParseResult& r, int first)
+{
+    int size = 0;
+    for (int i = first + 1; i < r.tokenCount; ++i) {
+        size += (int)sizeof(int) + r.tokens[i].len;
+    }
+    return size;
+}
+
+static void copyArguments(const RedisProtoParseResult& r, int first, char* out)
+{
+    for (int i = first + 1; i < r.tokenCount; ++i) {
+        const Token& token = r.tokens[i];
+        memcpy(out, &token.len, sizeof(int));
+        memcpy(out + sizeof(int), token.s, token.len);
+        out += sizeof(int) + token.len;
+    }
+}
+
+static bool sameArguments(const char* data, int size, const RedisProtoParseResult& r, int first)
+{
+    if (argumentsSize(r, first) != size) {
+        return false;
+    }
+    for (int i = first + 1; i < r.tokenCount; ++i) {
+        const Token& token = r.tokens[i];
+        int len;
+        memcpy(&len, data, sizeof(int));
+        if (len != token.len || memcmp(data + sizeof(int), token.s, len) != 0) {
+            return false;
+        }
+        data += sizeof(int) + len;
+    }
+    return true;
+}
+
+HotKeyCache::HotKeyCache(void)
+{
+    for (int i = 0; i < ShardCount; ++i) {
+        Shard* s = new Shard;
+        s->head = NULL;
+        s->tail = NULL;
+        s->memory = 0;
+        s->maxMemory = 0;
+        s->windowStart = 0;
+        memset(s->sketch, 0, sizeof(s->sketch));
+        memset(s->generations, 0, sizeof(s->generations));
+        memset(&s->stats, 0, sizeof(s->stats));
+        m_shards[i] = s;
+    }
+    m_ttl = DefaultTTL;
+    m_hotThreshold = DefaultHotThreshold;
+    setMaxMemory((long long)DefaultMaxMemory * 1024 * 1024);
+}
+
+HotKeyCache::~HotKeyCache(void)
+{
+    for (int i = 0; i < ShardCount; ++i) {
+        Shard* s = m_shards[i];
+        while (s->head) {
+            removeEntry(s, s->head);
+        }
+        delete s;
+    }
+}
+
+void HotKeyCache::setMaxMemory(long long bytes)
+{
+    m_maxMemory = bytes;
+    for (int i = 0; i < ShardCount; ++i) {
+        m_shards[i]->maxMemory = bytes / ShardCount;
+    }
+}
+
+void HotKeyCache::addHotKey(const char* key, int len)
+{
+    if (key && len > 0) {
+        m_hotKeys.insert(StringMap<bool>::value_type(String(key, len, true), true));
+    }
+}
+
+bool HotKeyCache::handleRequest(const char* key, int len, ClientPacket* packet)
+{
+    const RedisCommand* command = packet->command;
+    if (command->isWrite()) {
+        invalidateKeys(packet);
+        packet->cacheState = Invalidate;
+        return false;
+    }
+    if (!command->isCacheable()) {
+        return false;
+    }
+
+    RedisProtoParseResult& r = packet->recvParseResult;
+    unsigned int hash = hashForBytes(key, len);
+    long long now = EventLoop::monotonicTime() / 1000;
+    Shard* s = shard(hash);
+    s->lock.lock();
+    StringMap<CacheEntry*>::iterator it = s->entries.find(String(key, len));
+    if (it != s->entries.end()) {
+        CacheEntry* entry = it->second;
+        CachedReply** link = &entry->replies;
+        while (*link) {
+            CachedReply* reply = *link;
+            if (reply->commandType != command->type ||
+                    !sameArguments(reply->data, reply->argsSize, r, command->firstKey)) {
+                link = &reply->next;
+                continue;
+            }
+            if (reply->expireTime > now) {
+                packet->sendBuff.append(reply->data + reply->argsSize, reply->replySize);
+                touchEntry(s, entry);
+                ++s->stats.hits;
+                s->lock.unlock();
+                return true;
+            }
+
+            //Expired, the reply is read again
+            removeReply(s, entry, link);
+            if (!entry->replies) {
+                removeEntry(s, entry);
+            }
+            break;
+        }
+    }
+
+    ++s->stats.misses;
+    if (isHot(s, key, len, hash, now)) {
+        packet->cacheState = StoreReply;
+        packet->cacheGeneration = s->generations[hash % GenerationSlots];
+    }
+    s->lock.unlock();
+    return false;
+}
+
+void HotKeyCache::requestFinished(ClientPacket* packet, bool ok)
+{
+    int state = packet->cacheState;
+    packet->cacheState = None;
+    switch (state) {
+    case Invalidate:
+        //Replies read while the write was in flight may hold the old value
+        invalidateKeys(packet);
+        break;
+    case StoreReply:
+        if (ok) {
+            storeReply(packet);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void HotKeyCache::invalidate(const char* key, int len)
+{
+    unsigned int hash = hashForBytes(key, len);
+    Shard* s = shard(hash);
+    s->lock.lock();
+    ++s->generations[hash % GenerationSlots];
+    StringMap<CacheEntry*>::iterator it = s->entries.find(String(key, len));
+    if (it != s->entries.end()) {
+        removeEntry(s, it->second);
+        ++s->stats.invalidations;
+    }
+    s->lock.unlock();
+}
+
+HotKeyCache::Stats HotKeyCache::stats(void)
+{
+    Stats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < ShardCount; ++i) {
+        Shard* s = m_shards[i];
+        s->lock.lock();
+        total.hits += s->stats.hits;
+        total.misses += s->stats.misses;
+        total.stores += s->stats.stores;
+        total.invalidations += s->stats.invalidations;
+        total.evictions += s->stats.evictions;
+        total.memory += s->memory;
+        total.keys += (int)s->entries.size();
+        s->lock.unlock();
+    }
+    return total;
+}
+
+//Called with the shard locked
+bool HotKeyCache::isHot(Shard* s, const char* key, int len, unsigned int hash, long long now)
+{
+    if (!m_hotKeys.empty() && m_hotKeys.find(String(key, len)) != m_hotKeys.end()) {
+        return true;
+    }
+    if (m_hotThreshold <= 0) {
+        return false;
+    }
+
+    //Count-min sketch of the reads, cleared every second
+    if (now - s->windowStart >= 1000) {
+        memset(s->sketch, 0, sizeof(s->sketch));
+        s->windowStart = now;
+    }
+    unsigned int count = UINT_MAX;
+    for (int i = 0; i < SketchDepth; ++i) {
+        unsigned int index = ((hash ^ (hash >> 16)) * SketchSeeds[i]) >> 22;
+        unsigned int n = ++s->sketch[i][index % SketchWidth];
+        if (n < count) {
+            count = n;
+        }
+    }
+    return count >= (unsigned int)m_hotThreshold;
+}
+
+void HotKeyCache::invalidateKeys(ClientPacket* packet)
+{
+    const RedisCommand* command = packet->command;
+    RedisProtoParseResult& r = packet->recvParseResult;
+    int first = command->firstKey;
+    if (first <= 0) {
+        return;
+    }
+    int last = command->lastKeyIndex(r.tokenCount);
+    int step = (command->keyStep > 0 ? command->keyStep : 1);
+    for (int i = first; i <= last && i < r.tokenCount; i += step) {
+        invalidate(r.tokens[i].s, r.tokens[i].len);
+    }
+}
+
+void HotKeyCache::storeReply(ClientPacket* packet)
+{
+    const RedisCommand* command = packet->command;
+    RedisProtoParseResult& r = packet->recvParseResult;
+    int len = packet->sendParseResult.protoBuffLen;
+    int offset = packet->sendBufferOffset - len;
+    if (len <= 0 || len > MaxReplySize || offset < 0 || offset + len > packet->sendBuff.size()) {
+        return;
+    }
+    char type;
+    packet->sendBuff.copy(offset, &type, 1);
+    if (type == '-') {
+        return;
+    }
+
+    //The reply is copied before the shard is locked
+    int first = command->firstKey;
+    CachedReply* reply = new CachedReply;
+    reply->next = NULL;
+    reply->commandType = command->type;
+    reply->argsSize = argumentsSize(r, first);
+    reply->replySize = len;
+    reply->expireTime = EventLoop::monotonicTime() / 1000 + m_ttl;
+    reply->data = new char[reply->argsSize + len];
+    copyArguments(r, first, reply->data);
+    packet->sendBuff.copy(offset, reply->data + reply->argsSize, len);
+    int memory = (int)sizeof(CachedReply) + reply->argsSize + len;
+
+    Token& key = r.tokens[first];
+    unsigned int hash = hashForBytes(key.s, key.len);
+    Shard* s = shard(hash);
+    s->lock.lock();
+    if (s->generations[hash % GenerationSlots] != packet->cacheGeneration) {
+        s->lock.unlock();
+        delete []reply->data;
+        delete reply;
+        return;
+    }
+
+    CacheEntry* entry;
+    StringMap<CacheEntry*>::iterator it = s->entries.find(String(key.s, key.len));
+    if (it != s->entries.end()) {
+        entry = it->second;
+        //A reply stored by another request of the same command is replaced
+        CachedReply** link = &entry->replies;
+        while (*link) {
+            CachedReply* old = *link;
+            if (old->commandType == reply->commandType && old->argsSize == reply->argsSize &&
+                    memcmp(old->data, reply->data, reply->argsSize) == 0) {
+                removeReply(s, entry, link);
+                break;
+            }
+            link = &old->next;
+        }
+        touchEntry(s, entry);
+    } else {
+        entry = new CacheEntry;
+        it = s->entries.insert(StringMap<CacheEntry*>::value_type(String(key.s, key.len, true), entry)).first;
+        entry->key = &it->first;
+        entry->replies = NULL;
+        entry->memory = (int)sizeof(CacheEntry) + key.len;
+        entry->prev = NULL;
+        entry->next = s->head;
+        if (s->head) {
+            s->head->prev = entry;
+        } else {
+            s->tail = entry;
+        }
+        s->head = entry;
+        s->memory += entry->memory;
+    }
+
+    reply->next = entry->replies;
+    entry->replies = reply;
+    entry->memory += memory;
+    s->memory += memory;
+    ++s->stats.stores;
+    evict(s);
+    s->lock.unlock();
+}
+
+//Called with the shard locked
+void HotKeyCache::touchEntry(Shard* s, CacheEntry* entry)
+{
+    if (entry == s->head) {
+        return;
+    }
+    entry->prev->next = entry->next;
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        s->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = s->head;
+    s->head->prev = entry;
+    s->head = entry;
+}
+
+//Called with the shard locked
+void HotKeyCache::removeReply(Shard* s, CacheEntry* entry, CachedReply** link)
+{
+    CachedReply* reply = *link;
+    *link = reply->next;
+    int memory = (int)sizeof(CachedReply) + reply->argsSize + reply->replySize;
+    entry->memory -= memory;
+    s->memory -= memory;
+    delete []reply->data;
+    delete reply;
+}
+
+//Called with the shard locked
+void HotKeyCache::removeEntry(Shard* s, CacheEntry* entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        s->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        s->tail = entry->prev;
+    }
+
+    while (entry->replies) {
+        removeReply(s, entry, &entry->replies);
+    }
+    s->memory -= entry->memory;
+    s->entries.erase(s->entries.find(*entry->key));
+    delete entry;
+}
+
+//Called with the shard locked
+void HotKeyCache::evict(Shard* s)
+{
+    while (s->memory > s->maxMemory && s->tail) {
+        removeEntry(s, s->tail);
+        ++s->stats.evictions;
+    }
+}
@@ -0,0 +1,117 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#ifndef HOTKEYCACHE_H
+#define HOTKEYCACHE_H
+
+#include "util/hash.h"
+#include "util/locker.h"
+
+class ClientPacket;
+
+//Replies of read commands (GET, HGET, HGETALL, SMEMBERS) on hot keys kept
+//in the proxy. A key is hot when it is configured or read more than the
+//threshold in one second. Entries live for the TTL and are dropped when a
+//write on the key passes through the proxy. The keys are spread over
+//shards, each with its own lock, LRU list and share of the memory bound
+class HotKeyCache
+{
+public:
+    enum {
+        ShardCount = 16,
+        SketchDepth = 4,
+        SketchWidth = 1024,
+        GenerationSlots = 256,
+        MaxReplySize = 1024 * 64,       //Larger replies are not cached
+
+        DefaultMaxMemory = 64,          //MB
+        DefaultTTL = 1000,              //Milliseconds
+        DefaultHotThreshold = 1000      //Reads of a key per second
+    };
+
+    //Cache work left for the end of a request
+    enum State {
+        None,
+        StoreReply,                     //Store the reply of a hot key
+        Invalidate                      //Drop the keys of a write
+    };
+
+    struct Stats {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long stores;
+        unsigned long long invalidations;
+        unsigned long long evictions;
+        long long memory;
+        int keys;
+    };
+
+    HotKeyCache(void);
+    ~HotKeyCache(void);
+
+    void setMaxMemory(long long bytes);
+    void setTTL(int ms) { m_ttl = ms; }
+    //0 turns the detection off, only the configured keys are cached
+    void setHotThreshold(int reads) { m_hotThreshold = reads; }
+    void addHotKey(const char* key, int len);
+
+    long long maxMemory(void) const { return m_maxMemory; }
+    int ttl(void) const { return m_ttl; }
+    int hotThreshold(void) const { return m_hotThreshold; }
+    int hotKeyCount(void) const { return (int)m_hotKeys.size(); }
+
+    //Called when a request is sent to its group. A cached reply of a read
+    //is appended to the packet and true returned. Otherwise the packet is
+    //marked to store its reply if the key is hot, or to drop its keys
+    //again when the write is finished
+    bool handleRequest(const char* key, int len, ClientPacket* packet);
+    //Called when the request marked by handleRequest is finished
+    void requestFinished(ClientPacket* packet, bool ok);
+
+    void invalidate(const char* key, int len);
+    Stats stats(void);
+
+private:
+    struct CachedReply;
+    struct CacheEntry;
+    struct Shard;
+
+    Shard* shard(unsigned int hash) { return m_shards[hash % ShardCount]; }
+    bool isHot(Shard* s, const char* key, int len, unsigned int hash, long long now);
+    void invalidateKeys(ClientPacket* packet);
+    void storeReply(ClientPacket* packet);
+    void touchEntry(Shard* s, CacheEntry* entry);
+    void removeReply(Shard* s, CacheEntry* entry, CachedReply** link);
+    void removeEntry(Shard* s, CacheEntry* entry);
+    void evict(Shard* s);
+
+private:
+    Shard* m_shards[ShardCount];
+    long long m_maxMemory;
+    int m_ttl;
+    int m_hotThreshold;
+    StringMap<bool> m_hotKeys;          //Configured, read only once serving
+
+private:
+    HotKeyCache(const HotKeyCache&);
+    HotKeyCache& operator =(const HotKeyCache&);
+};
+
+#endif
@@ -76,6 +76,9 @@ void startOneCache(void)
 
     const SHashInfo* sHashInfo = cfg->hashInfo();
     proxy.setMaxHashValue(sHashInfo->hash_value_max);
+    proxy.setHashStrategy(RedisProxy::hashStrategyByName(sHashInfo->hash_strategy));
+    proxy.setHashTag(sHashInfo->hash_tag);
+    proxy.setClientTimeout(cfg->clientTimeout());
 
     const GroupOption* groupOption = cfg->groupOption();
     proxy.setGroupRetryTime(groupOption->group_retry_time);
@@ -88,6 +91,7 @@ void startOneCache(void)
         RedisServantGroup* group = new RedisServantGroup;
         RedisServantGroupPolicy* policy = RedisServantGroupPolicy::createPolicy(info->groupPolicy());
         group->setGroupName(info->groupName());
+        group->setWeight(info->weight());
         group->setPolicy(policy);
 
         const HostInfoList& hostList = info->hosts();
@@ -100,9 +104,20 @@ void startOneCache(void)
             opt.poolSize = hostInfo.get_connectionNum();
             opt.reconnInterval = groupOption->backend_retry_interval;
             opt.maxReconnCount = groupOption->backend_retry_limit;
+            opt.multiplexed = hostInfo.get_multiplex();
+            opt.maxConcurrency = groupOption->backend_max_concurrency;
+            opt.maxLatency = groupOption->backend_max_latency;
+            opt.maxQueueSize = groupOption->backend_queue_size;
+            opt.requestTimeout = groupOption->backend_timeout;
+            opt.queueTimeout = groupOption->backend_queue_timeout;
+            opt.breakerErrorRate = groupOption->breaker_error_rate;
+            opt.breakerMinRequests = groupOption->breaker_min_requests;
+            opt.breakerSlowTime = groupOption->breaker_slow_time;
+            opt.breakerEjectTime = groupOption->breaker_eject_time;
             servant->setOption(opt);
             servant->setRedisAddress(HostAddress(hostInfo.get_ip().c_str(), hostInfo.get_port()));
             servant->setEventLoop(proxy.eventLoop());
+            servant->setEventLoopThreadPool(&pool);
             if (hostInfo.get_master()) {
                 group->addMasterRedisServant(servant);
             } else {
@@ -111,28 +126,71 @@ void startOneCache(void)
         }
         group->setEnabled(true);
         proxy.addRedisGroup(group);
-        for (int i = info->hashMin(); i <= info->hashMax(); ++i) {
-            proxy.setGroupMappingValue(i, group);
+        if (proxy.hashStrategy() == RedisProxy::ModuloHash ||
+                proxy.hashStrategy() == RedisProxy::Crc16Hash) {
+            for (int i = info->hashMin(); i <= info->hashMax(); ++i) {
+                proxy.setGroupMappingValue(i, group);
+            }
         }
+    }
+    proxy.assignHashValues();
 
-        for (int i = 0; i < cfg->hashMapCnt(); ++i) {
-            const CHashMapping* mapping = cfg->hashMapping(i);
-            RedisServantGroup* group = proxy.group(mapping->group_name);
+    //The saved mapping of the last run takes the place of the computed one
+    for (int i = 0; i < cfg->hashMapCnt(); ++i) {
+        const CHashMapping* mapping = cfg->hashMapping(i);
+        RedisServantGroup* group = proxy.group(mapping->group_name);
+        if (group != NULL) {
             proxy.setGroupMappingValue(mapping->hash_value, group);
         }
+    }
 
-        for (int i = 0; i < cfg->keyMapCnt(); ++i) {
-            const CKeyMapping* mapping = cfg->keyMapping(i);
-            RedisServantGroup* group = proxy.group(mapping->group_name);
-            if (group != NULL) {
-                proxy.addGroupKeyMapping(mapping->key, strlen(mapping->key), group);
-            }
+    //A migration stopped by the last run starts over from its source
+    for (int i = 0; i < cfg->hashMapCnt(); ++i) {
+        const CHashMapping* mapping = cfg->hashMapping(i);
+        RedisServantGroup* source = proxy.group(mapping->migrate_from);
+        RedisServantGroup* target = proxy.group(mapping->group_name);
+        if (mapping->migrate_from[0] == 0 || source == NULL || target == NULL) {
+            continue;
+        }
+        int keysPerSecond = mapping->migrate_rate;
+        if (keysPerSecond <= 0) {
+            keysPerSecond = HashMigrator::DefaultKeysPerSecond;
+        }
+        proxy.setGroupMappingValue(mapping->hash_value, source);
+        if (proxy.hashMigrator()->start(mapping->hash_value, target, keysPerSecond) != HashMigrator::Started) {
+            Logger::log(Logger::Warning, "Hash value %d is left in group '%s', its migration can't be resumed",
+                        mapping->hash_value, source->groupName());
+        }
+    }
+
+    for (int i = 0; i < cfg->keyMapCnt(); ++i) {
+        const CKeyMapping* mapping = cfg->keyMapping(i);
+        RedisServantGroup* group = proxy.group(mapping->group_name);
+        if (group != NULL) {
+            proxy.addGroupKeyMapping(mapping->key, strlen(mapping->key), group);
         }
     }
 
     CProxyMonitor monitor;
     proxy.setMonitor(&monitor);
 
+    proxy.setRequestCoalescingEnabled(cfg->requestCoalescingEnable());
+
+    HotKeyCache hotKeyCache;
+    const HotKeyCacheOption* cacheOption = cfg->hotKeyCacheOption();
+    if (cacheOption->enable) {
+        hotKeyCache.setMaxMemory((long long)cacheOption->max_memory * 1024 * 1024);
+        hotKeyCache.setTTL(cacheOption->ttl);
+        hotKeyCache.setHotThreshold(cacheOption->hot_threshold);
+        for (unsigned int i = 0; i < cacheOption->keys.size(); ++i) {
+            const string& key = cacheOption->keys[i];
+            hotKeyCache.addHotKey(key.data(), key.size());
+        }
+        proxy.setHotKeyCache(&hotKeyCache);
+        Logger::log(Logger::Message, "Hot key cache enabled: %dMB, ttl %dms, %d configured keys",
+                    cacheOption->max_memory, cacheOption->ttl, hotKeyCache.hotKeyCount());
+    }
+
     int port = cfg->port();
     if (port <= 0) {
         port = RedisProxy::DefaultPort;
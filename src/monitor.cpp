@@ -34,7 +34,7 @@ CCommandRecorder::CCommandRecorder() {
 CCommandRecorder::~CCommandRecorder(){}
 
 void CCommandRecorder::addCnt(int commandType) {
-    if (commandType >= 0 && commandType <= RedisCommand::CMD_COUNT)
+    if (commandType >= 0 && commandType < RedisCommand::CMD_COUNT)
         ++m_cmdCnt[commandType];
 }
 
@@ -231,44 +231,28 @@ void topKeyProc(ClientPacket* packet, void* arg) {
 }
 
 
+//Registers an admin command, its key and reply metadata left at zero
+static void registerMonitorCommand(const char* name, void (*proc)(ClientPacket*, void*), void* arg) {
+    RedisCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    strcpy(cmd.name, name);
+    cmd.len = strlen(name);
+    cmd.type = -1;
+    cmd.proc = proc;
+    cmd.arg = arg;
+    cmd.replyCost = RedisCommand::ReplySmall;
+    RedisCommandTable::instance()->registerCommand(&cmd, 1);
+}
+
 void CProxyMonitor::proxyStarted(RedisProxy* proxy) {
     m_proxyBeginTime.timmingBegin();
     m_redisProxy = proxy;
 
     // Register command
-    RedisCommand status;
-    strcpy(status.name, STATUS);
-    status.len = strlen(STATUS);
-    status.type = -1;
-    status.proc = statusProc;
-    status.arg = this;
-    RedisCommandTable::instance()->registerCommand(&status, 1);
-
-    RedisCommand outPutStatus;
-    strcpy(outPutStatus.name, OUTPUTSTATUS);
-    outPutStatus.len = strlen(OUTPUTSTATUS);
-    outPutStatus.type = -1;
-    outPutStatus.proc = outPutStatusProc;
-    outPutStatus.arg = this;
-    RedisCommandTable::instance()->registerCommand(&outPutStatus, 1);
-
-    // top key
-    RedisCommand topKey;
-    strcpy(topKey.name, TOPKEY);
-    topKey.len = strlen(TOPKEY);
-    topKey.type = -1;
-    topKey.proc = topKeyProc;
-    topKey.arg = this;
-    RedisCommandTable::instance()->registerCommand(&topKey, 1);
-
-    // top value
-    RedisCommand topValue;
-    strcpy(topValue.name, TOPVALUE);
-    topValue.len = strlen(TOPVALUE);
-    topValue.type = -1;
-    topValue.proc = topValueProc;
-    topValue.arg = this;
-    RedisCommandTable::instance()->registerCommand(&topValue, 1);
+    registerMonitorCommand(STATUS, statusProc, this);
+    registerMonitorCommand(OUTPUTSTATUS, outPutStatusProc, this);
+    registerMonitorCommand(TOPKEY, topKeyProc, this);
+    registerMonitorCommand(TOPVALUE, topValueProc, this);
 
     m_topKeyEnable = CRedisProxyCfg::instance()->topKeyEnable();
     if (m_topKeyEnable) {
@@ -299,11 +283,13 @@ void CProxyMonitor::clientDisconnected(ClientPacket* ) {
 
 
 void CProxyMonitor::replyClientFinished(ClientPacket* packet) {
-    int replySize = packet->sendBuff.size();
-    if (m_topKeyEnable) {
+    int replySize = packet->replySize();
+    //Only requests of a key command have a key to record
+    const RedisCommand* command = packet->command;
+    if (m_topKeyEnable && command && command->firstKey > 0) {
         KeyStrValueSize keyInfo;
-        char* key = packet->recvParseResult.tokens[1].s;
-        int len = packet->recvParseResult.tokens[1].len;
+        char* key = packet->recvParseResult.tokens[command->firstKey].s;
+        int len = packet->recvParseResult.tokens[command->firstKey].len;
         if (len > 0) {
             keyInfo.key = new char[len + 1];
             strncpy(keyInfo.key, key, len);
@@ -336,7 +322,7 @@ void CProxyMonitor::replyClientFinished(ClientPacket* packet) {
     redisRecorder.valueInfo.addBytes(replySize);
     ++redisRecorder.m_AllRequestTimes;
     redisRecorder.addAllReplySize(replySize);
-    redisRecorder.addAllRequestSize(packet->recvBuff.size());
+    redisRecorder.addAllRequestSize(packet->recvParseResult.protoBuffLen);
     redisRecorder.commandRecorder.addCnt(packet->commandType);
     m_backendLock.unlock();
 }
@@ -359,6 +345,24 @@ void CFormatMonitorToIoBuf::formatOneServant(
                                 servant->redisAddress().port(),
                                 servant->option().poolSize,
                                 str, servant->isActived()?"Y":"N");
+    char limit[16] = "-";
+    if (servant->concurrencyLimit() > 0) {
+        sprintf(limit, "%d", servant->concurrencyLimit());
+    }
+    m_iobuf->appendFormatString("%8s%9d%11lld",
+                                limit,
+                                servant->queuedRequestNums(),
+                                servant->rejectedRequests());
+    const CircuitBreaker& breaker = servant->circuitBreaker();
+    const char* breakerState = "-";
+    if (breaker.isEnabled()) {
+        switch (breaker.state()) {
+        case CircuitBreaker::Open: breakerState = "OPEN"; break;
+        case CircuitBreaker::HalfOpen: breakerState = "HALF"; break;
+        default: breakerState = "CLOSED"; break;
+        }
+    }
+    m_iobuf->appendFormatString("%10s%9lld", breakerState, breaker.ejections());
 
     CProxyMonitor::RedisRecorderMap::iterator itMap = mapRedisRec->find(servant);
     if (itMap != mapRedisRec->end()) {
@@ -471,7 +475,7 @@ void CFormatMonitorToIoBuf::formatProxyToIoBuf(CProxyMonitor& proxyMonirot) {
     }
     m_iobuf->append("\n[Backends]\n");
     int groupCnt = proxy->groupCount();
-    m_iobuf->append("[GROUP]                [IP]    [PORT] [CONNPOOL] [MASTER] [ACTIVE]      [REQUESTS]        [RECV SIZE]       [SEND SIZE]    [SEND>1KB]  [SEND>1MB]   [COMMANDS]\n");
+    m_iobuf->append("[GROUP]                [IP]    [PORT] [CONNPOOL] [MASTER] [ACTIVE] [LIMIT] [QUEUED] [REJECTED] [BREAKER] [EJECTS]      [REQUESTS]        [RECV SIZE]       [SEND SIZE]    [SEND>1KB]  [SEND>1MB]   [COMMANDS]\n");
     for (int  i = 0; i < groupCnt; i++) {
         RedisServantGroup* group = proxy->group(i);
         formatServants(proxyMonirot, group);
@@ -54,8 +54,9 @@ void ProxyManager::setGroupTTL(RedisServantGroup* group, int seconds, bool resto
 
     //Update group old hash values
     info->oldHashValues.clear();
+    const RoutingTable* table = m_proxy->routingTable();
     for (int i = 0; i < m_proxy->maxHashValue(); ++i) {
-        if (m_proxy->hashForGroup(i) == group) {
+        if (table->hashForGroup(i) == group) {
             info->oldHashValues.push_back(i);
         }
     }
@@ -71,11 +72,13 @@ void ProxyManager::removeGroup(RedisServantGroup* group)
     std::vector<int> groupOldHashValue;
     std::set<RedisServantGroup*> otherGroups;
     int maxHashValue = m_proxy->maxHashValue();
+    //The hash values of the group move to the others in one update
+    RoutingTable* table = m_proxy->beginRoutingUpdate();
     for (int i = 0; i < maxHashValue; ++i) {
-        RedisServantGroup* mp = m_proxy->hashForGroup(i);
+        RedisServantGroup* mp = table->hashForGroup(i);
         if (mp == group) {
             groupOldHashValue.push_back(i);
-            m_proxy->setGroupMappingValue(i, NULL);
+            table->setHashForGroup(i, NULL);
         } else {
             otherGroups.insert(mp);
         }
@@ -86,6 +89,7 @@ void ProxyManager::removeGroup(RedisServantGroup* group)
     }
 
     if (otherGroups.empty() || groupOldHashValue.empty()) {
+        m_proxy->endRoutingUpdate(table);
         return;
     }
 
@@ -99,8 +103,9 @@ void ProxyManager::removeGroup(RedisServantGroup* group)
     for (int i = 0; itHash != groupOldHashValue.cend(); ++itHash, ++i) {
         int hashval = *itHash;
         RedisServantGroup* group = vec[i % vec.size()];
-        m_proxy->setGroupMappingValue(hashval, group);
+        table->setHashForGroup(hashval, group);
     }
+    m_proxy->endRoutingUpdate(table);
 }
 
 void ProxyManager::onSetGroupTTL(int, short, void* arg)
@@ -130,10 +135,13 @@ void ProxyManager::onRestoreGroup(int, short, void* arg)
     RedisServantGroup* group = info->group;
     if (group->isEnabled()) {
         Logger::log(Logger::Message, "Group '%s' has been restored", info->group->groupName());
+        RedisProxy* proxy = info->manager->proxy();
+        RoutingTable* table = proxy->beginRoutingUpdate();
         std::vector<int>::iterator it = info->oldHashValues.begin();
         for (; it != info->oldHashValues.end(); ++it) {
-            info->manager->proxy()->setGroupMappingValue(*it, group);
+            table->setHashForGroup(*it, group);
         }
+        proxy->endRoutingUpdate(table);
         info->can_ttl = true;
     } else {
         info->ev.active(500);
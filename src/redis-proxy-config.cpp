@@ -60,6 +60,7 @@ CHostInfo::CHostInfo() {
     master = false;
     priority = 0;
     policy = 0;
+    multiplex = false;
 }
 CHostInfo::~CHostInfo(){}
 string CHostInfo::get_ip()const
@@ -76,6 +77,7 @@ bool CHostInfo::get_master()const     { return master;}
 int CHostInfo::get_policy()const      { return policy;}
 int CHostInfo::get_priority()const    { return priority;}
 int CHostInfo::get_connectionNum()const    { return connection_num;}
+bool CHostInfo::get_multiplex()const  { return multiplex;}
 
 void CHostInfo::set_ip(string& s)        { ip = s;}
 void CHostInfo::set_hostName(string& s)  { host_name = s;}
@@ -84,11 +86,15 @@ void CHostInfo::set_master(bool m)       { master = m;}
 void CHostInfo::set_policy(int p)        { policy = p;}
 void CHostInfo::set_priority(int p)      { priority = p;}
 void CHostInfo::set_connectionNum(int p) { connection_num = p;}
+void CHostInfo::set_multiplex(bool m)    { multiplex = m;}
 
 CGroupInfo::CGroupInfo()
 {
     memset(m_groupName, '\0', sizeof(m_groupName));
     memset(m_groupPolicy, '\0', sizeof(m_groupPolicy));
+    m_hashMin = 0;
+    m_hashMax = 0;
+    m_weight = 1;
 }
 
 CGroupInfo::~CGroupInfo() {}
@@ -96,7 +102,10 @@ CGroupInfo::~CGroupInfo() {}
 CRedisProxyCfg::CRedisProxyCfg() {
     m_operateXmlPointer = new COperateXml;
     m_hashInfo.hash_value_max = 0;
+    memset(m_hashInfo.hash_strategy, '\0', sizeof(m_hashInfo.hash_strategy));
+    memset(m_hashInfo.hash_tag, '\0', sizeof(m_hashInfo.hash_tag));
     m_threadNum = 0;
+    m_clientTimeout = 0;
     m_port = 0;
     memset(m_vip.if_alias_name, '\0', sizeof(m_vip.if_alias_name));
     memset(m_vip.vip_address, '\0', sizeof(m_vip.vip_address));
@@ -105,6 +114,7 @@ CRedisProxyCfg::CRedisProxyCfg() {
     m_daemonize = false;
     m_guard = false;
     m_topKeyEnable = false;
+    m_requestCoalescingEnable = true;
     m_hashMappingList = new HashMappingList;
     m_keyMappingList = new KeyMappingList;
     m_groupInfo = new GroupInfoList;
@@ -164,6 +174,10 @@ void CRedisProxyCfg::set_groupAttribute(TiXmlAttribute *groupAttr, CGroupInfo& p
             memcpy(pGroup.m_groupPolicy, value, strlen(value)+1);
             continue;
         }
+        if (0 == strcasecmp(name, "weight")) {
+            pGroup.m_weight = atoi(value);
+            continue;
+        }
     }
 }
 
@@ -202,6 +216,10 @@ void CRedisProxyCfg::set_hostAttribute(TiXmlAttribute *addrAttr, CHostInfo& pHos
             pHostInfo.set_master((atoi(value) != 0));
             continue;
         }
+        if (0 == strcasecmp(name, "multiplex")) {
+            pHostInfo.set_multiplex((atoi(value) != 0));
+            continue;
+        }
     }
 
 }
@@ -247,6 +265,10 @@ void CRedisProxyCfg::set_hostEle(TiXmlElement* hostContactEle, CHostInfo& hostIn
             hostInfo.set_master((atoi(strText) != 0));
             continue;
         }
+        if (0 == strcasecmp(strValue, "multiplex")) {
+            hostInfo.set_multiplex((atoi(strText) != 0));
+            continue;
+        }
     }
 }
 
@@ -260,6 +282,10 @@ void CRedisProxyCfg::getRootAttr(const TiXmlElement* pRootNode) {
             m_threadNum = atoi(value);
             continue;
         }
+        if (0 == strcasecmp(name, "client_timeout")) {
+            m_clientTimeout = atoi(value);
+            continue;
+        }
         if (0 == strcasecmp(name, "port")) {
             m_port = atoi(value);
             continue;
@@ -268,6 +294,14 @@ void CRedisProxyCfg::getRootAttr(const TiXmlElement* pRootNode) {
             m_hashInfo.hash_value_max = atoi(value);
             continue;
         }
+        if (0 == strcasecmp(name, "hash_strategy")) {
+            strncpy(m_hashInfo.hash_strategy, value, sizeof(m_hashInfo.hash_strategy) - 1);
+            continue;
+        }
+        if (0 == strcasecmp(name, "hash_tag")) {
+            strncpy(m_hashInfo.hash_tag, value, sizeof(m_hashInfo.hash_tag) - 1);
+            continue;
+        }
         if (0 == strcasecmp(name, "log_file")) {
             strcpy(m_logFile, value);
             continue;
@@ -325,6 +359,14 @@ void CRedisProxyCfg::setHashMappingNode(TiXmlElement* pNode) {
                 }
                 if (0 == strcasecmp(name, "group_name")) {
                     strcpy(hashMap.group_name, value);
+                    continue;
+                }
+                if (0 == strcasecmp(name, "migrate_from")) {
+                    strcpy(hashMap.migrate_from, value);
+                    continue;
+                }
+                if (0 == strcasecmp(name, "migrate_rate")) {
+                    hashMap.migrate_rate = atoi(value);
                 }
             }
             m_hashMappingList->push_back(hashMap);
@@ -351,6 +393,42 @@ void CRedisProxyCfg::setGroupOption(const TiXmlElement* vidNode) {
             m_groupOption.group_retry_time = atoi(value);
             continue;
         }
+        if (0 == strcasecmp(name, "backend_max_concurrency")) {
+            m_groupOption.backend_max_concurrency = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "backend_max_latency")) {
+            m_groupOption.backend_max_latency = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "backend_queue_size")) {
+            m_groupOption.backend_queue_size = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "backend_timeout")) {
+            m_groupOption.backend_timeout = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "backend_queue_timeout")) {
+            m_groupOption.backend_queue_timeout = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "breaker_error_rate")) {
+            m_groupOption.breaker_error_rate = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "breaker_min_requests")) {
+            m_groupOption.breaker_min_requests = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "breaker_slow_time")) {
+            m_groupOption.breaker_slow_time = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "breaker_eject_time")) {
+            m_groupOption.breaker_eject_time = atoi(value);
+            continue;
+        }
 
         if (0 == strcasecmp(name, "auto_eject_group")) {
             if(strcasecmp(value, "0") != 0 && strcasecmp(value, "") != 0 ) {
@@ -369,6 +447,42 @@ void CRedisProxyCfg::setGroupOption(const TiXmlElement* vidNode) {
 
 
 
+void CRedisProxyCfg::setHotKeyCacheNode(TiXmlElement* pNode) {
+    TiXmlAttribute *addrAttr = pNode->FirstAttribute();
+    for (; addrAttr != NULL; addrAttr = addrAttr->Next()) {
+        const char* name = addrAttr->Name();
+        const char* value = addrAttr->Value();
+        if (value == NULL) value = "";
+        if (0 == strcasecmp(name, "enable")) {
+            if(strcasecmp(value, "0") != 0 && strcasecmp(value, "") != 0 ) {
+                m_hotKeyCacheOption.enable = true;
+            }
+            continue;
+        }
+        if (0 == strcasecmp(name, "max_memory")) {
+            m_hotKeyCacheOption.max_memory = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "ttl")) {
+            m_hotKeyCacheOption.ttl = atoi(value);
+            continue;
+        }
+        if (0 == strcasecmp(name, "hot_threshold")) {
+            m_hotKeyCacheOption.hot_threshold = atoi(value);
+        }
+    }
+
+    TiXmlElement* pNext = pNode->FirstChildElement();
+    for (; pNext != NULL; pNext = pNext->NextSiblingElement()) {
+        if (0 == strcasecmp(pNext->Value(), "key")) {
+            const char* key = pNext->Attribute("key_name");
+            if (key != NULL && key[0] != '\0') {
+                m_hotKeyCacheOption.keys.push_back(key);
+            }
+        }
+    }
+}
+
 void CRedisProxyCfg::setKeyMappingNode(TiXmlElement* pNode) {
     TiXmlElement* pNext = pNode->FirstChildElement();
     for (; pNext != NULL; pNext = pNext->NextSiblingElement()) {
@@ -449,17 +563,30 @@ bool GetNodePointerByName(
 
 
 bool CRedisProxyCfg::saveProxyLastState(RedisProxy* proxy) {
+    m_saveMutex.lock();
     TiXmlElement* pRootNode = (TiXmlElement*)m_operateXmlPointer->get_rootElement();
     string nodeHash = "hash_mapping";
     TiXmlElement* pOldHashMap;
     if (GetNodePointerByName(pRootNode, nodeHash, pOldHashMap)) {
         pRootNode->RemoveChild(pOldHashMap);
     }
+    const RoutingTable* table = proxy->routingTable();
+    HashMigrator::Progress migration = proxy->hashMigrator()->progress();
     TiXmlElement hashMappingNode("hash_mapping");
     for (int i = 0; i < proxy->maxHashValue(); ++i) {
+        RedisServantGroup* group = table->hashForGroup(i);
+        if (group == NULL) {
+            continue;
+        }
         TiXmlElement hashNode("hash");
         hashNode.SetAttribute("value", i);
-        hashNode.SetAttribute("group_name", proxy->hashForGroup(i)->groupName());
+        hashNode.SetAttribute("group_name", group->groupName());
+        //The keys not moved yet are only found with the source
+        RedisServantGroup* source = table->migrationSource(i);
+        if (source != NULL) {
+            hashNode.SetAttribute("migrate_from", source->groupName());
+            hashNode.SetAttribute("migrate_rate", migration.keysPerSecond);
+        }
         hashMappingNode.InsertEndChild(hashNode);
     }
     pRootNode->InsertEndChild(hashMappingNode);
@@ -472,8 +599,8 @@ bool CRedisProxyCfg::saveProxyLastState(RedisProxy* proxy) {
     }
     TiXmlElement keyMappingNode("key_mapping");
 
-    StringMap<RedisServantGroup*>& keyMapping = proxy->keyMapping();
-    StringMap<RedisServantGroup*>::iterator it = keyMapping.begin();
+    const StringMap<RedisServantGroup*>& keyMapping = table->keyMapping();
+    StringMap<RedisServantGroup*>::const_iterator it = keyMapping.begin();
     for (; it != keyMapping.end(); ++it) {
         String key = it->first;
         TiXmlElement keyNode("key");
@@ -497,6 +624,7 @@ bool CRedisProxyCfg::saveProxyLastState(RedisProxy* proxy) {
         current_time->tm_hour);
 
     bool ok = m_operateXmlPointer->m_docPointer->SaveFile(fileName);
+    m_saveMutex.unlock();
     return ok;
 }
 
@@ -535,6 +663,14 @@ bool CRedisProxyCfg::loadCfg(const char* file) {
             continue;
         }
 
+        if (0 == strcasecmp(pNode->Value(), "request_coalescing")) {
+            const char* value = pNode->Attribute("enable");
+            if (value != NULL) {
+                m_requestCoalescingEnable = (strcasecmp(value, "0") != 0 && strcasecmp(value, "") != 0);
+            }
+            continue;
+        }
+
         if (0 == strcasecmp(pNode->Value(), "hash")) {
             TiXmlElement* pNext = pNode->FirstChildElement();
             if (NULL == pNext) continue;
@@ -545,6 +681,20 @@ bool CRedisProxyCfg::loadCfg(const char* file) {
                         continue;
                     }
                     m_hashInfo.hash_value_max = atoi(pNext->GetText());
+                    continue;
+                }
+                if (0 == strcasecmp(pNext->Value(), "hash_strategy")) {
+                    if (pNext->GetText() != NULL) {
+                        strncpy(m_hashInfo.hash_strategy, pNext->GetText(),
+                                sizeof(m_hashInfo.hash_strategy) - 1);
+                    }
+                    continue;
+                }
+                if (0 == strcasecmp(pNext->Value(), "hash_tag")) {
+                    if (pNext->GetText() != NULL) {
+                        strncpy(m_hashInfo.hash_tag, pNext->GetText(),
+                                sizeof(m_hashInfo.hash_tag) - 1);
+                    }
                 }
             }
             continue;
@@ -565,6 +715,16 @@ bool CRedisProxyCfg::loadCfg(const char* file) {
             setKeyMappingNode(pNode);
             continue;
         }
+        if (0 == strcasecmp(pNode->Value(), "hot_key_cache")) {
+            setHotKeyCacheNode(pNode);
+            continue;
+        }
+    }
+
+    //The strategies made for many groups default to the cluster's slot count
+    if (m_hashInfo.hash_value_max == 0 &&
+            RedisProxy::hashStrategyByName(m_hashInfo.hash_strategy) > RedisProxy::ModuloHash) {
+        m_hashInfo.hash_value_max = RedisProxy::MaxHashValue;
     }
 
     return true;
@@ -575,22 +735,47 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
 {
     const int hash_value_max = pCfg->hashInfo()->hash_value_max;
     if (hash_value_max > REDIS_PROXY_HASH_MAX) {
-        errMsg = "hash_value_max is not greater than 1024";
+        errMsg = "hash_value_max is not greater than 16384";
+        return false;
+    }
+
+    int strategy = RedisProxy::hashStrategyByName(pCfg->hashInfo()->hash_strategy);
+    if (strategy < 0) {
+        errMsg = "hash_strategy is wrong, it should be modulo, crc16, jump or ketama";
+        return false;
+    }
+    int tagLen = strlen(pCfg->hashInfo()->hash_tag);
+    if (tagLen != 0 && tagLen != 2) {
+        errMsg = "hash_tag must be two characters, as \"{}\"";
         return false;
     }
 
+    //Jump and ketama assign the hash values themselves
+    bool assigned = (strategy == RedisProxy::JumpHash || strategy == RedisProxy::KetamaHash);
+
     int port = pCfg->port();
     if (port <= 0 || port > 65535) {
         errMsg = "onecache's port is invalid";
         return false;
     }
 
+    const HotKeyCacheOption* cacheOption = pCfg->hotKeyCacheOption();
+    if (cacheOption->enable && (cacheOption->max_memory <= 0 || cacheOption->ttl <= 0)) {
+        errMsg = "hot_key_cache's max_memory and ttl must be greater than 0";
+        return false;
+    }
+
     int thread_num = pCfg->threadNum();
     if (thread_num <= 0) {
         errMsg = "onecache's thread_num is invalid";
         return false;
     }
 
+    if (pCfg->clientTimeout() < 0) {
+        errMsg = "onecache's client_timeout is invalid";
+        return false;
+    }
+
     bool barray[REDIS_PROXY_HASH_MAX] = {0};
     string groupNameBuf[512];
     int groupCnt_ = pCfg->groupCnt();
@@ -606,9 +791,13 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
         }
         if (!empty) {
             if (0 != strcasecmp(group->groupPolicy(), POLICY_READ_BALANCE) &&
-                0 != strcasecmp(group->groupPolicy(), POLICY_MASTER_ONLY))
+                0 != strcasecmp(group->groupPolicy(), POLICY_MASTER_ONLY) &&
+                0 != strcasecmp(group->groupPolicy(), POLICY_LEAST_OUTSTANDING) &&
+                0 != strcasecmp(group->groupPolicy(), POLICY_PEAK_EWMA) &&
+                0 != strcasecmp(group->groupPolicy(), POLICY_P2C))
             {
-                errMsg = "group's policy is wrong, it should be  read_balance or master_only";
+                errMsg = "group's policy is wrong, it should be read_balance, master_only, "
+                         "least_outstanding, peak_ewma or p2c";
                 return false;
             }
         }
@@ -621,6 +810,14 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
             }
         }
 
+        if (group->weight() <= 0) {
+            errMsg = "group's weight must be greater than 0";
+            return false;
+        }
+        if (assigned) {
+            continue;
+        }
+
         if (group->hashMin() > group->hashMax()) {
             errMsg = "hash_min > hash_max";
             return false;
@@ -642,7 +839,11 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
             barray[j] = true;
         }
     }
-    for (int i = 0; i < hash_value_max; ++i) {
+    if (assigned && groupCnt_ == 0) {
+        errMsg = "no group to assign the hash values";
+        return false;
+    }
+    for (int i = 0; !assigned && i < hash_value_max; ++i) {
         if (!barray[i]) {
             errMsg = "hash values are not complete";
             return false;
@@ -660,6 +861,53 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
         return false;
     }
 
+    if (groupOp->backend_max_concurrency < 0) {
+        errMsg = "backend_max_concurrency invalid";
+        return false;
+    }
+
+    if (groupOp->backend_max_latency < 0 ||
+            (groupOp->backend_max_latency > 0 && groupOp->backend_max_concurrency == 0)) {
+        errMsg = "backend_max_latency invalid";
+        return false;
+    }
+
+    if (groupOp->backend_queue_size < 0) {
+        errMsg = "backend_queue_size invalid";
+        return false;
+    }
+
+    if (groupOp->backend_timeout < 0) {
+        errMsg = "backend_timeout invalid";
+        return false;
+    }
+
+    if (groupOp->backend_queue_timeout < 0) {
+        errMsg = "backend_queue_timeout invalid";
+        return false;
+    }
+
+    if (groupOp->breaker_error_rate < 0 || groupOp->breaker_error_rate > 100) {
+        errMsg = "breaker_error_rate invalid";
+        return false;
+    }
+
+    if (groupOp->breaker_min_requests < 0) {
+        errMsg = "breaker_min_requests invalid";
+        return false;
+    }
+
+    if (groupOp->breaker_slow_time < 0) {
+        errMsg = "breaker_slow_time invalid";
+        return false;
+    }
+
+    if (groupOp->breaker_eject_time < 0 ||
+            (groupOp->breaker_eject_time == 0 && groupOp->breaker_error_rate > 0)) {
+        errMsg = "breaker_eject_time invalid";
+        return false;
+    }
+
     if (groupOp->auto_eject_group) {
         if (groupOp->group_retry_time <= 0) {
             errMsg = "group_retry_time invalid";
@@ -685,6 +933,20 @@ bool CRedisProxyCfgChecker::isValid(CRedisProxyCfg* pCfg, const char*& errMsg)
             errMsg = "hash_mapping's group name doesn't exist";
             return false;
         }
+        if (p->migrate_from[0] == 0) {
+            continue;
+        }
+        exist = false;
+        for (int j = 0; j < groupCnt_; ++j) {
+            if (groupNameBuf[j] == p->migrate_from) {
+                exist = true;
+                break;
+            }
+        }
+        if (!exist || p->migrate_rate < 0 || p->migrate_rate > HashMigrator::MaxKeysPerSecond) {
+            errMsg = "hash_mapping's migration invalid";
+            return false;
+        }
     }
 
     int keyMapCnt = pCfg->keyMapCnt();
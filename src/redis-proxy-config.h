@@ -65,6 +65,7 @@ public:
     int get_policy()const;
     int get_priority()const;
     int get_connectionNum()const;
+    bool get_multiplex()const;
 
     void set_ip(string& s);
     void set_hostName(string& s);
@@ -73,6 +74,7 @@ public:
     void set_policy(int p);
     void set_priority(int p);
     void set_connectionNum(int p);
+    void set_multiplex(bool m);
 private:
     string ip;
     string host_name;
@@ -81,12 +83,15 @@ private:
     int priority;
     int policy;
     int connection_num;
+    bool multiplex;
 };
 typedef std::vector<CHostInfo> HostInfoList;
 
 struct SHashInfo {
     // int hash_type;
     int hash_value_max;
+    char hash_strategy[32];
+    char hash_tag[32];
 };
 
 struct SVipInfo {
@@ -101,9 +106,13 @@ public:
     CHashMapping() {
         hash_value = 0;
         memset(group_name, '\0', sizeof(group_name));
+        memset(migrate_from, '\0', sizeof(migrate_from));
+        migrate_rate = 0;
     }
     int  hash_value;
     char group_name[512];
+    char migrate_from[512];     //Group the keys were being moved from, empty if none
+    int  migrate_rate;          //Keys per second of that migration
 };
 typedef std::vector<CHashMapping> HashMappingList;
 
@@ -128,6 +137,7 @@ public:
     const char* groupPolicy() const { return m_groupPolicy; }
     int hashMin()const { return m_hashMin; }
     int hashMax()const { return m_hashMax; }
+    int weight()const { return m_weight; }
     const HostInfoList& hosts() const { return m_hosts; }
     void setGroupPolicy(const char* p) {
         strcpy(m_groupPolicy, p);
@@ -138,6 +148,7 @@ private:
     char          m_groupPolicy[128];
     int           m_hashMin;
     int           m_hashMax;
+    int           m_weight;
     HostInfoList  m_hosts;
     friend class CRedisProxyCfg;
 };
@@ -151,9 +162,27 @@ struct GroupOption {
         group_retry_time = 30;
         auto_eject_group = false;
         eject_after_restore = false;
+        backend_max_concurrency = 0;
+        backend_max_latency = 0;
+        backend_queue_size = 0;
+        backend_timeout = 0;
+        backend_queue_timeout = 0;
+        breaker_error_rate = 0;
+        breaker_min_requests = 20;
+        breaker_slow_time = 0;
+        breaker_eject_time = 5000;
     }
     int  backend_retry_interval;
     int  backend_retry_limit;
+    int  backend_max_concurrency;
+    int  backend_max_latency;
+    int  backend_queue_size;
+    int  backend_timeout;
+    int  backend_queue_timeout;
+    int  breaker_error_rate;
+    int  breaker_min_requests;
+    int  breaker_slow_time;
+    int  breaker_eject_time;
     int  group_retry_time;
     bool auto_eject_group;
     bool eject_after_restore;
@@ -161,6 +190,20 @@ struct GroupOption {
 
 
 
+struct HotKeyCacheOption {
+    HotKeyCacheOption(){
+        enable = false;
+        max_memory = HotKeyCache::DefaultMaxMemory;
+        ttl = HotKeyCache::DefaultTTL;
+        hot_threshold = HotKeyCache::DefaultHotThreshold;
+    }
+    bool enable;
+    int  max_memory;            // MB
+    int  ttl;                   // milliseconds
+    int  hot_threshold;         // reads of a key per second, 0 for the configured keys only
+    vector<string> keys;
+};
+
 // read the config
 class CRedisProxyCfg
 {
@@ -178,13 +221,16 @@ public:
     const CGroupInfo* group(int index)const {return &(*m_groupInfo)[index];}
     const SHashInfo*  hashInfo()const {return &m_hashInfo;}
     const GroupOption* groupOption()const {return &m_groupOption;}
+    const HotKeyCacheOption* hotKeyCacheOption()const {return &m_hotKeyCacheOption;}
     const SVipInfo*  vipInfo()const {return &m_vip;}
     int threadNum()const {return m_threadNum;}
+    int clientTimeout()const {return m_clientTimeout;}
     int port() const {return m_port;}
     const char* logFile(){ return m_logFile; }
     bool daemonize() { return m_daemonize;}
     bool guard() { return m_guard;}
     bool topKeyEnable() { return m_topKeyEnable;}
+    bool requestCoalescingEnable() { return m_requestCoalescingEnable;}
 
     int hashMapCnt(){ return m_hashMappingList->size();}
     int keyMapCnt(){ return m_keyMappingList->size();}
@@ -192,18 +238,22 @@ public:
     const CKeyMapping* keyMapping(int index)const {return &(*m_keyMappingList)[index];}
 private:
     COperateXml*     m_operateXmlPointer;
+    Mutex            m_saveMutex;       //Admin commands of several threads save
     GroupInfoList*   m_groupInfo;
     HashMappingList* m_hashMappingList;
     KeyMappingList*  m_keyMappingList;
     SHashInfo        m_hashInfo;
     SVipInfo         m_vip;
     int              m_threadNum;
+    int              m_clientTimeout;
     int              m_port;
     char             m_logFile[512];
     bool             m_daemonize;
     bool             m_guard;
     bool             m_topKeyEnable;
+    bool             m_requestCoalescingEnable;
     GroupOption      m_groupOption;
+    HotKeyCacheOption m_hotKeyCacheOption;
 private:
     void set_groupName(CGroupInfo& group, const char* name);
     void set_hashMin(CGroupInfo& group, int num);
@@ -219,6 +269,7 @@ private:
     void setHashMappingNode(TiXmlElement* pNode);
     void setKeyMappingNode(TiXmlElement* pNode);
     void setGroupOption(const TiXmlElement* pNode);
+    void setHotKeyCacheNode(TiXmlElement* pNode);
 private:
     CRedisProxyCfg(const CRedisProxyCfg&);
     CRedisProxyCfg& operator =(const CRedisProxyCfg&);
@@ -228,7 +279,7 @@ private:
 class CRedisProxyCfgChecker
 {
 public:
-    enum {REDIS_PROXY_HASH_MAX = 1024};
+    enum {REDIS_PROXY_HASH_MAX = RedisProxy::MaxHashValue};
     CRedisProxyCfgChecker();
     ~CRedisProxyCfgChecker();
     static bool isValid(CRedisProxyCfg* pCfg, const char*& err);
@@ -48,88 +48,33 @@ RedisServant* ServantSelect::selectSlave(RedisServantGroup* group) {
 }
 
 
+//The policy of a group is shared by the loops, the counters are atomic
 RedisServant* ServantSelect::oneMaster(RedisServantGroup* group) {
     int masterCount = group->masterCount();
-    unsigned int callNum = m_masterCallNum;
+    unsigned int callNum = __atomic_fetch_add(&m_masterCallNum, 1, __ATOMIC_RELAXED);
     for (int i = 0; i < masterCount; ++i) {
         RedisServant* servant = group->master(callNum % masterCount);
-        if (servant->isActived())
+        if (servant->isUsable())
             return servant;
         callNum++;
     }
-    m_masterCallNum = callNum;
     return NULL;
 }
 
 RedisServant* ServantSelect::oneSlave(RedisServantGroup* group) {
     int slaveCount = group->slaveCount();
-    unsigned int callNum = m_slaveCallNum;
+    unsigned int callNum = __atomic_fetch_add(&m_slaveCallNum, 1, __ATOMIC_RELAXED);
     for (int i = 0; i < slaveCount; ++i) {
         RedisServant* servant = group->slave(callNum % slaveCount);
-        if (servant->isActived()) {
-            ++m_slaveCallNum;
+        if (servant->isUsable()) {
             return servant;
         }
         ++callNum;
     }
-    m_slaveCallNum = callNum;
     return NULL;
 }
 
 
-static int CommandType[RedisCommand::CMD_COUNT] = {0};
-void initCommandType()
-{
-    for (int i = 0; i < RedisCommand::CMD_COUNT; ++i) {
-        // DUMP DEL DECR DECRBY EXPIREAT EXISTS EXPIRE GETSET HSET HSETNX HMSET HINCRBY
-        // HDEL HINCRBYFLOAT INCR INCRBY INCRBYFLOAT LPUSH LPUSHX LPOP LREM
-        // LINSERT   LSET LTRIM MSET PSETEX PERSIST PEXPIRE
-        // PEXPIREAT PTTL  PING RESTORE RPOP RPUSH RPUSHX SADD SREM
-        // SPOP SETBIT SETRANGE SET SETEX
-        // SETNX TTL ZADD ZREM ZINCRBY ZREMRANGEBYRANK ZREMRANGEBYSCORE
-        if (RedisCommand::APPEND == i || RedisCommand::BITPOS == i
-            || RedisCommand::DUMP == i || RedisCommand::DEL == i
-            || RedisCommand::DECR == i || RedisCommand::DECRBY == i
-            || RedisCommand::EXPIREAT == i || RedisCommand::EXISTS == i
-            || RedisCommand::EXPIRE == i || RedisCommand::GETSET == i
-            || RedisCommand::HSET == i || RedisCommand::HSETNX == i
-            || RedisCommand::HMSET == i || RedisCommand::HINCRBY == i
-            || RedisCommand::HDEL == i || RedisCommand::HINCRBYFLOAT == i
-            || RedisCommand::INCR == i || RedisCommand::INCRBY == i
-            || RedisCommand::INCRBYFLOAT == i || RedisCommand::LPUSH == i
-            || RedisCommand::LPUSHX == i || RedisCommand::LPOP == i
-            || RedisCommand::LREM == i || RedisCommand::LINSERT == i
-            || RedisCommand::LSET == i || RedisCommand::LTRIM == i
-            || RedisCommand::MSET == i || RedisCommand::PSETEX == i
-            || RedisCommand::PERSIST == i || RedisCommand::PEXPIRE == i
-            || RedisCommand::PEXPIREAT == i || RedisCommand::PTTL == i
-            || RedisCommand::PING == i || RedisCommand::RESTORE == i
-            || RedisCommand::RPOP == i || RedisCommand::RPUSH == i
-            || RedisCommand::RPUSHX == i || RedisCommand::SADD == i
-            || RedisCommand::SREM == i || RedisCommand::SPOP == i
-            || RedisCommand::SETBIT == i || RedisCommand::SETRANGE == i
-            || RedisCommand::SET == i || RedisCommand::SETEX == i
-            || RedisCommand::SETNX == i || RedisCommand::TTL == i
-            || RedisCommand::ZADD == i || RedisCommand::ZREM == i
-            || RedisCommand::ZINCRBY == i || RedisCommand::ZREMRANGEBYRANK == i
-            || RedisCommand::ZREMRANGEBYSCORE == i)
-        {
-            CommandType[i] = 1;
-        } else {
-            CommandType[i] = 0;
-        }
-    }
-}
-
-class CommandTypeInit {
-public:
-    CommandTypeInit() {
-        initCommandType();
-    }
-};
-
-static CommandTypeInit init;
-
 ReadBalancePolicy::ReadBalancePolicy(void) {
     m_readCnt = 0;
 }
@@ -139,14 +84,11 @@ ReadBalancePolicy::~ReadBalancePolicy(void) {}
 
 RedisServant* ReadBalancePolicy::selectServant(RedisServantGroup* group, ClientPacket* packet)
 {
-    if (packet->commandType < 0 || packet->commandType >= RedisCommand::CMD_COUNT) {
-        return m_servantSelect.selectMaster(group);
-    }
-    if (1 == CommandType[packet->commandType]) {
+    if (!packet->command || !packet->command->isRead()) {
         return m_servantSelect.selectMaster(group);
     }
 
-    if (0 == (++m_readCnt % 2)){
+    if (0 == (__atomic_add_fetch(&m_readCnt, 1, __ATOMIC_RELAXED) % 2)){
         return m_servantSelect.selectSlave(group);
     }
     return m_servantSelect.selectMaster(group);
@@ -158,4 +100,144 @@ RedisServant* MasterOnlyPolicy::selectServant(RedisServantGroup* group, ClientPa
 }
 
 
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+static THREAD_LOCAL unsigned int t_random = 0;
+
+//xorshift, seeded per thread
+static unsigned int nextRandom(void)
+{
+    unsigned int x = t_random;
+    if (x == 0) {
+        x = (unsigned int)(EventLoop::monotonicTime() ^ (size_t)&t_random) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    t_random = x;
+    return x;
+}
 
+//The servants a request may go to: the masters, and for a read the slaves
+//as well. The index runs over the masters first
+static int candidateCount(RedisServantGroup* group, bool slaves)
+{
+    return group->masterCount() + (slaves ? group->slaveCount() : 0);
+}
+
+static RedisServant* candidate(RedisServantGroup* group, int index)
+{
+    if (index < group->masterCount()) {
+        return group->master(index);
+    }
+    return group->slave(index - group->masterCount());
+}
+
+static bool isReadRequest(ClientPacket* packet)
+{
+    return (packet->command && packet->command->isRead());
+}
+
+//The active servant with the least cost. The scan starts at a different
+//servant each time so that equal servants share the requests
+template <typename Cost>
+static RedisServant* leastCostServant(RedisServantGroup* group, bool slaves,
+                                      unsigned int start, Cost cost)
+{
+    int count = candidateCount(group, slaves);
+    RedisServant* best = NULL;
+    double bestCost = 0;
+    for (int i = 0; i < count; ++i) {
+        RedisServant* servant = candidate(group, (start + i) % count);
+        if (!servant->isUsable()) {
+            continue;
+        }
+        double c = cost(servant);
+        if (!best || c < bestCost) {
+            best = servant;
+            bestCost = c;
+        }
+    }
+    return best;
+}
+
+struct OutstandingCost
+{
+    double operator ()(RedisServant* servant) const
+    { return servant->outstandingRequests(); }
+};
+
+struct PeakEwmaCost
+{
+    PeakEwmaCost(void) : now(EventLoop::monotonicTime()) {}
+    double operator ()(RedisServant* servant) const
+    { return servant->loadCost(now); }
+    long long now;
+};
+
+RedisServant* LeastOutstandingPolicy::selectServant(RedisServantGroup* group, ClientPacket* packet)
+{
+    unsigned int start = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+    bool read = isReadRequest(packet);
+    RedisServant* servant = leastCostServant(group, read, start, OutstandingCost());
+    if (!servant && !read) {
+        servant = leastCostServant(group, true, start, OutstandingCost());
+    }
+    return servant;
+}
+
+RedisServant* PeakEwmaPolicy::selectServant(RedisServantGroup* group, ClientPacket* packet)
+{
+    unsigned int start = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+    bool read = isReadRequest(packet);
+    RedisServant* servant = leastCostServant(group, read, start, PeakEwmaCost());
+    if (!servant && !read) {
+        servant = leastCostServant(group, true, start, PeakEwmaCost());
+    }
+    return servant;
+}
+
+//The first usable servant from index on
+static RedisServant* activeCandidate(RedisServantGroup* group, int count, int index)
+{
+    for (int i = 0; i < count; ++i) {
+        RedisServant* servant = candidate(group, (index + i) % count);
+        if (servant->isUsable()) {
+            return servant;
+        }
+    }
+    return NULL;
+}
+
+static RedisServant* powerOfTwoChoices(RedisServantGroup* group, bool slaves)
+{
+    int count = candidateCount(group, slaves);
+    if (count == 0) {
+        return NULL;
+    }
+    unsigned int r = nextRandom();
+    int first = r % count;
+    RedisServant* a = activeCandidate(group, count, first);
+    if (!a || count == 1) {
+        return a;
+    }
+    //Another index than the first one
+    int second = (first + 1 + (r >> 16) % (count - 1)) % count;
+    RedisServant* b = activeCandidate(group, count, second);
+    PeakEwmaCost cost;
+    return (cost(b) < cost(a)) ? b : a;
+}
+
+RedisServant* PowerOfTwoChoicesPolicy::selectServant(RedisServantGroup* group, ClientPacket* packet)
+{
+    bool read = isReadRequest(packet);
+    RedisServant* servant = powerOfTwoChoices(group, read);
+    if (!servant && !read) {
+        servant = powerOfTwoChoices(group, true);
+    }
+    return servant;
+}
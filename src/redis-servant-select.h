@@ -24,6 +24,9 @@
 
 #define POLICY_READ_BALANCE "read_balance"
 #define POLICY_MASTER_ONLY  "master_only"
+#define POLICY_LEAST_OUTSTANDING "least_outstanding"
+#define POLICY_PEAK_EWMA    "peak_ewma"
+#define POLICY_P2C          "p2c"
 
 class ServantSelect
 {
@@ -64,6 +67,43 @@ private:
 };
 
 
+//The load aware policies send writes to the masters and reads to the
+//masters and the slaves. Writes go to a slave only if no master is active,
+//as with the other policies
+
+//The servant with the fewest requests in flight
+class LeastOutstandingPolicy : public RedisServantGroupPolicy
+{
+public:
+    LeastOutstandingPolicy(void) : m_next(0) {}
+    ~LeastOutstandingPolicy(void) {}
+    virtual RedisServant* selectServant(RedisServantGroup* g, ClientPacket* p);
+private:
+    unsigned int m_next;    //First servant looked at, ties are spread
+};
+
+//The servant with the lowest peak EWMA latency times requests in flight
+class PeakEwmaPolicy : public RedisServantGroupPolicy
+{
+public:
+    PeakEwmaPolicy(void) : m_next(0) {}
+    ~PeakEwmaPolicy(void) {}
+    virtual RedisServant* selectServant(RedisServantGroup* g, ClientPacket* p);
+private:
+    unsigned int m_next;
+};
+
+//The cheaper by peak EWMA of two servants drawn at random. Loops that
+//see the same estimates don't all rush to the one servant that looks best
+class PowerOfTwoChoicesPolicy : public RedisServantGroupPolicy
+{
+public:
+    PowerOfTwoChoicesPolicy(void) {}
+    ~PowerOfTwoChoicesPolicy(void) {}
+    virtual RedisServant* selectServant(RedisServantGroup* g, ClientPacket* p);
+};
+
+
 
 #endif
 
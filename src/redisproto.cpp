@@ -18,12 +18,161 @@
 */
 
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define REDISPROTO_X86_SIMD
+#endif
 
 #include "redisproto.h"
 
 #define READ_AGAIN -2
 #define READ_ERROR -1
 
+
+//Scanning kernels. The SSE2/AVX2 versions are picked at startup from the
+//cpu features, the scalar ones are used everywhere else
+
+//Index of the first c in s, len if there is none
+static int findByteScalar(const char* s, int len, char c)
+{
+    int pos = 0;
+    while (pos < len && s[pos] != c) {
+        ++pos;
+    }
+    return pos;
+}
+
+//Parses the digits of a number line up to its CR. Returns the index of
+//the CR, READ_AGAIN if the CR is not there yet or READ_ERROR
+static int readNumberScalar(const char* s, int len, int* num)
+{
+    int pos = 0;
+    *num = 0;
+    int signed_num = 1;
+    while (pos < len && s[pos] != '\r') {
+        if (s[pos] == '-') {
+            signed_num = -1;
+        } else if (s[pos] == '+') {
+            signed_num = 1;
+        } else if (s[pos] >= '0' && s[pos] <= '9') {
+            *num = (*num * 10) + (s[pos] - '0');
+        } else {
+            return READ_ERROR;
+        }
+        ++pos;
+    }
+    *num *= signed_num;
+    return (pos < len) ? pos : READ_AGAIN;
+}
+
+#ifdef REDISPROTO_X86_SIMD
+__attribute__((target("sse2")))
+static int findByteSSE2(const char* s, int len, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    int pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(s + pos));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return pos + findByteScalar(s + pos, len - pos, c);
+}
+
+__attribute__((target("avx2")))
+static int findByteAVX2(const char* s, int len, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    int pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(s + pos));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return pos + findByteSSE2(s + pos, len - pos, c);
+}
+
+//Converts 1 to 8 validated digits at once (SWAR). At least 8 bytes must be
+//readable from s
+static unsigned int convertDigits8(const char* s, int count)
+{
+    unsigned long long v;
+    memcpy(&v, s, 8);
+    v -= 0x3030303030303030ULL;
+    v <<= (8 - count) * 8;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+         (((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+    return (unsigned int)v;
+}
+
+//Finds the CR and checks the digits in one 16 byte block. Numbers with
+//more than 8 digits, a sign other than a leading one or less than 16
+//bytes of data go to the scalar version
+__attribute__((target("sse2")))
+static int readNumberSSE2(const char* s, int len, int* num)
+{
+    if (len < 16) {
+        return readNumberScalar(s, len, num);
+    }
+    int start = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+    __m128i chunk = _mm_loadu_si128((const __m128i*)s);
+    int crMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')));
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                    _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+    int digitMask = _mm_movemask_epi8(isDigit);
+    if (crMask == 0) {
+        return readNumberScalar(s, len, num);
+    }
+    int cr = __builtin_ctz(crMask);
+    int count = cr - start;
+    int wanted = ((1 << cr) - 1) & ~((1 << start) - 1);
+    if (count > 8 || (digitMask & wanted) != wanted) {
+        return readNumberScalar(s, len, num);
+    }
+    int n = (count == 0) ? 0 : (int)convertDigits8(s + start, count);
+    *num = (s[0] == '-') ? -n : n;
+    return cr;
+}
+#endif
+
+typedef int (*FindByteFunc)(const char* s, int len, char c);
+typedef int (*ReadNumberFunc)(const char* s, int len, int* num);
+
+static FindByteFunc selectFindByte(void)
+{
+#ifdef REDISPROTO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return findByteAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return findByteSSE2;
+    }
+#endif
+    return findByteScalar;
+}
+
+static ReadNumberFunc selectReadNumber(void)
+{
+#ifdef REDISPROTO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        return readNumberSSE2;
+    }
+#endif
+    return readNumberScalar;
+}
+
+static const FindByteFunc findByte = selectFindByte();
+static const ReadNumberFunc readNumber = selectReadNumber();
+
 static int readTextLine(char* s, int len, int stringlen)
 {
     if (len <= stringlen) {
@@ -50,56 +199,32 @@ static int readTextLine(char* s, int len, int stringlen)
 
 static int readTextEndByCRLF(char* s, int len, int* stringlen)
 {
-    int pos = 0;
-    *stringlen = 0;
-    while (pos < len && s[pos] != '\r') {
-        ++(*stringlen);
-        ++pos;
-    }
+    int pos = findByte(s, len, '\r');
+    *stringlen = pos;
     if (*stringlen == 0) {
         return READ_ERROR;
     }
 
-    if (s[pos] != '\r') {
+    if (pos + 1 >= len) {
         return READ_AGAIN;
-    } else {
-        if (pos < len) {
-            ++pos;
-            return (s[pos] == '\n') ? pos + 1 : READ_ERROR;
-        }
     }
-    return READ_AGAIN;
+    ++pos;
+    return (s[pos] == '\n') ? pos + 1 : READ_ERROR;
 }
 
 
 static int readNumberLine(char* s, int len, int* num)
 {
-    int pos = 0;
-    *num = 0;
-    int signed_num = 1;
-    while (pos < len && s[pos] != '\r') {
-        if (s[pos] == '-') {
-            signed_num = -1;
-        } else if (s[pos] == '+') {
-            signed_num = 1;
-        } else if (s[pos] >= '0' && s[pos] <= '9') {
-            *num = (*num * 10) + (s[pos] - '0');
-        } else {
-            return READ_ERROR;
-        }
-        ++pos;
+    int pos = readNumber(s, len, num);
+    if (pos < 0) {
+        return pos;
     }
-    *num *= signed_num;
 
-    if (s[pos] != '\r') {
+    if (pos + 1 >= len) {
         return READ_AGAIN;
-    } else {
-        if (pos < len) {
-            ++pos;
-            return (s[pos] == '\n') ? pos + 1 : READ_ERROR;
-        }
     }
-    return READ_AGAIN;
+    ++pos;
+    return (s[pos] == '\n') ? pos + 1 : READ_ERROR;
 }
 
 static int readBulk(char* s, int len, Token* tok)
@@ -118,12 +243,12 @@ static int readBulk(char* s, int len, Token* tok)
         }
 
         pos += ret;
+        if (stringlen < 0) {
+            //Null bulk
+            return pos;
+        }
         if (pos == len) {
-            if (stringlen <= 0) {
-                return pos;
-            } else {
-                return READ_AGAIN;
-            }
+            return READ_AGAIN;
         }
 
         str = s + pos;
@@ -140,7 +265,7 @@ static int readBulk(char* s, int len, Token* tok)
     }
 }
 
-static int readMultiBulk(char* s, int len, Token* toks, int* cnt)
+static int readMultiBulk(char* s, int len, RedisProtoParseResult* result)
 {
     int pos = 0;
     if (s[pos++] != '*') {
@@ -155,8 +280,17 @@ static int readMultiBulk(char* s, int len, Token* toks, int* cnt)
             return ret;
         }
         pos += ret;
+        if (argc < 0) {
+            //Null multi bulk
+            result->tokenCount = 0;
+            return pos;
+        }
+        if (argc > RedisProtoParseResult::MaxToken) {
+            return READ_ERROR;
+        }
         while (pos < len && (lines != argc)) {
-            Token* tok = toks + lines;
+            result->reserveTokens(lines + 1);
+            Token* tok = result->tokens + lines;
             ret = readBulk(s + pos, len - pos, tok);
             if (ret < 0) {
                 return ret;
@@ -167,7 +301,7 @@ static int readMultiBulk(char* s, int len, Token* toks, int* cnt)
         if (lines != argc) {
             return READ_AGAIN;
         }
-        *cnt = lines;
+        result->tokenCount = lines;
         return pos;
     } else {
         return READ_AGAIN;
@@ -240,6 +374,39 @@ static int readInteger(char* s, int len, int* num)
 
 
 
+bool RedisProtoParseResult::reserveTokens(int count)
+{
+    if (count <= m_tokenCapacity) {
+        return true;
+    }
+    if (count > MaxToken) {
+        return false;
+    }
+    int capacity = m_tokenCapacity * 2;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    if (capacity > MaxToken) {
+        capacity = MaxToken;
+    }
+    Token* p = new Token[capacity];
+    memcpy(p, tokens, sizeof(Token) * m_tokenCapacity);
+    releaseTokens();
+    tokens = p;
+    m_tokenCapacity = capacity;
+    return true;
+}
+
+void RedisProtoParseResult::releaseTokens(void)
+{
+    if (tokens != m_inlineTokens) {
+        delete []tokens;
+        tokens = m_inlineTokens;
+        m_tokenCapacity = InlineToken;
+    }
+}
+
+
 RedisProto::RedisProto(void)
 {
 }
@@ -273,6 +440,10 @@ void RedisProto::outputProtoString(const char* s, int len)
 
 RedisProto::ParseState RedisProto::parse(char *s, int len, RedisProtoParseResult *result)
 {
+    if (len <= 0) {
+        return ProtoIncomplete;
+    }
+
     int ret = 0;
     switch (s[0]) {
     case '+':
@@ -293,7 +464,7 @@ RedisProto::ParseState RedisProto::parse(char *s, int len, RedisProtoParseResult
         break;
     case '*':
         result->type = RedisProtoParseResult::MultiBulk;
-        ret = readMultiBulk(s, len, result->tokens, &result->tokenCount);
+        ret = readMultiBulk(s, len, result);
         break;
     default:
         result->type = RedisProtoParseResult::Unknown;
@@ -314,3 +485,212 @@ RedisProto::ParseState RedisProto::parse(char *s, int len, RedisProtoParseResult
 }
 
 
+void RedisProtoParser::reset(void)
+{
+    m_base = 0;
+    m_pos = 0;
+    m_argc = 0;
+    m_lines = 0;
+}
+
+RedisProto::ParseState RedisProtoParser::parse(char* s, int len, RedisProtoParseResult* result)
+{
+    if (len <= 0) {
+        return RedisProto::ProtoIncomplete;
+    }
+
+    if (m_pos == 0) {
+        result->reset();
+        if (s[0] != '*') {
+            //Single line and bulk messages are parsed in constant time. An
+            //integer leaves no token to take the command name from
+            RedisProto::ParseState state = RedisProto::parse(s, len, result);
+            if (state == RedisProto::ProtoOK && result->type == RedisProtoParseResult::Integer) {
+                return RedisProto::ProtoError;
+            }
+            return state;
+        }
+        if (len == 1) {
+            return RedisProto::ProtoIncomplete;
+        }
+        int argc = 0;
+        int ret = readNumberLine(s + 1, len - 1, &argc);
+        if (ret == READ_AGAIN) {
+            return RedisProto::ProtoIncomplete;
+        } else if (ret == READ_ERROR) {
+            return RedisProto::ProtoError;
+        }
+        //An empty or null multi bulk has no command
+        if (argc <= 0 || argc > RedisProtoParseResult::MaxToken) {
+            return RedisProto::ProtoError;
+        }
+        m_pos = ret + 1;
+        m_argc = argc;
+        m_lines = 0;
+    } else if (s != m_base) {
+        for (int i = 0; i < m_lines; ++i) {
+            result->tokens[i].s = s + (result->tokens[i].s - m_base);
+        }
+    }
+    m_base = s;
+
+    while (m_lines < m_argc && m_pos < len) {
+        //The tokens grow with the elements received, not with the count
+        //announced by the header
+        result->reserveTokens(m_lines + 1);
+        int ret = readBulk(s + m_pos, len - m_pos, result->tokens + m_lines);
+        if (ret == READ_AGAIN) {
+            return RedisProto::ProtoIncomplete;
+        } else if (ret == READ_ERROR) {
+            reset();
+            return RedisProto::ProtoError;
+        }
+        m_pos += ret;
+        ++m_lines;
+    }
+    if (m_lines != m_argc) {
+        return RedisProto::ProtoIncomplete;
+    }
+
+    result->type = RedisProtoParseResult::MultiBulk;
+    result->tokenCount = m_lines;
+    result->protoBuff = s;
+    result->protoBuffLen = m_pos;
+    reset();
+    return RedisProto::ProtoOK;
+}
+
+void RedisProtoFrameScanner::reset(void)
+{
+    m_state = Type;
+    m_type = 0;
+    m_negative = false;
+    m_number = 0;
+    m_bulkLeft = 0;
+    m_depth = 0;
+    m_length = 0;
+}
+
+void RedisProtoFrameScanner::elementFinished(void)
+{
+    while (m_depth > 0) {
+        if (--m_remains[m_depth-1] > 0) {
+            m_state = Type;
+            return;
+        }
+        --m_depth;
+    }
+    m_state = Finished;
+}
+
+int RedisProtoFrameScanner::scan(const IOBuffer& buf, int offset)
+{
+    IOSegment segs[16];
+    while (m_state != Finished && offset < buf.size()) {
+        int count = buf.segments(offset, segs, 16);
+        for (int i = 0; i < count && m_state != Finished; ++i) {
+            int ret = scan(segs[i].data, segs[i].size);
+            if (ret < 0) {
+                return ret;
+            }
+            offset += ret;
+        }
+    }
+    return offset;
+}
+
+void RedisProtoFrameScanner::skipBulk(long long n)
+{
+    m_bulkLeft -= n;
+    m_length += n;
+    if (m_bulkLeft == 0) {
+        elementFinished();
+    }
+}
+
+int RedisProtoFrameScanner::scan(const char* s, int len)
+{
+    int pos = 0;
+    while (pos < len && m_state != Finished) {
+        switch (m_state) {
+        case Type:
+            m_type = s[pos++];
+            switch (m_type) {
+            case '+': case '-': case ':': case '_':
+            case ',': case '#': case '(':
+                m_state = Line;
+                break;
+            case '$': case '*': case '%': case '~':
+            case '>': case '=': case '!': case '|':
+                m_negative = false;
+                m_number = 0;
+                m_state = Number;
+                break;
+            default:
+                return RedisProto::ProtoError;
+            }
+            break;
+        case Line:
+            pos += findByte(s + pos, len - pos, '\n');
+            if (pos < len) {
+                ++pos;
+                elementFinished();
+            }
+            break;
+        case Number:
+            while (pos < len && s[pos] != '\n') {
+                char c = s[pos++];
+                if (c >= '0' && c <= '9') {
+                    m_number = m_number * 10 + (c - '0');
+                } else if (c == '-') {
+                    m_negative = true;
+                } else if (c != '\r') {
+                    return RedisProto::ProtoError;
+                }
+            }
+            if (pos == len) {
+                break;
+            }
+            ++pos;
+            if (m_negative || (m_number == 0 && m_type != '$' && m_type != '=' && m_type != '!')) {
+                //Null or empty
+                elementFinished();
+            } else if (m_type == '$' || m_type == '=' || m_type == '!') {
+                m_bulkLeft = m_number + 2;
+                m_state = BulkData;
+            } else {
+                if (m_depth == MaxDepth) {
+                    return RedisProto::ProtoError;
+                }
+                long long count = m_number;
+                if (m_type == '%' || m_type == '|') {
+                    count *= 2;
+                }
+                if (m_type == '|') {
+                    //The attribute map comes before the real reply
+                    ++count;
+                }
+                m_remains[m_depth++] = count;
+                m_state = Type;
+            }
+            break;
+        case BulkData:
+        {
+            long long n = len - pos;
+            if (n > m_bulkLeft) {
+                n = m_bulkLeft;
+            }
+            pos += (int)n;
+            m_bulkLeft -= n;
+            if (m_bulkLeft == 0) {
+                elementFinished();
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    m_length += pos;
+    return pos;
+}
@@ -20,6 +20,8 @@
 #ifndef REDISPROTO_H
 #define REDISPROTO_H
 
+#include "util/iobuffer.h"
+
 struct Token {
     char* s;
     int len;
@@ -28,7 +30,10 @@ struct Token {
 class RedisProtoParseResult
 {
 public:
-    enum { MaxToken = 1024 };
+    enum {
+        InlineToken = 4,            //Tokens stored without allocation
+        MaxToken = 1024 * 1024      //Elements of a multi bulk, as redis
+    };
     enum Type {
         Unknown = 0,    //?????
         Status,         //"+"
@@ -37,9 +42,14 @@ public:
         Bulk,           //"$"
         MultiBulk       //"*"
     };
-    RedisProtoParseResult(void) { reset(); }
-    ~RedisProtoParseResult(void) {}
+    RedisProtoParseResult(void) {
+        tokens = m_inlineTokens;
+        m_tokenCapacity = InlineToken;
+        reset();
+    }
+    ~RedisProtoParseResult(void) { releaseTokens(); }
 
+    //The token storage is kept for the next message
     void reset(void) {
         protoBuff = 0;
         protoBuffLen = 0;
@@ -48,12 +58,32 @@ public:
         tokenCount = 0;
     }
 
+    //Resets and frees grown token storage
+    void clear(void) {
+        reset();
+        releaseTokens();
+    }
+
+    //Makes room for count tokens, the tokens stored are kept
+    bool reserveTokens(int count);
+
     char* protoBuff;
     int protoBuffLen;
     int type;
     int integer;
-    Token tokens[MaxToken];
+    Token* tokens;
     int tokenCount;
+
+private:
+    void releaseTokens(void);
+
+private:
+    int m_tokenCapacity;
+    Token m_inlineTokens[InlineToken];
+
+private:
+    RedisProtoParseResult(const RedisProtoParseResult&);
+    RedisProtoParseResult& operator=(const RedisProtoParseResult&);
 };
 
 class RedisProto
@@ -72,4 +102,76 @@ public:
     static ParseState parse(char* s, int len, RedisProtoParseResult* result);
 };
 
+//Parses one message fed in pieces. The elements of a multi bulk parsed by
+//an earlier call are kept, so a message received in many reads is scanned
+//once. The message may have moved since the last call (buffer growth or
+//compaction), the tokens already parsed follow it. A message without a
+//command name (an empty multi bulk, an integer) is a protocol error
+class RedisProtoParser
+{
+public:
+    RedisProtoParser(void) { reset(); }
+    ~RedisProtoParser(void) {}
+
+    void reset(void);
+    bool isParsing(void) const { return (m_pos > 0); }
+    RedisProto::ParseState parse(char* s, int len, RedisProtoParseResult* result);
+
+private:
+    char* m_base;       //Message address of the last call
+    int m_pos;          //Bytes of the message parsed
+    int m_argc;         //Elements of the multi bulk
+    int m_lines;        //Elements parsed
+};
+
+//Finds the end of one reply fed in pieces. Only the frame is tracked
+//(nesting and bulk lengths), no token is stored, so each byte is seen once
+class RedisProtoFrameScanner
+{
+public:
+    enum { MaxDepth = 32 };
+
+    RedisProtoFrameScanner(void) { reset(); }
+    ~RedisProtoFrameScanner(void) {}
+
+    void reset(void);
+
+    //Scans the next piece of the reply and returns the bytes that belong
+    //to the frame, ProtoError if the data is not a reply
+    int scan(const char* s, int len);
+
+    //Scans the chunks of buf from offset on up to the end of the frame.
+    //Returns the offset after the bytes scanned, ProtoError if the data
+    //is not a reply
+    int scan(const IOBuffer& buf, int offset);
+    bool isFinished(void) const { return m_state == Finished; }
+    long long length(void) const { return m_length; }
+
+    //Bytes of the current bulk (with its CRLF) that may be passed on
+    //without scanning, followed by skipBulk() for the bytes passed
+    long long bulkBytesLeft(void) const
+    { return (m_state == BulkData) ? m_bulkLeft : 0; }
+    void skipBulk(long long n);
+
+private:
+    enum State {
+        Type = 0,
+        Line,
+        Number,
+        BulkData,
+        Finished
+    };
+    void elementFinished(void);
+
+private:
+    int m_state;
+    char m_type;
+    bool m_negative;
+    long long m_number;
+    long long m_bulkLeft;
+    long long m_remains[MaxDepth];
+    int m_depth;
+    long long m_length;         //Bytes of the frame scanned
+};
+
 #endif
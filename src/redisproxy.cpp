@@ -17,6 +17,8 @@
 * under the License.
 */
 
+#include <algorithm>
+
 #include "util/logger.h"
 #include "command.h"
 #include "cmdhandler.h"
@@ -24,54 +26,220 @@
 #include "redisservant.h"
 #include "redisproxy.h"
 #include "redis-proxy-config.h"
+#include "util/slab.h"
 
 ClientPacket::ClientPacket(void)
 {
     commandType = -1;
+    command = NULL;
+    cacheState = HotKeyCache::None;
+    cacheGeneration = 0;
+    flightState = SingleFlight::None;
+    flightHash = 0;
+    flightGeneration = 0;
+    flightGroup = NULL;
+    flightNext = NULL;
+    flightWaiters = NULL;
     recvBufferOffset = 0;
     sendBufferOffset = 0;
     finishedState = 0;
     sendToRedisBytes = 0;
     requestServant = NULL;
+    requestTime = 0;
     redisSocket = NULL;
+    pipeline = NULL;
+    pipelineNext = NULL;
     finished_func = defaultFinishedHandler;
 }
 
 ClientPacket::~ClientPacket(void)
 {
+    if (requestTime != 0) {
+        requestServant->requestFinished(this);
+    }
+    clearReply();
+}
+
+void* ClientPacket::operator new(size_t size)
+{
+    return Slab::alloc((int)size);
+}
+
+void ClientPacket::operator delete(void* p)
+{
+    Slab::free(p, (int)sizeof(ClientPacket));
+}
+
+void ClientPacket::appendReplySegment(const char* data, int size)
+{
+    IOSegment seg;
+    seg.data = data;
+    seg.size = size;
+    sendSegments.append(seg);
+}
+
+void ClientPacket::appendReply(ClientPacket* sub)
+{
+    IOSegment segs[16];
+    int offset = 0;
+    while (offset < sub->sendBuff.size()) {
+        int count = sub->sendBuff.segments(offset, segs, 16);
+        for (int i = 0; i < count; ++i) {
+            sendSegments.append(segs[i]);
+            offset += segs[i].size;
+        }
+    }
+    for (int i = 0; i < sub->sendSegments.size(); ++i) {
+        sendSegments.append(sub->sendSegments.at(i));
+    }
+    for (int i = 0; i < sub->replyPackets.size(); ++i) {
+        replyPackets.append(sub->replyPackets.at(i));
+    }
+    if (!sub->replyPackets.isEmpty()) {
+        sub->replyPackets.clear();
+    }
+    holdReplyPacket(sub);
+}
+
+void ClientPacket::holdReplyPacket(ClientPacket* sub)
+{
+    replyPackets.append(sub);
+}
+
+void ClientPacket::clearReply(void)
+{
+    sendBuff.clear();
+    if (!sendSegments.isEmpty()) {
+        sendSegments.clear();
+    }
+    if (!replyPackets.isEmpty()) {
+        for (int i = 0; i < replyPackets.size(); ++i) {
+            delete replyPackets.at(i);
+        }
+        replyPackets.clear();
+    }
+}
+
+//The request is recvParseResult.protoBuff, unless it was assembled from
+//pieces (own bytes in recvBuff and bytes of the parent packet)
+int ClientPacket::fillRequestSegments(int offset, IOSegment* segs, int maxCount) const
+{
+    if (requestSegments.isEmpty()) {
+        if (offset >= recvParseResult.protoBuffLen || maxCount <= 0) {
+            return 0;
+        }
+        segs[0].data = recvParseResult.protoBuff + offset;
+        segs[0].size = recvParseResult.protoBuffLen - offset;
+        return 1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < requestSegments.size() && count < maxCount; ++i) {
+        const IOSegment& seg = requestSegments.at(i);
+        if (offset >= seg.size) {
+            offset -= seg.size;
+            continue;
+        }
+        segs[count].data = seg.data + offset;
+        segs[count].size = seg.size - offset;
+        ++count;
+        offset = 0;
+    }
+    return count;
 }
 
+static void sendNextPipelineRequest(ClientPacket* packet);
+
 void ClientPacket::setFinishedState(ClientPacket::State state)
 {
     finishedState = state;
+    timer.stop();
+    if (requestTime != 0) {
+        requestServant->requestFinished(this);
+        requestTime = 0;
+    }
+    if (cacheState != HotKeyCache::None) {
+        proxy()->hotKeyCache()->requestFinished(this, state == RequestFinished);
+    }
+    if (flightState != SingleFlight::None) {
+        SingleFlight::finished(this);
+    }
+    if (pipeline) {
+        sendNextPipelineRequest(this);
+    }
     finished_func(this, finished_arg);
 }
 
 RedisProto::ParseState ClientPacket::parseRecvBuffer(void)
 {
-    recvParseResult.reset();
-    RedisProto::ParseState state = RedisProto::parse(recvBuff.data() + recvBufferOffset,
-                                                     recvBuff.size() - recvBufferOffset,
-                                                     &recvParseResult);
+    RedisProto::ParseState state = recvParser.parse(recvBuff.data() + recvBufferOffset,
+                                                    recvBuff.size() - recvBufferOffset,
+                                                    &recvParseResult);
     if (state == RedisProto::ProtoOK) {
         recvBufferOffset += recvParseResult.protoBuffLen;
     }
     return state;
 }
 
+//Replies are passed on as they are, so only their frame is scanned. Single
+//line replies are tokenized as well, their value may be used (DEL). Bulk
+//and multi bulk replies stay in the chunks they were received in, their
+//protoBuff is not set
+static void setReplyParseResult(IOBuffer& buf, int offset, int len, RedisProtoParseResult* result)
+{
+    result->reset();
+    IOSegment first;
+    if (buf.segments(offset, &first, 1) == 0) {
+        return;
+    }
+    switch (first.data[0]) {
+    case '+':
+    case '-':
+    case ':':
+        result->protoBuff = buf.data() + offset;
+        RedisProto::parse(result->protoBuff, len, result);
+        break;
+    case '$':
+        result->type = RedisProtoParseResult::Bulk;
+        break;
+    case '*':
+        result->type = RedisProtoParseResult::MultiBulk;
+        break;
+    default:
+        break;
+    }
+    result->protoBuffLen = len;
+}
+
 RedisProto::ParseState ClientPacket::parseSendBuffer(void)
 {
-    sendParseResult.reset();
-    RedisProto::ParseState state = RedisProto::parse(sendBuff.data() + sendBufferOffset,
-                                                     sendBuff.size() - sendBufferOffset,
-                                                     &sendParseResult);
-    if (state == RedisProto::ProtoOK) {
-        sendBufferOffset += sendParseResult.protoBuffLen;
+    //The chunks received since the last call are scanned
+    int offset = sendBufferOffset + (int)sendScanner.length();
+    if (sendScanner.scan(sendBuff, offset) < 0) {
+        sendScanner.reset();
+        return RedisProto::ProtoError;
     }
-    return state;
+    if (!sendScanner.isFinished()) {
+        return RedisProto::ProtoIncomplete;
+    }
+
+    int len = (int)sendScanner.length();
+    sendScanner.reset();
+    setReplyParseResult(sendBuff, sendBufferOffset, len, &sendParseResult);
+    sendBufferOffset += len;
+    return RedisProto::ProtoOK;
 }
 
-void ClientPacket::defaultFinishedHandler(ClientPacket *packet, void *)
+//Appends a complete reply framed by the caller
+void ClientPacket::appendRedisReply(const IOBuffer& reply, int offset, int len)
+{
+    int start = sendBuff.size();
+    sendBuff.append(reply, offset, len);
+    setReplyParseResult(sendBuff, start, len, &sendParseResult);
+    sendBufferOffset = start + len;
+}
+
+static void appendFinishedStateReply(ClientPacket* packet)
 {
     switch (packet->finishedState) {
     case ClientPacket::Unknown:
@@ -91,23 +259,157 @@ void ClientPacket::defaultFinishedHandler(ClientPacket *packet, void *)
         break;
     case ClientPacket::RequestFinished:
         break;
+    case ClientPacket::RequestRejected:
+        packet->sendBuff.append("-BUSY Too many requests to the backend\r\n");
+        break;
+    case ClientPacket::RequestTimeout:
+        packet->sendBuff.append("-TIMEOUT Request to the backend timed out\r\n");
+        break;
     default:
         break;
     }
+}
+
+void ClientPacket::defaultFinishedHandler(ClientPacket *packet, void *)
+{
+    appendFinishedStateReply(packet);
     packet->server->writeReply(packet);
 }
 
 
+//Requests of a pipeline sent to one pooled servant. Only the head is in
+//flight, the others wait so that the servant sees them in request order
+struct PipelineChain
+{
+    RedisServant* servant;
+    ClientPacket* head;
+    ClientPacket* tail;
+};
+
+//Pipelined requests of one client dispatched together. Each request runs
+//in its own packet and the replies are appended in request order
+struct PipelineContext
+{
+    int requestCount;
+    int finishedCount;
+    ClientPacket* subs[RedisProxy::MaxPipelineDepth];
+    ClientPacket* packet;
+    Vector<PipelineChain> chains;
+};
+
+static void sendPipelineRequest(RedisServant* servant, ClientPacket* packet)
+{
+    if (servant->isMultiplexed()) {
+        //A multiplexed connection keeps the order by itself
+        servant->handle(packet);
+        return;
+    }
+
+    PipelineContext* context = packet->pipeline;
+    for (int i = 0; i < context->chains.size(); ++i) {
+        PipelineChain& chain = context->chains.at(i);
+        if (chain.servant == servant) {
+            if (chain.head) {
+                chain.tail->pipelineNext = packet;
+                chain.tail = packet;
+                return;
+            }
+            chain.head = packet;
+            chain.tail = packet;
+            servant->handle(packet);
+            return;
+        }
+    }
+
+    PipelineChain chain;
+    chain.servant = servant;
+    chain.head = packet;
+    chain.tail = packet;
+    context->chains.append(chain);
+    servant->handle(packet);
+}
+
+static void sendNextPipelineRequest(ClientPacket* packet)
+{
+    PipelineContext* context = packet->pipeline;
+    for (int i = 0; i < context->chains.size(); ++i) {
+        PipelineChain& chain = context->chains.at(i);
+        if (chain.head == packet) {
+            ClientPacket* next = packet->pipelineNext;
+            packet->pipelineNext = NULL;
+            chain.head = next;
+            if (next) {
+                chain.servant->handle(next);
+            } else {
+                chain.tail = NULL;
+            }
+            return;
+        }
+    }
+}
+
+static void onPipelinePacketFinished(ClientPacket* sub, void* arg)
+{
+    PipelineContext* context = (PipelineContext*)arg;
+    appendFinishedStateReply(sub);
+    ++context->finishedCount;
+    if (context->finishedCount == context->requestCount) {
+        ClientPacket* packet = context->packet;
+        RedisProxy* proxy = packet->proxy();
+        for (int i = 0; i < context->requestCount; ++i) {
+            proxy->monitor()->replyClientFinished(context->subs[i]);
+            packet->appendReply(context->subs[i]);
+        }
+        delete context;
+        proxy->writeReply(packet);
+    }
+}
+
+//The request is parsed where it is in the client buffer, which is left
+//alone until the replies of the pipeline are written
+static void appendPipelineRequest(PipelineContext* context, char* request, int len)
+{
+    ClientPacket* packet = context->packet;
+    ClientPacket* sub = new ClientPacket;
+    sub->server = packet->server;
+    sub->eventLoop = packet->eventLoop;
+    sub->clientAddress = packet->clientAddress;
+    sub->finished_func = onPipelinePacketFinished;
+    sub->finished_arg = context;
+    sub->pipeline = context;
+    sub->recvParser.parse(request, len, &sub->recvParseResult);
+    context->subs[context->requestCount] = sub;
+    ++context->requestCount;
+}
+
+
+
+//Replaced routing tables are freed by quiescent states: the lookups of a
+//loop are done within one of its callbacks, so none is in progress when
+//the timer of the loop runs. A table replaced before every loop has run
+//its timer can't be in use anymore
+struct RoutingReader
+{
+    RedisProxy* proxy;
+    Event timer;
+    unsigned long long epoch;       //Routing epoch at the last quiescent state
+};
 
 static Monitor dummy;
 RedisProxy::RedisProxy(void)
 {
     m_monitor = &dummy;
+    m_hotKeyCache = NULL;
+    m_requestCoalescing = true;
+    m_clientTimeout = 0;
     m_hashFunc = hashForBytes;
     m_maxHashValue = DefaultMaxHashValue;
-    for (int i = 0; i < MaxHashValue; ++i) {
-        m_hashMapping[i] = NULL;
-    }
+    m_hashStrategy = ModuloHash;
+    m_hashTag[0] = '\0';
+    m_routing = new RoutingTable;
+    m_retiredTables = NULL;
+    m_routingEpoch = 1;
+    m_routingShared = false;
     m_vipAddress[0] = 0;
     m_vipName[0] = 0;
     m_vipEnabled = false;
@@ -116,15 +418,94 @@ RedisProxy::RedisProxy(void)
     m_ejectAfterRestoreEnabled = false;
     m_threadPoolRefCount = 0;
     m_proxyManager.setProxy(this);
+    m_hashMigrator.setProxy(this);
 }
 
 RedisProxy::~RedisProxy(void)
 {
+    for (int i = 0; i < m_routingReaders.size(); ++i) {
+        m_routingReaders.at(i)->timer.remove();
+        delete m_routingReaders.at(i);
+    }
+    while (m_retiredTables) {
+        RoutingTable* table = m_retiredTables;
+        m_retiredTables = table->nextRetired;
+        delete table;
+    }
+    delete m_routing;
     for (int i = 0; i < m_groups.size(); ++i) {
         delete m_groups.at(i);
     }
 }
 
+void RedisProxy::addRoutingReader(EventLoop* loop)
+{
+    RoutingReader* reader = new RoutingReader;
+    reader->proxy = this;
+    reader->epoch = m_routingEpoch;
+    reader->timer.set(loop, -1, EV_PERSIST, onRoutingQuiescent, reader);
+    reader->timer.active(RoutingQuiescentInterval);
+    m_routingReaders.append(reader);
+}
+
+void RedisProxy::onRoutingQuiescent(socket_t, short, void* arg)
+{
+    RoutingReader* reader = (RoutingReader*)arg;
+    RedisProxy* proxy = reader->proxy;
+    unsigned long long epoch = __atomic_load_n(&proxy->m_routingEpoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&proxy->m_retiredTables, __ATOMIC_RELAXED) != NULL) {
+        proxy->m_routingMutex.lock();
+        proxy->reclaimRoutingTables();
+        proxy->m_routingMutex.unlock();
+    }
+}
+
+void RedisProxy::reclaimRoutingTables(void)
+{
+    unsigned long long oldest = m_routingEpoch;
+    for (int i = 0; i < m_routingReaders.size(); ++i) {
+        unsigned long long epoch = __atomic_load_n(&m_routingReaders.at(i)->epoch, __ATOMIC_ACQUIRE);
+        if (epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    RoutingTable** link = &m_retiredTables;
+    while (*link) {
+        RoutingTable* table = *link;
+        if (table->retiredEpoch < oldest) {
+            __atomic_store_n(link, table->nextRetired, __ATOMIC_RELAXED);
+            delete table;
+        } else {
+            link = &table->nextRetired;
+        }
+    }
+}
+
+RoutingTable* RedisProxy::beginRoutingUpdate(void)
+{
+    m_routingMutex.lock();
+    //Nobody reads the table before the proxy runs, it is changed in place
+    if (!m_routingShared) {
+        return m_routing;
+    }
+    return new RoutingTable(*m_routing);
+}
+
+void RedisProxy::endRoutingUpdate(RoutingTable* table)
+{
+    if (table != m_routing) {
+        RoutingTable* old = m_routing;
+        __atomic_store_n(&m_routing, table, __ATOMIC_RELEASE);
+        old->retiredEpoch = m_routingEpoch;
+        old->nextRetired = m_retiredTables;
+        __atomic_store_n(&m_retiredTables, old, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_routingEpoch, m_routingEpoch + 1, __ATOMIC_RELEASE);
+    }
+    m_routingMutex.unlock();
+}
+
 bool RedisProxy::run(const HostAddress& addr)
 {
     if (isRunning()) {
@@ -150,15 +531,29 @@ bool RedisProxy::run(const HostAddress& addr)
     Logger::log(Logger::Message, "Start the %s on port %d", APP_NAME, addr.port());
 
     RedisCommand cmds[] = {
-        {"HASHMAPPING", 11, -1, onHashMapping, NULL},
-        {"ADDKEYMAPPING", 13, -1, onAddKeyMapping, NULL},
-        {"DELKEYMAPPING", 13, -1, onDelKeyMapping, NULL},
-        {"SHOWMAPPING", 11, -1, onShowMapping, NULL},
-        {"POOLINFO", 8, -1, onPoolInfo, NULL},
-        {"SHUTDOWN", 8, -1, onShutDown, this}
+        {"HASHMAPPING", 11, -1, onHashMapping, NULL, 0, 0, 0, 0, 0, 0},
+        {"ADDKEYMAPPING", 13, -1, onAddKeyMapping, NULL, 0, 0, 0, 0, 0, 0},
+        {"DELKEYMAPPING", 13, -1, onDelKeyMapping, NULL, 0, 0, 0, 0, 0, 0},
+        {"SHOWMAPPING", 11, -1, onShowMapping, NULL, 0, 0, 0, 0, 0, 0},
+        {"POOLINFO", 8, -1, onPoolInfo, NULL, 0, 0, 0, 0, 0, 0},
+        {"HOTKEYCACHE", 11, -1, onHotKeyCache, NULL, 0, 0, 0, 0, 0, 0},
+        {"MIGRATEHASH", 11, -1, onMigrateHash, NULL, 0, 0, 0, 0, 0, 0},
+        {"MIGRATEINFO", 11, -1, onMigrateInfo, NULL, 0, 0, 0, 0, 0, 0},
+        {"SHUTDOWN", 8, -1, onShutDown, this, 0, 0, 0, 0, 0, 0}
     };
     RedisCommandTable::instance()->registerCommand(cmds, sizeof(cmds)/sizeof(RedisCommand));
 
+    //From now on the routing table is replaced instead of changed
+    addRoutingReader(eventLoop());
+    if (m_eventLoopThreadPool) {
+        for (int i = 0; i < m_eventLoopThreadPool->size(); ++i) {
+            addRoutingReader(m_eventLoopThreadPool->thread(i)->eventLoop());
+        }
+    }
+    m_routingMutex.lock();
+    m_routingShared = true;
+    m_routingMutex.unlock();
+
     return TcpServer::run(addr);
 }
 
@@ -189,7 +584,9 @@ void RedisProxy::addRedisGroup(RedisServantGroup *group)
 bool RedisProxy::setGroupMappingValue(int hashValue, RedisServantGroup *group)
 {
     if (hashValue >= 0 && hashValue < MaxHashValue) {
-        m_hashMapping[hashValue] = group;
+        RoutingTable* table = beginRoutingUpdate();
+        table->setHashForGroup(hashValue, group);
+        endRoutingUpdate(table);
         return true;
     }
     return false;
@@ -198,11 +595,123 @@ bool RedisProxy::setGroupMappingValue(int hashValue, RedisServantGroup *group)
 RedisServantGroup *RedisProxy::hashForGroup(int hashValue) const
 {
     if (hashValue >= 0 && hashValue < m_maxHashValue) {
-        return m_hashMapping[hashValue];
+        return routingTable()->hashForGroup(hashValue);
     }
     return NULL;
 }
 
+void RedisProxy::setHashTag(const char* tag)
+{
+    if (tag && strlen(tag) == 2) {
+        strcpy(m_hashTag, tag);
+    } else {
+        m_hashTag[0] = '\0';
+    }
+}
+
+int RedisProxy::hashValue(const char* key, int len) const
+{
+    //As redis cluster does, a key with a non-empty tag hashes as its tag
+    if (m_hashTag[0] != '\0') {
+        const char* begin = (const char*)memchr(key, m_hashTag[0], len);
+        if (begin) {
+            ++begin;
+            const char* end = (const char*)memchr(begin, m_hashTag[1], key + len - begin);
+            if (end && end > begin) {
+                key = begin;
+                len = (int)(end - begin);
+            }
+        }
+    }
+    if (m_hashStrategy == Crc16Hash) {
+        return crc16ForBytes(key, len) % m_maxHashValue;
+    }
+    return m_hashFunc(key, len) % m_maxHashValue;
+}
+
+int RedisProxy::hashStrategyByName(const char* name)
+{
+    if (name == NULL || name[0] == '\0' || strcasecmp(name, HASH_STRATEGY_MODULO) == 0) {
+        return ModuloHash;
+    } else if (strcasecmp(name, HASH_STRATEGY_CRC16) == 0) {
+        return Crc16Hash;
+    } else if (strcasecmp(name, HASH_STRATEGY_JUMP) == 0) {
+        return JumpHash;
+    } else if (strcasecmp(name, HASH_STRATEGY_KETAMA) == 0) {
+        return KetamaHash;
+    }
+    return -1;
+}
+
+const char* RedisProxy::hashStrategyName(int strategy)
+{
+    switch (strategy) {
+    case Crc16Hash: return HASH_STRATEGY_CRC16;
+    case JumpHash: return HASH_STRATEGY_JUMP;
+    case KetamaHash: return HASH_STRATEGY_KETAMA;
+    default: return HASH_STRATEGY_MODULO;
+    }
+}
+
+struct KetamaPoint
+{
+    unsigned int hash;
+    RedisServantGroup* group;
+    bool operator <(const KetamaPoint& other) const { return hash < other.hash; }
+};
+
+//Hash values are small consecutive numbers, mix them before the
+//jump hash and the ring use them as keys
+static unsigned long long mixHashValue(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void RedisProxy::assignHashValues(void)
+{
+    int count = m_groups.size();
+    if (count == 0) {
+        return;
+    }
+
+    RoutingTable* table = beginRoutingUpdate();
+    if (m_hashStrategy == JumpHash) {
+        //Groups keep their place in the configuration, new ones go last
+        for (int i = 0; i < m_maxHashValue; ++i) {
+            table->setHashForGroup(i, m_groups.at(jumpConsistentHash(mixHashValue(i), count)));
+        }
+    } else if (m_hashStrategy == KetamaHash) {
+        //The points of a group only depend on its name and weight
+        std::vector<KetamaPoint> ring;
+        char buf[300];
+        for (int i = 0; i < count; ++i) {
+            RedisServantGroup* group = m_groups.at(i);
+            int points = (group->weight() > 0 ? group->weight() : 1) * KetamaPointsPerWeight;
+            for (int j = 0; j < points; ++j) {
+                KetamaPoint point;
+                point.hash = hashForBytes(buf, sprintf(buf, "%s-%d", group->groupName(), j));
+                point.group = group;
+                ring.push_back(point);
+            }
+        }
+        std::sort(ring.begin(), ring.end());
+
+        for (int i = 0; i < m_maxHashValue; ++i) {
+            KetamaPoint key;
+            key.hash = (unsigned int)mixHashValue(i);
+            std::vector<KetamaPoint>::iterator it = std::lower_bound(ring.begin(), ring.end(), key);
+            if (it == ring.end()) {
+                it = ring.begin();
+            }
+            table->setHashForGroup(i, it->group);
+        }
+    }
+    endRoutingUpdate(table);
+}
+
 RedisServantGroup *RedisProxy::group(const char *name) const
 {
     for (int i = 0; i < groupCount(); ++i) {
@@ -214,31 +723,59 @@ RedisServantGroup *RedisProxy::group(const char *name) const
     return NULL;
 }
 
-RedisServantGroup *RedisProxy::mapToGroup(const char* key, int len)
+RedisServantGroup *RedisProxy::mapToGroup(const char* key, int len,
+                                          RedisServantGroup** migrationSource)
 {
-    if (!m_keyMapping.empty()) {
-        String _key(key, len, false);
-        StringMap<RedisServantGroup*>::iterator it = m_keyMapping.find(_key);
-        if (it != m_keyMapping.end()) {
-            return it->second;
-        }
+    const RoutingTable* table = routingTable();
+    RedisServantGroup* group = table->keyForGroup(key, len);
+    if (migrationSource) {
+        *migrationSource = NULL;
     }
-
-    unsigned int hash_val = m_hashFunc(key, len);
-    unsigned int idx = hash_val % m_maxHashValue;
-    return m_hashMapping[idx];
+    if (group) {
+        return group;
+    }
+    int hash = hashValue(key, len);
+    if (migrationSource) {
+        *migrationSource = table->migrationSource(hash);
+    }
+    return table->hashForGroup(hash);
 }
 
 void RedisProxy::handleClientPacket(const char *key, int len, ClientPacket *packet)
 {
-    RedisServantGroup* group = mapToGroup(key, len);
+    //Reads of hot keys may be answered here, writes drop the cached replies
+    if (m_hotKeyCache && packet->command && m_hotKeyCache->handleRequest(key, len, packet)) {
+        packet->setFinishedState(ClientPacket::RequestFinished);
+        return;
+    }
+
+    RedisServantGroup* source;
+    RedisServantGroup* group = mapToGroup(key, len, &source);
     if (!group) {
         packet->setFinishedState(ClientPacket::RequestError);
         return;
     }
+    //An identical read in flight answers this one as well
+    if (m_requestCoalescing && packet->command && SingleFlight::join(group, key, len, packet)) {
+        return;
+    }
+    //The key of a migrating hash value is moved before it is used
+    if (source) {
+        m_hashMigrator.moveKeyAndHandle(key, len, source, group, packet);
+        return;
+    }
+    sendToGroup(group, packet);
+}
+
+void RedisProxy::sendToGroup(RedisServantGroup* group, ClientPacket* packet)
+{
     RedisServant* servant = group->findUsableServant(packet);
     if (servant) {
-        servant->handle(packet);
+        if (packet->pipeline) {
+            sendPipelineRequest(servant, packet);
+        } else {
+            servant->handle(packet);
+        }
     } else {
         if (m_autoEjectGroup) {
             m_groupMutex.lock();
@@ -252,7 +789,9 @@ void RedisProxy::handleClientPacket(const char *key, int len, ClientPacket *pack
 bool RedisProxy::addGroupKeyMapping(const char *key, int len, RedisServantGroup *group)
 {
     if (key && len > 0 && group) {
-        m_keyMapping.insert(StringMap<RedisServantGroup*>::value_type(String(key, len, true), group));
+        RoutingTable* table = beginRoutingUpdate();
+        table->addKeyMapping(key, len, group);
+        endRoutingUpdate(table);
         return true;
     }
     return false;
@@ -261,7 +800,9 @@ bool RedisProxy::addGroupKeyMapping(const char *key, int len, RedisServantGroup
 void RedisProxy::removeGroupKeyMapping(const char *key, int len)
 {
     if (key && len > 0) {
-        m_keyMapping.erase(String(key, len));
+        RoutingTable* table = beginRoutingUpdate();
+        table->removeKeyMapping(key, len);
+        endRoutingUpdate(table);
     }
 }
 
@@ -302,6 +843,23 @@ void RedisProxy::clientConnected(Context* c)
     m_monitor->clientConnected(packet);
 }
 
+void RedisProxy::waitRequest(Context* c)
+{
+    ClientPacket* packet = (ClientPacket*)c;
+    if (m_clientTimeout > 0) {
+        packet->timer.setHandler(onClientTimeout, packet);
+        packet->eventLoop->timingWheel()->start(&packet->timer, m_clientTimeout * 1000);
+    }
+    TcpServer::waitRequest(c);
+}
+
+void RedisProxy::onClientTimeout(void* arg)
+{
+    ClientPacket* packet = (ClientPacket*)arg;
+    packet->_event.remove();
+    packet->proxy()->closeConnection(packet);
+}
+
 TcpServer::ReadStatus RedisProxy::readingRequest(Context *c)
 {
     ClientPacket* packet = (ClientPacket*)c;
@@ -320,7 +878,30 @@ TcpServer::ReadStatus RedisProxy::readingRequest(Context *c)
 void RedisProxy::readRequestFinished(Context *c)
 {
     ClientPacket* packet = (ClientPacket*)c;
+    packet->timer.stop();
     RedisProtoParseResult& r = packet->recvParseResult;
+    if (!packet->isRecvParseEnd() || !packet->sendSegments.isEmpty()) {
+        //A second complete request behind this one starts a pipeline. The
+        //replies of the last pipeline may still be queued as segments, the
+        //request then runs as a pipeline too so that its reply follows them
+        int offset = packet->recvBufferOffset - r.protoBuffLen;
+        int firstLen = r.protoBuffLen;
+        bool more = (!packet->isRecvParseEnd() &&
+                     packet->parseRecvBuffer() == RedisProto::ProtoOK);
+        if (more || !packet->sendSegments.isEmpty()) {
+            dispatchPipeline(packet, offset, firstLen, more);
+            return;
+        }
+        packet->recvBufferOffset = offset;
+        packet->recvParser.reset();
+        packet->parseRecvBuffer();
+    }
+
+    packet->sendToRedisBytes = 0;
+    packet->sendScanner.reset();
+    packet->requestServant = NULL;
+    packet->redisSocket = NULL;
+
     char* cmd = r.tokens[0].s;
     int len = r.tokens[0].len;
 
@@ -328,6 +909,37 @@ void RedisProxy::readRequestFinished(Context *c)
     cmdtable->execCommand(cmd, len, packet);
 }
 
+void RedisProxy::dispatchPipeline(ClientPacket* packet, int offset, int firstLen, bool more)
+{
+    PipelineContext* context = new PipelineContext;
+    context->requestCount = 0;
+    context->finishedCount = 0;
+    context->packet = packet;
+
+    //The first request and the one parsed behind it (if any) are taken,
+    //then every other complete request in the buffer up to the depth
+    RedisProtoParseResult& r = packet->recvParseResult;
+    appendPipelineRequest(context, packet->recvBuff.data() + offset, firstLen);
+    if (more) {
+        appendPipelineRequest(context, r.protoBuff, r.protoBuffLen);
+    }
+    while (more && context->requestCount < MaxPipelineDepth && !packet->isRecvParseEnd()) {
+        if (packet->parseRecvBuffer() != RedisProto::ProtoOK) {
+            break;
+        }
+        appendPipelineRequest(context, r.protoBuff, r.protoBuffLen);
+    }
+
+    //The context is released by the last finished request
+    RedisCommandTable* cmdtable = RedisCommandTable::instance();
+    int count = context->requestCount;
+    for (int i = 0; i < count; ++i) {
+        ClientPacket* sub = context->subs[i];
+        RedisProtoParseResult& request = sub->recvParseResult;
+        cmdtable->execCommand(request.tokens[0].s, request.tokens[0].len, sub);
+    }
+}
+
 void RedisProxy::writeReply(Context *c)
 {
     ClientPacket* packet = (ClientPacket*)c;
@@ -337,7 +949,8 @@ void RedisProxy::writeReply(Context *c)
             closeConnection(c);
             break;
         case RedisProto::ProtoIncomplete:
-            waitRequest(c);
+            //Reply now, the rest of the request is kept for the next read
+            TcpServer::writeReply(c);
             break;
         case RedisProto::ProtoOK:
             readRequestFinished(c);
@@ -353,11 +966,23 @@ void RedisProxy::writeReply(Context *c)
 void RedisProxy::writeReplyFinished(Context *c)
 {
     ClientPacket* packet = (ClientPacket*)c;
-    m_monitor->replyClientFinished(packet);
+    //Pipelined requests were reported one by one
+    if (packet->finishedState != ClientPacket::Unknown) {
+        m_monitor->replyClientFinished(packet);
+    }
     packet->finishedState = ClientPacket::Unknown;
     packet->commandType = -1;
-    packet->sendBuff.clear();
-    packet->recvBuff.clear();
+    packet->command = NULL;
+    packet->clearReply();
+    //An idle connection keeps no buffer memory. A request partly received
+    //keeps its buffer and the tokens parsed so far
+    if (packet->isRecvParseEnd()) {
+        packet->recvBuff.clear();
+        packet->recvParseResult.clear();
+    } else {
+        packet->recvBuff.remove(packet->recvBufferOffset);
+        packet->recvParseResult.reset();
+    }
     packet->sendBytes = 0;
     packet->recvBytes = 0;
     packet->sendToRedisBytes = 0;
@@ -365,8 +990,8 @@ void RedisProxy::writeReplyFinished(Context *c)
     packet->redisSocket = NULL;
     packet->recvBufferOffset = 0;
     packet->sendBufferOffset = 0;
-    packet->sendParseResult.reset();
-    packet->recvParseResult.reset();
+    packet->sendScanner.reset();
+    packet->sendParseResult.clear();
     waitRequest(c);
 }
 
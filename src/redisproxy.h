@@ -28,14 +28,20 @@
 #include "util/tcpserver.h"
 #include "util/locker.h"
 
+#include "timingwheel.h"
 #include "command.h"
 #include "redisproto.h"
 #include "redisservantgroup.h"
 #include "proxymanager.h"
+#include "hotkeycache.h"
+#include "singleflight.h"
+#include "routingtable.h"
+#include "hashmigrator.h"
 
 class RedisConnection;
 class RedisServant;
 class RedisProxy;
+struct PipelineContext;
 class ClientPacket : public Context
 {
 public:
@@ -45,32 +51,70 @@ public:
         ProtoNotSupport = 2,
         WrongNumberOfArguments = 3,
         RequestError = 4,
-        RequestFinished = 5
+        RequestFinished = 5,
+        RequestRejected = 6,        //Shed by the servant under overload
+        RequestTimeout = 7          //No reply or connection in time
     };
 
     ClientPacket(void);
     ~ClientPacket(void);
 
+    //Packets come from the slab of the allocating thread
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
     void setFinishedState(State state);
     RedisProxy* proxy(void) const { return (RedisProxy*)server; }
     RedisProto::ParseState parseRecvBuffer(void);
     RedisProto::ParseState parseSendBuffer(void);
+    void appendRedisReply(const IOBuffer& reply, int offset, int len);
     bool isRecvParseEnd(void) const
     { return (recvBufferOffset == recvBuff.size()); }
 
+    //Appends data to the reply without copying it, the data must stay
+    //valid until the reply is written
+    void appendReplySegment(const char* data, int size);
+    //Appends the reply of a finished sub packet without copying it. The
+    //sub packet is owned by this packet until the reply is written
+    void appendReply(ClientPacket* sub);
+    //Keeps a sub packet whose buffers are referenced by the reply
+    void holdReplyPacket(ClientPacket* sub);
+    void clearReply(void);
+
+    //Fills segs with the request to redis from offset on and returns the
+    //number of segments filled
+    int fillRequestSegments(int offset, IOSegment* segs, int maxCount) const;
+
     static void defaultFinishedHandler(ClientPacket *packet, void*);
 
     int finishedState;                              //Finished state
     void* finished_arg;                             //Finished function arg
     void (*finished_func)(ClientPacket*, void*);    //Finished notify function
     int commandType;                                //Current command type
+    const RedisCommand* command;                    //Entry of the current command
+    int cacheState;                                 //Hot key cache work left
+    unsigned int cacheGeneration;                   //Key generation when the read missed
+    int flightState;                                //Single flight role of the request
+    unsigned int flightHash;                        //Hash of the request bytes
+    unsigned int flightGeneration;                  //Key generation when the request was sent
+    RedisServantGroup* flightGroup;                 //Group the request is sent to
+    ClientPacket* flightNext;                       //Next leader of the bucket or next waiter
+    ClientPacket* flightWaiters;                    //Requests waiting for this reply
     int recvBufferOffset;                           //Current request buffer offset
     int sendBufferOffset;                           //Current reply buffer offset
+    RedisProtoParser recvParser;                    //Request parser
+    RedisProtoFrameScanner sendScanner;             //Reply frame scanner
     RedisProtoParseResult recvParseResult;          //Request parse result
     RedisProtoParseResult sendParseResult;          //Reply parse result
     int sendToRedisBytes;                           //Send to redis bytes
     RedisServant* requestServant;                   //Object of request
+    long long requestTime;                          //When requestServant took the request, 0 once finished
     RedisConnection* redisSocket;                   //Redis socket
+    PipelineContext* pipeline;                      //Pipeline of the request
+    ClientPacket* pipelineNext;                     //Next request to the same servant
+    Vector<ClientPacket*> replyPackets;             //Sub packets referenced by the reply
+    Vector<IOSegment> requestSegments;              //Request assembled from the parent's bytes
+    WheelTimer timer;                               //Idle client or request to redis timeout
 };
 
 class Monitor
@@ -85,14 +129,36 @@ public:
     virtual void replyClientFinished(ClientPacket*) {}
 };
 
+#define HASH_STRATEGY_MODULO "modulo"
+#define HASH_STRATEGY_CRC16  "crc16"
+#define HASH_STRATEGY_JUMP   "jump"
+#define HASH_STRATEGY_KETAMA "ketama"
+
+struct RoutingReader;
+
 class RedisProxy : public TcpServer
 {
 public:
     enum {
         DefaultPort = 8221,
 
-        MaxHashValue = 1024,
+        MaxHashValue = RoutingTable::MaxHashValue,
         DefaultMaxHashValue = 128,
+        KetamaPointsPerWeight = 160,
+        RoutingQuiescentInterval = 200,     //Milliseconds
+
+        MaxPipelineDepth = 128      //Pipelined requests dispatched at once
+    };
+
+    //How keys become hash values and hash values become groups.
+    //ModuloHash and Crc16Hash take the hash_min/hash_max ranges of the
+    //groups, JumpHash and KetamaHash spread the hash values over the
+    //groups so that adding a group moves only its share of them.
+    enum HashStrategy {
+        ModuloHash = 0,
+        Crc16Hash,
+        JumpHash,
+        KetamaHash
     };
 
     RedisProxy(void);
@@ -119,6 +185,14 @@ public:
     void setMonitor(Monitor* monitor) { m_monitor = monitor; }
     Monitor* monitor(void) const { return m_monitor; }
 
+    void setHotKeyCache(HotKeyCache* cache) { m_hotKeyCache = cache; }
+    void setRequestCoalescingEnabled(bool b) { m_requestCoalescing = b; }
+    //Seconds a client may stay silent before it is disconnected, 0 for ever
+    void setClientTimeout(int seconds) { m_clientTimeout = seconds; }
+    int clientTimeout(void) const { return m_clientTimeout; }
+    bool requestCoalescingEnabled(void) const { return m_requestCoalescing; }
+    HotKeyCache* hotKeyCache(void) const { return m_hotKeyCache; }
+
     bool run(const HostAddress &addr);
     void stop(void);
 
@@ -126,39 +200,78 @@ public:
     bool setGroupMappingValue(int hashValue, RedisServantGroup* group);
     void setHashFunction(HashFunc func) { m_hashFunc = func; }
     void setMaxHashValue(int value) { m_maxHashValue = value; }
+    void setHashStrategy(int strategy) { m_hashStrategy = strategy; }
+    int hashStrategy(void) const { return m_hashStrategy; }
+    static int hashStrategyByName(const char* name);
+    static const char* hashStrategyName(int strategy);
+    //Two characters around the part of the keys that is hashed, empty
+    //to hash the whole keys
+    void setHashTag(const char* tag);
+    const char* hashTag(void) const { return m_hashTag; }
+    void assignHashValues(void);
 
     HashFunc hashFunction(void) const { return m_hashFunc; }
     int maxHashValue(void) const { return m_maxHashValue; }
     RedisServantGroup* hashForGroup(int hashValue) const;
+    int hashValue(const char* key, int len) const;
 
     int groupCount(void) const { return m_groups.size(); }
     RedisServantGroup* group(int index) const { return m_groups.at(index); }
     RedisServantGroup* group(const char* name) const;
-    RedisServantGroup* mapToGroup(const char* key, int len);
+    //migrationSource, if given, is set to the group the key may still be
+    //in while its hash value is migrating, NULL otherwise
+    RedisServantGroup* mapToGroup(const char* key, int len,
+                                  RedisServantGroup** migrationSource = NULL);
     void handleClientPacket(const char* key, int len, ClientPacket* packet);
+    void sendToGroup(RedisServantGroup* group, ClientPacket* packet);
+    HashMigrator* hashMigrator(void) { return &m_hashMigrator; }
 
     bool addGroupKeyMapping(const char* key, int len, RedisServantGroup* group);
     void removeGroupKeyMapping(const char* key, int len);
 
-    StringMap<RedisServantGroup*>& keyMapping(void) { return m_keyMapping; }
+    //The current routing table. It stays valid until the loop of the
+    //calling thread returns to its events
+    const RoutingTable* routingTable(void) const
+    { return __atomic_load_n(&m_routing, __ATOMIC_ACQUIRE); }
+
+    //Updates are serialized. The table returned by beginRoutingUpdate is
+    //changed and then published by endRoutingUpdate
+    RoutingTable* beginRoutingUpdate(void);
+    void endRoutingUpdate(RoutingTable* table);
 
     virtual Context* createContextObject(void);
     virtual void destroyContextObject(Context* c);
     virtual void closeConnection(Context* c);
     virtual void clientConnected(Context* c);
+    virtual void waitRequest(Context* c);
     virtual ReadStatus readingRequest(Context* c);
     virtual void readRequestFinished(Context* c);
     virtual void writeReply(Context* c);
     virtual void writeReplyFinished(Context* c);
 
 private:
+    void dispatchPipeline(ClientPacket* packet, int offset, int firstLen, bool more);
     static void vipHandler(socket_t, short, void*);
+    static void onClientTimeout(void* arg);
+    void addRoutingReader(EventLoop* loop);
+    void reclaimRoutingTables(void);
+    static void onRoutingQuiescent(socket_t, short, void*);
 
 private:
     Monitor* m_monitor;
+    HotKeyCache* m_hotKeyCache;
+    bool m_requestCoalescing;
+    int m_clientTimeout;
     HashFunc m_hashFunc;
     int m_maxHashValue;
-    RedisServantGroup* m_hashMapping[MaxHashValue];
+    int m_hashStrategy;
+    char m_hashTag[3];
+    RoutingTable* m_routing;
+    RoutingTable* m_retiredTables;          //Replaced, waiting for the readers
+    unsigned long long m_routingEpoch;      //Count of replaced tables
+    bool m_routingShared;                   //Readers may use the table
+    Vector<RoutingReader*> m_routingReaders;
+    Mutex m_routingMutex;
     Vector<RedisServantGroup*> m_groups;
     TcpSocket m_vipSocket;
     char m_vipName[256];
@@ -168,11 +281,11 @@ private:
     int  m_groupRetryTime;
     bool m_autoEjectGroup;
     bool m_ejectAfterRestoreEnabled;
-    StringMap<RedisServantGroup*> m_keyMapping;
     unsigned int m_threadPoolRefCount;
     EventLoopThreadPool* m_eventLoopThreadPool;
     Mutex m_groupMutex;
     ProxyManager m_proxyManager;
+    HashMigrator m_hashMigrator;
 
 private:
     RedisProxy(const RedisProxy&);
@@ -17,12 +17,24 @@
 * under the License.
 */
 
+#include <math.h>
+#include <string.h>
+
 #include "util/logger.h"
 #include "redisproxy.h"
 #include "redisservant.h"
+#include "redisservantgroup.h"
 
 RedisConnection::RedisConnection(void)
 {
+    m_connecting = false;
+    m_connectBegin = 0;
+    m_pool = NULL;
+    m_generation = 0;
+    m_pipe[0] = -1;
+    m_pipe[1] = -1;
+    m_pipeSize = 0;
+    m_pipeBytes = 0;
 }
 
 RedisConnection::~RedisConnection(void)
@@ -32,35 +44,334 @@ RedisConnection::~RedisConnection(void)
 
 bool RedisConnection::connect(const HostAddress& addr)
 {
-    timeval defaultVal;
-    socketlen_t len = sizeof(timeval);
+    disconnect();
     TcpSocket sock = TcpSocket::createTcpSocket();
     if (sock.isNull()) {
         Logger::log(Logger::Error, "RedisConnection::connect: %s", strerror(errno));
         return false;
     }
 
-    sock.option(SOL_SOCKET, SO_SNDTIMEO, (char*)&defaultVal, &len);
-
-    timeval sndTimeout = {1, 0};
-    sock.setOption(SOL_SOCKET, SO_SNDTIMEO, (char*)&sndTimeout, sizeof(timeval));
-    if (!sock.connect(addr)) {
+    sock.setNonBlocking();
+    sock.setNoDelay();
+    sock.setKeepAlive();
+    if (sock.nonblocking_connect(addr) == TcpSocket::IOError) {
         Logger::log(Logger::Error, "RedisConnection::connect: %s", strerror(errno));
         sock.close();
         return false;
     }
 
-    sock.setOption(SOL_SOCKET, SO_SNDTIMEO, (char*)&defaultVal, sizeof(timeval));
-    sock.setNonBlocking();
-    sock.setNoDelay();
-    sock.setKeepAlive();
     m_socket = sock;
+    m_connecting = true;
+    m_connectBegin = EventLoop::monotonicTime();
+    return true;
+}
+
+bool RedisConnection::connectFinished(void)
+{
+    m_connecting = false;
+    int err = m_socket.pendingError();
+    if (err != 0) {
+        Logger::log(Logger::Error, "RedisConnection::connect: %s", strerror(err));
+        disconnect();
+        return false;
+    }
     return true;
 }
 
+long long RedisConnection::connectTime(void) const
+{
+    return EventLoop::monotonicTime() - m_connectBegin;
+}
+
 void RedisConnection::disconnect(void)
 {
     m_socket.close();
+    m_connecting = false;
+    closePipe();
+}
+
+bool RedisConnection::openPipe(void)
+{
+#ifdef __linux__
+    if (m_pipe[0] >= 0) {
+        return true;
+    }
+    if (pipe2(m_pipe, O_NONBLOCK) != 0) {
+        Logger::log(Logger::Warning, "RedisConnection::openPipe: %s", strerror(errno));
+        m_pipe[0] = m_pipe[1] = -1;
+        return false;
+    }
+    m_pipeSize = fcntl(m_pipe[1], F_SETPIPE_SZ, (int)PipeSize);
+    if (m_pipeSize <= 0) {
+        m_pipeSize = fcntl(m_pipe[1], F_GETPIPE_SZ);
+    }
+    if (m_pipeSize <= 0) {
+        closePipe();
+        return false;
+    }
+    m_pipeBytes = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void RedisConnection::closePipe(void)
+{
+#ifndef WIN32
+    if (m_pipe[0] >= 0) {
+        ::close(m_pipe[0]);
+        ::close(m_pipe[1]);
+    }
+#endif
+    m_pipe[0] = -1;
+    m_pipe[1] = -1;
+    m_pipeBytes = 0;
+}
+
+
+
+
+RedisMultiplexConnection::RedisMultiplexConnection(RedisServant* servant, EventLoop* loop)
+{
+    m_servant = servant;
+    m_loop = loop;
+    m_sendBytes = 0;
+    m_recvOffset = 0;
+    m_pendingCount = 0;
+    m_writing = false;
+}
+
+RedisMultiplexConnection::~RedisMultiplexConnection(void)
+{
+    m_conn.disconnect();
+}
+
+bool RedisMultiplexConnection::open(const HostAddress& addr)
+{
+    if (m_conn.isActived()) {
+        return true;
+    }
+
+    if (!m_conn.connect(addr)) {
+        ++m_stats.failed;
+        return false;
+    }
+
+    //Requests posted during the handshake are buffered and written
+    //as soon as the socket becomes writable
+    socket_t sock = m_conn.m_socket.socket();
+    m_readEvent.set(m_loop, sock, EV_READ | EV_PERSIST, onReadable, this);
+    m_writeEvent.set(m_loop, sock, EV_WRITE, onWritable, this);
+    m_writeEvent.active(RedisConnection::ConnectTimeout);
+    m_writing = true;
+    return true;
+}
+
+void RedisMultiplexConnection::close(void)
+{
+    Vector<ClientPacket*> failed;
+    reset(failed);
+    for (int i = 0; i < failed.size(); ++i) {
+        failed.at(i)->setFinishedState(ClientPacket::RequestError);
+    }
+}
+
+bool RedisMultiplexConnection::post(ClientPacket* packet)
+{
+    if (!m_conn.isActived() && !open(m_servant->redisAddress())) {
+        return false;
+    }
+
+    IOSegment segs[16];
+    int offset = 0;
+    while (offset < packet->recvParseResult.protoBuffLen) {
+        int count = packet->fillRequestSegments(offset, segs, 16);
+        if (count == 0) {
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            m_sendBuff.append(segs[i].data, segs[i].size);
+            offset += segs[i].size;
+        }
+    }
+    m_pending.append(packet);
+    ++m_pendingCount;
+    if (m_servant->requestTimeout() > 0 && !m_timer.isActive()) {
+        m_timer.setHandler(onTimeout, this);
+        m_loop->timingWheel()->start(&m_timer, m_servant->requestTimeout());
+    }
+
+    //Everything posted before the loop runs again goes out in one send
+    if (!m_writing) {
+        m_writing = true;
+        m_writeEvent.trigger(EV_WRITE);
+    }
+    return true;
+}
+
+void RedisMultiplexConnection::reset(Vector<ClientPacket*>& failed)
+{
+    m_timer.stop();
+    if (m_conn.isActived()) {
+        m_readEvent.remove();
+        m_writeEvent.remove();
+        m_conn.disconnect();
+    }
+
+    while (1) {
+        ClientPacket* packet = m_pending.take(NULL);
+        if (packet != NULL) {
+            failed.append(packet);
+        } else {
+            break;
+        }
+    }
+    m_pendingCount = 0;
+    m_sendBuff.clear();
+    m_sendBytes = 0;
+    m_recvBuff.clear();
+    m_recvOffset = 0;
+    m_scanner.reset();
+    m_writing = false;
+}
+
+void RedisMultiplexConnection::onWritable(socket_t sock, short flags, void* arg)
+{
+    RedisMultiplexConnection* conn = (RedisMultiplexConnection*)arg;
+    if (!conn->m_conn.isActived()) {
+        return;
+    }
+
+    if (conn->m_conn.isConnecting()) {
+        if ((flags & EV_TIMEOUT) || !conn->m_conn.connectFinished()) {
+            ++conn->m_stats.failed;
+            Logger::log(Logger::Warning, "Multiplexed connection to redis (%s:%d) failed",
+                        conn->m_servant->redisAddress().ip(),
+                        conn->m_servant->redisAddress().port());
+            conn->close();
+            return;
+        }
+        ++conn->m_stats.succeeded;
+        conn->m_stats.totalTime += conn->m_conn.connectTime();
+        conn->m_readEvent.active();
+    }
+
+    IOBuffer& buf = conn->m_sendBuff;
+    TcpSocket socket(sock);
+    while (conn->m_sendBytes < buf.size()) {
+        IOSegment segs[TcpSocket::MaxSendSegments];
+        int count = buf.segments(conn->m_sendBytes, segs, TcpSocket::MaxSendSegments);
+        int ret = socket.nonblocking_sendv(segs, count);
+        if (ret == TcpSocket::IOAgain) {
+            conn->m_writeEvent.active();
+            return;
+        } else if (ret == TcpSocket::IOError) {
+            conn->close();
+            return;
+        }
+        conn->m_sendBytes += ret;
+    }
+
+    buf.clear();
+    conn->m_sendBytes = 0;
+    conn->m_writing = false;
+}
+
+void RedisMultiplexConnection::onReadable(socket_t sock, short, void* arg)
+{
+    RedisMultiplexConnection* conn = (RedisMultiplexConnection*)arg;
+    Vector<ClientPacket*> finished;
+    Vector<ClientPacket*> failed;
+
+    if (!conn->m_conn.isActived()) {
+        return;
+    }
+
+    IOBuffer& buf = conn->m_recvBuff;
+    IOBuffer::DirectCopy cp = buf.beginCopy();
+    TcpSocket socket(sock);
+    int ret = socket.nonblocking_recv(cp.address, cp.maxsize);
+    switch (ret) {
+    case TcpSocket::IOAgain:
+        break;
+    case TcpSocket::IOError:
+        Logger::log(Logger::Warning, "Multiplexed connection to redis (%s:%d) closed",
+                    conn->m_servant->redisAddress().ip(),
+                    conn->m_servant->redisAddress().port());
+        conn->reset(failed);
+        break;
+    default:
+        buf.endCopy(ret);
+        while (conn->m_recvOffset < buf.size()) {
+            RedisProtoFrameScanner& scanner = conn->m_scanner;
+            int ret = scanner.scan(buf, conn->m_recvOffset + (int)scanner.length());
+            if (ret >= 0 && !scanner.isFinished()) {
+                break;
+            }
+
+            ClientPacket* packet = conn->m_pending.take(NULL);
+            if (ret < 0 || packet == NULL) {
+                //The reply stream can not be matched to the requests anymore
+                if (packet != NULL) {
+                    failed.append(packet);
+                }
+                conn->reset(failed);
+                break;
+            }
+
+            int len = (int)scanner.length();
+            scanner.reset();
+            --conn->m_pendingCount;
+            packet->appendRedisReply(buf, conn->m_recvOffset, len);
+            conn->m_recvOffset += len;
+            finished.append(packet);
+        }
+
+        if (conn->m_recvOffset > 0) {
+            buf.remove(conn->m_recvOffset);
+            conn->m_recvOffset = 0;
+        }
+        break;
+    }
+
+    //Finishing a packet may post the next request of the same client
+    //to this connection, so the replies are delivered after parsing
+    for (int i = 0; i < finished.size(); ++i) {
+        ClientPacket* packet = finished.at(i);
+        packet->setFinishedState(ClientPacket::RequestFinished);
+    }
+    for (int i = 0; i < failed.size(); ++i) {
+        failed.at(i)->setFinishedState(ClientPacket::RequestError);
+    }
+}
+
+//Replies come in request order, the oldest request is the only one to
+//watch. Once it is late the connection can't be used anymore
+void RedisMultiplexConnection::onTimeout(void* arg)
+{
+    RedisMultiplexConnection* conn = (RedisMultiplexConnection*)arg;
+    ClientPacket* packet = conn->m_pending.head(NULL);
+    if (packet == NULL) {
+        return;
+    }
+
+    int timeout = conn->m_servant->requestTimeout();
+    int waited = (int)((EventLoop::monotonicTime() - packet->requestTime) / 1000);
+    if (waited < timeout) {
+        conn->m_loop->timingWheel()->start(&conn->m_timer, timeout - waited);
+        return;
+    }
+
+    Logger::log(Logger::Warning, "Request to redis (%s:%d) timed out, the multiplexed connection is reset",
+                conn->m_servant->redisAddress().ip(),
+                conn->m_servant->redisAddress().port());
+    Vector<ClientPacket*> failed;
+    conn->reset(failed);
+    failed.at(0)->setFinishedState(ClientPacket::RequestTimeout);
+    for (int i = 1; i < failed.size(); ++i) {
+        failed.at(i)->setFinishedState(ClientPacket::RequestError);
+    }
 }
 
 
@@ -68,13 +379,27 @@ void RedisConnection::disconnect(void)
 
 RedisConnectionPool::RedisConnectionPool(void)
 {
+    m_loop = NULL;
+    m_connectedFunc = NULL;
+    m_connectedArg = NULL;
     m_activeConnNums = 0;
     m_capacity = 0;
+    m_generation = 0;
 }
 
 RedisConnectionPool::~RedisConnectionPool(void)
 {
-    close();
+    while (1) {
+        RedisConnection* sock = m_pool.pop_back(NULL);
+        if (sock != NULL) {
+            delete sock;
+        } else {
+            break;
+        }
+    }
+    for (int i = 0; i < m_connecting.size(); ++i) {
+        delete m_connecting.at(i);
+    }
 }
 
 bool RedisConnectionPool::open(const HostAddress& addr, int capacity)
@@ -93,64 +418,61 @@ bool RedisConnectionPool::open(const HostAddress& addr, int capacity)
 
     for (int i = 0; i < m_capacity; ++i) {
         RedisConnection* sock = new RedisConnection;
-        if (!sock->connect(addr)) {
+        if (!startConnect(sock)) {
             delete sock;
-            close();
-            return false;
-        } else {
-            m_pool.push_back(sock);
+            break;
         }
     }
-    Logger::log(Logger::Message, "Creating successful. nums: %d", m_pool.size());
     return true;
 }
 
 RedisConnection *RedisConnectionPool::select(void)
 {
-    m_locker.lock();
     RedisConnection* sock = m_pool.pop_back(NULL);
     if (sock) {
         ++m_activeConnNums;
     } else {
-        if ((m_pool.size() + m_activeConnNums) < m_capacity) {
+        //The caller queues the request until the new connection is ready
+        if ((m_pool.size() + m_activeConnNums + m_connecting.size()) < m_capacity) {
             sock = new RedisConnection;
-            if (!sock->connect(m_redisAddress)) {
+            if (!startConnect(sock)) {
                 delete sock;
-                sock = NULL;
-            } else {
-                ++m_activeConnNums;
             }
+            sock = NULL;
         }
     }
-    m_locker.unlock();
     return sock;
 }
 
 void RedisConnectionPool::unSelect(RedisConnection *sock)
 {
-    m_locker.lock();
     m_pool.push_back(sock);
     --m_activeConnNums;
-    m_locker.unlock();
 }
 
 bool RedisConnectionPool::repairSocket(RedisConnection *sock)
 {
-    sock->disconnect();
-    return sock->connect(m_redisAddress);
+    //The connection leaves the active set and comes back through the
+    //connected handler once the new handshake is done. A stale one is
+    //not repaired, the pool has opened its replacement
+    if (isStale(sock) || !startConnect(sock)) {
+        return false;
+    }
+    --m_activeConnNums;
+    return true;
 }
 
 void RedisConnectionPool::free(RedisConnection *sock)
 {
     delete sock;
-    m_locker.lock();
     --m_activeConnNums;
-    m_locker.unlock();
 }
 
+//Connections in use are still counted as active. They are freed when
+//they come back, see isStale()
 void RedisConnectionPool::close(void)
 {
-    m_locker.lock();
+    ++m_generation;
     while (1) {
         RedisConnection* sock = m_pool.pop_back(NULL);
         if (sock != NULL) {
@@ -159,7 +481,297 @@ void RedisConnectionPool::close(void)
             break;
         }
     }
-    m_locker.unlock();
+
+    while (1) {
+        RedisConnection* sock = m_connecting.pop_back(NULL);
+        if (sock != NULL) {
+            sock->m_connEvent.remove();
+            delete sock;
+        } else {
+            break;
+        }
+    }
+}
+
+bool RedisConnectionPool::startConnect(RedisConnection* sock)
+{
+    if (!sock->connect(m_redisAddress)) {
+        ++m_stats.failed;
+        return false;
+    }
+
+    sock->m_pool = this;
+    sock->m_generation = m_generation;
+    sock->m_connEvent.set(m_loop, sock->m_socket.socket(), EV_WRITE, onConnected, sock);
+    sock->m_connEvent.active(RedisConnection::ConnectTimeout);
+    m_connecting.append(sock);
+    return true;
+}
+
+void RedisConnectionPool::removeConnecting(RedisConnection* sock)
+{
+    int count = m_connecting.size();
+    for (int i = 0; i < count; ++i) {
+        if (m_connecting.at(i) == sock) {
+            m_connecting.at(i) = m_connecting.at(count - 1);
+            m_connecting.pop_back(NULL);
+            break;
+        }
+    }
+}
+
+void RedisConnectionPool::onConnected(socket_t, short flags, void* arg)
+{
+    RedisConnection* sock = (RedisConnection*)arg;
+    RedisConnectionPool* pool = sock->m_pool;
+    pool->removeConnecting(sock);
+
+    if ((flags & EV_TIMEOUT) || !sock->connectFinished()) {
+        ++pool->m_stats.failed;
+        Logger::log(Logger::Warning, "Connect to redis (%s:%d) failed",
+                    pool->m_redisAddress.ip(), pool->m_redisAddress.port());
+        delete sock;
+        sock = NULL;
+    } else {
+        ++pool->m_stats.succeeded;
+        pool->m_stats.totalTime += sock->connectTime();
+        ++pool->m_activeConnNums;
+    }
+
+    if (pool->m_connectedFunc) {
+        pool->m_connectedFunc(sock, pool->m_connectedArg);
+    } else if (sock) {
+        pool->unSelect(sock);
+    }
+}
+
+
+
+RedisServantShard::RedisServantShard(RedisServant* servant, EventLoop* loop)
+{
+    m_servant = servant;
+    m_loop = loop;
+    m_generation = 0;
+    m_requestCount = 0;
+    m_muxIndex = 0;
+    m_syncEvent.setTimer(m_loop, RedisServant::onSyncShard, this);
+    m_connPool.setEventLoop(m_loop);
+    m_connPool.setConnectedHandler(RedisServant::onConnectionReady, this);
+}
+
+//Servants are destroyed at exit after the loop threads, so the events
+//registered with those loops are not touched here
+RedisServantShard::~RedisServantShard(void)
+{
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        delete m_muxConns.at(i);
+    }
+}
+
+int RedisServantShard::multiplexConnectionNums(void) const
+{
+    int count = 0;
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        if (m_muxConns.at(i)->isActived()) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+RedisConnectStats RedisServantShard::connectStats(void) const
+{
+    RedisConnectStats stats = m_connPool.connectStats();
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        stats.add(m_muxConns.at(i)->connectStats());
+    }
+    return stats;
+}
+
+int RedisServantShard::pendingRequestNums(void) const
+{
+    int count = m_requestCount;
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        count += m_muxConns.at(i)->pendingCount();
+    }
+    return count;
+}
+
+void RedisServantShard::open(void)
+{
+    const HostAddress& addr = m_servant->redisAddress();
+    int capacity = m_servant->shardConnectionNums();
+    if (!m_servant->isMultiplexed()) {
+        //A failed pool is refilled on demand by select()
+        m_connPool.open(addr, capacity);
+        return;
+    }
+
+    while (m_muxConns.size() < capacity) {
+        m_muxConns.append(new RedisMultiplexConnection(m_servant, m_loop));
+    }
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        if (!m_muxConns.at(i)->open(addr)) {
+            Logger::log(Logger::Warning, "Open multiplexed connection (%s:%d) failed",
+                        addr.ip(), addr.port());
+        }
+    }
+}
+
+void RedisServantShard::close(void)
+{
+    for (int i = 0; i < m_muxConns.size(); ++i) {
+        m_muxConns.at(i)->close();
+    }
+
+    m_connPool.close();
+    failRequests();
+}
+
+void RedisServantShard::dropStalledRequests(void)
+{
+    //Nothing is left to serve the waiting requests
+    if (m_connPool.activeConnectionNums() + m_connPool.connectingNums() == 0) {
+        failRequests();
+    }
+}
+
+void RedisServantShard::failRequests(void)
+{
+    while (1) {
+        ClientPacket* packet = m_requests.take(NULL);
+        if (packet != NULL) {
+            --m_requestCount;
+            packet->setFinishedState(ClientPacket::RequestError);
+        } else {
+            break;
+        }
+    }
+}
+
+
+
+CircuitBreaker::CircuitBreaker(void)
+{
+    m_errorRate = 0;
+    m_minRequests = 0;
+    m_ejectTime = 0;
+    m_state = Closed;
+    m_ejectFactor = 0;
+    m_openUntil = 0;
+    m_probeTime = 0;
+    m_windowStart = 0;
+    m_requests = 0;
+    m_failures = 0;
+    m_ejections = 0;
+}
+
+CircuitBreaker::~CircuitBreaker(void)
+{
+}
+
+void CircuitBreaker::setOption(int errorRate, int minRequests, int ejectTime)
+{
+    m_errorRate = errorRate;
+    m_minRequests = (minRequests > 0) ? minRequests : 1;
+    m_ejectTime = ejectTime;
+}
+
+bool CircuitBreaker::isAvailable(void) const
+{
+    long long now;
+    switch (state()) {
+    case Open:
+        now = EventLoop::monotonicTime();
+        return now >= __atomic_load_n(&m_openUntil, __ATOMIC_RELAXED);
+    case HalfOpen:
+        //A probe without an answer doesn't keep the servant out for ever
+        now = EventLoop::monotonicTime();
+        return now - __atomic_load_n(&m_probeTime, __ATOMIC_RELAXED) >= m_ejectTime * 1000LL;
+    default:
+        return true;
+    }
+}
+
+void CircuitBreaker::requestSent(long long now)
+{
+    int s = state();
+    if (s == Closed || !isAvailable()) {
+        return;
+    }
+    __atomic_store_n(&m_probeTime, now, __ATOMIC_RELAXED);
+    if (s == Open) {
+        __atomic_compare_exchange_n(&m_state, &s, (int)HalfOpen, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+CircuitBreaker::Result CircuitBreaker::requestFinished(long long sentTime, long long now, bool failed)
+{
+    int s = state();
+    switch (s) {
+    case Open:
+        //Sent before the ejection
+        return Ignored;
+    case HalfOpen:
+        if (sentTime < __atomic_load_n(&m_probeTime, __ATOMIC_RELAXED)) {
+            return Ignored;
+        }
+        if (failed) {
+            if (__atomic_compare_exchange_n(&m_state, &s, (int)Open, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                if (m_ejectFactor < MaxEjectFactor) {
+                    ++m_ejectFactor;
+                }
+                __atomic_store_n(&m_openUntil, now + m_ejectTime * 1000LL * m_ejectFactor,
+                                 __ATOMIC_RELAXED);
+                __atomic_add_fetch(&m_ejections, 1, __ATOMIC_RELAXED);
+            }
+            return Failed;
+        }
+        if (__atomic_compare_exchange_n(&m_state, &s, (int)Closed, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            m_ejectFactor = 0;
+            resetWindow(now);
+            return Restored;
+        }
+        return Passed;
+    default:
+        break;
+    }
+
+    if (now - __atomic_load_n(&m_windowStart, __ATOMIC_RELAXED) >= WindowTime) {
+        resetWindow(now);
+    }
+    int requests = __atomic_add_fetch(&m_requests, 1, __ATOMIC_RELAXED);
+    if (!failed) {
+        return Passed;
+    }
+    int failures = __atomic_add_fetch(&m_failures, 1, __ATOMIC_RELAXED);
+    if (requests >= m_minRequests && failures * 100 >= m_errorRate * requests) {
+        return TripWanted;
+    }
+    return Failed;
+}
+
+bool CircuitBreaker::trip(long long now)
+{
+    int s = Closed;
+    if (!__atomic_compare_exchange_n(&m_state, &s, (int)Open, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    m_ejectFactor = 1;
+    __atomic_store_n(&m_openUntil, now + m_ejectTime * 1000LL, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m_ejections, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void CircuitBreaker::resetWindow(long long now)
+{
+    __atomic_store_n(&m_windowStart, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_failures, 0, __ATOMIC_RELAXED);
 }
 
 
@@ -170,11 +782,29 @@ RedisServant::RedisServant(void)
     m_reconnCount = 0;
     m_actived = false;
     m_reconnectEnabled = true;
+    m_generation = 0;
+    m_loopPool = NULL;
+    m_outstanding = 0;
+    m_latency = 0;
+    m_limit = 0;
+    m_limitTime = 0;
+    m_rejected = 0;
+    m_group = NULL;
+}
+
+void RedisServant::setOption(const Option& opt)
+{
+    m_option = opt;
+    m_limit = opt.maxConcurrency;
+    m_breaker.setOption(opt.breakerErrorRate, opt.breakerMinRequests, opt.breakerEjectTime);
 }
 
 RedisServant::~RedisServant(void)
 {
-    stop();
+    m_actived = false;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        delete m_shards.at(i);
+    }
 
     if (m_connListener.isActived()) {
         m_connListener.disconnect();
@@ -188,65 +818,454 @@ bool RedisServant::start(void)
         return true;
     }
 
-    if (!m_connPool.open(m_redisAddress, m_option.poolSize)) {
+    if (m_option.poolSize <= 0) {
+        Logger::log(Logger::Error, "Start redis servant (%s:%d) failed: capacity parameter error",
+                    m_redisAddress.ip(), m_redisAddress.port());
         return false;
     }
 
-    if (m_connListener.connect(m_redisAddress)) {
-        m_connEvent.set(m_loop, m_connListener.m_socket.socket(), EV_READ, onDisconnected, this);
-        m_connEvent.active();
+    if (m_connListener.isConnecting()) {
+        return true;
     }
-    m_actived = true;
+
+    //The listener connection doubles as the reachability check, the
+    //shards connect from their own threads once it is established
+    if (!m_connListener.connect(m_redisAddress)) {
+        return false;
+    }
+    m_connEvent.set(m_loop, m_connListener.m_socket.socket(), EV_WRITE, onListenerConnected, this);
+    m_connEvent.active(RedisConnection::ConnectTimeout);
     return true;
 }
 
 void RedisServant::stop(void)
 {
-    m_locker.lock();
-    m_connPool.close();
-    while (1) {
-        ClientPacket* packet = m_requests.take(NULL);
-        if (packet != NULL) {
-            packet->setFinishedState(ClientPacket::RequestError);
+    if (!m_actived) {
+        return;
+    }
+    m_actived = false;
+    syncShards();
+}
+
+RedisServantShard* RedisServant::shard(EventLoop* loop) const
+{
+    int index = loop ? loop->index() : -1;
+    if (index < 0 || index >= m_shards.size()) {
+        index = 0;
+    }
+    return m_shards.at(index);
+}
+
+int RedisServant::connectionNums(void) const
+{
+    return shardConnectionNums() * m_shards.size();
+}
+
+int RedisServant::activeConnectionNums(void) const
+{
+    int count = 0;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        RedisServantShard* s = m_shards.at(i);
+        if (m_option.multiplexed) {
+            count += s->multiplexConnectionNums();
         } else {
-            break;
+            count += s->connectionPool()->activeConnectionNums();
         }
     }
-    m_actived = false;
-    m_locker.unlock();
+    return count;
 }
 
+int RedisServant::pendingRequestNums(void) const
+{
+    int count = 0;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        count += m_shards.at(i)->pendingRequestNums();
+    }
+    return count;
+}
+
+int RedisServant::queuedRequestNums(void) const
+{
+    int count = 0;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        count += m_shards.at(i)->queuedRequestNums();
+    }
+    return count;
+}
+
+RedisConnectStats RedisServant::connectStats(void) const
+{
+    RedisConnectStats stats;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        stats.add(m_shards.at(i)->connectStats());
+    }
+    return stats;
+}
+
+int RedisServant::shardConnectionNums(void) const
+{
+    //connection_num is split between the loops, each loop gets at least one
+    int shards = m_shards.size();
+    if (shards <= 1) {
+        return m_option.poolSize;
+    }
+    int count = (m_option.poolSize + shards - 1) / shards;
+    return (count > 0) ? count : 1;
+}
+
+void RedisServant::createShards(void)
+{
+    if (!m_shards.isEmpty()) {
+        return;
+    }
+
+    if (m_loopPool && m_loopPool->size() > 0) {
+        for (int i = 0; i < m_loopPool->size(); ++i) {
+            m_shards.append(new RedisServantShard(this, m_loopPool->thread(i)->eventLoop()));
+        }
+    } else {
+        m_shards.append(new RedisServantShard(this, m_loop));
+    }
+}
+
+void RedisServant::syncShards(void)
+{
+    //The shards are only touched by their own threads, ask them to catch up
+    for (int i = 0; i < m_shards.size(); ++i) {
+        m_shards.at(i)->m_syncEvent.trigger();
+    }
+}
+
+void RedisServant::onSyncShard(socket_t, short, void* arg)
+{
+    RedisServantShard* shard = (RedisServantShard*)arg;
+    RedisServant* servant = shard->m_servant;
+    if (!servant->m_actived) {
+        shard->close();
+    } else if (shard->m_generation != servant->m_generation) {
+        //A restart after a disconnection drops the old connections
+        shard->close();
+        shard->open();
+        shard->m_generation = servant->m_generation;
+    }
+}
+
+//The latency (usec, as a float) and the time it was taken (msec, wrapping)
+//share one word, a thread never sees one of them without the other
+static unsigned long long packLatency(double latency, long long now)
+{
+    float f = (float)latency;
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return ((unsigned long long)bits << 32) | (unsigned int)(now / 1000);
+}
+
+//The latency of the packed value, decayed until now. w is set to the
+//weight the old latency keeps
+static double unpackLatency(unsigned long long packed, long long now, double* w)
+{
+    unsigned int bits = (unsigned int)(packed >> 32);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    int elapsed = (int)((unsigned int)(now / 1000) - (unsigned int)packed);
+    *w = (elapsed > 0) ? exp(-elapsed * 1000.0 / RedisServant::LatencyDecayTime) : 1.0;
+    return f * *w;
+}
+
+double RedisServant::latency(long long now) const
+{
+    double w;
+    return unpackLatency(__atomic_load_n(&m_latency, __ATOMIC_RELAXED), now, &w);
+}
+
+//Called once for each request handled, when it finishes. Only the reply
+//time of answered requests is taken
+void RedisServant::requestFinished(ClientPacket* packet)
+{
+    __atomic_sub_fetch(&m_outstanding, 1, __ATOMIC_RELAXED);
+    int state = packet->finishedState;
+    if (state != ClientPacket::RequestFinished && state != ClientPacket::RequestError &&
+            state != ClientPacket::RequestTimeout) {
+        return;
+    }
+
+    long long now = EventLoop::monotonicTime();
+    double rtt = (double)(now - packet->requestTime);
+    if (m_breaker.isEnabled()) {
+        bool slow = (m_option.breakerSlowTime > 0 && rtt > m_option.breakerSlowTime * 1000.0);
+        judgeRequest(packet->requestTime, now, state != ClientPacket::RequestFinished || slow);
+    }
+    if (state != ClientPacket::RequestFinished) {
+        return;
+    }
+
+    //The peak is taken against the decayed latency, as latency(now) sees
+    //it. The estimate is shared by the loops, a late writer retries so
+    //that it never overwrites a peak just recorded
+    unsigned long long packed = __atomic_load_n(&m_latency, __ATOMIC_RELAXED);
+    unsigned long long next;
+    do {
+        double w;
+        double latency = unpackLatency(packed, now, &w);
+        if (rtt < latency) {
+            latency += rtt * (1 - w);
+        } else {
+            latency = rtt;
+        }
+        next = packLatency(latency, now);
+    } while (!__atomic_compare_exchange_n(&m_latency, &packed, next, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    adaptConcurrencyLimit(now, rtt);
+}
+
+//A master is only ejected while another master takes the writes, a slave
+//while another servant takes the reads
+void RedisServant::judgeRequest(long long sentTime, long long now, bool failed)
+{
+    switch (m_breaker.requestFinished(sentTime, now, failed)) {
+    case CircuitBreaker::TripWanted:
+        if ((m_group == NULL || m_group->canEject(this)) && m_breaker.trip(now)) {
+            Logger::log(Logger::Warning, "Redis (%s:%d) ejected for %d ms, too many requests failed",
+                        m_redisAddress.ip(), m_redisAddress.port(), m_option.breakerEjectTime);
+        }
+        break;
+    case CircuitBreaker::Restored:
+        Logger::log(Logger::Message, "Redis (%s:%d) restored after an ejection",
+                    m_redisAddress.ip(), m_redisAddress.port());
+        break;
+    default:
+        break;
+    }
+}
+
+int RedisServant::concurrencyLimit(void) const
+{
+    if (m_option.maxConcurrency <= 0) {
+        return 0;
+    }
+    double limit;
+    __atomic_load(&m_limit, &limit, __ATOMIC_RELAXED);
+    return (int)limit;
+}
+
+void RedisServant::adaptConcurrencyLimit(long long now, double rtt)
+{
+    if (m_option.maxConcurrency <= 0 || m_option.maxLatency <= 0) {
+        return;
+    }
+
+    //The limit is shared by the loops, it is changed by compare and swap
+    //so that no increase is lost and no cut is undone
+    double limit;
+    double next;
+    __atomic_load(&m_limit, &limit, __ATOMIC_RELAXED);
+    if (rtt <= m_option.maxLatency * 1000.0) {
+        do {
+            next = limit + 1 / limit;
+            if (next > m_option.maxConcurrency) {
+                next = m_option.maxConcurrency;
+            }
+        } while (!__atomic_compare_exchange(&m_limit, &limit, &next, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return;
+    }
+
+    //The requests sent along with this one are late too, the limit is cut
+    //once for all of them by the thread that claims the cut time
+    long long time = __atomic_load_n(&m_limitTime, __ATOMIC_RELAXED);
+    if (now - time < (long long)rtt ||
+            !__atomic_compare_exchange_n(&m_limitTime, &time, now, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int minLimit = (m_option.maxConcurrency < MinConcurrencyLimit) ?
+                m_option.maxConcurrency : MinConcurrencyLimit;
+    do {
+        next = limit * 0.9;
+        if (next < minLimit) {
+            next = minLimit;
+        }
+    } while (!__atomic_compare_exchange(&m_limit, &limit, &next, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void RedisServant::reject(ClientPacket* packet)
+{
+    __atomic_add_fetch(&m_rejected, 1, __ATOMIC_RELAXED);
+    packet->setFinishedState(ClientPacket::RequestRejected);
+}
 
 void RedisServant::handle(ClientPacket* packet)
 {
     packet->requestServant = this;
-    RedisConnection* sock = m_connPool.select();
-    if (sock == NULL) {
-        m_locker.lock();
-        if (m_actived) {
-            m_requests.append(packet);
-            m_locker.unlock();
+    if (!m_actived) {
+        packet->setFinishedState(ClientPacket::RequestError);
+        return;
+    }
+    int limit = concurrencyLimit();
+    if (limit > 0 && outstandingRequests() >= limit) {
+        reject(packet);
+        return;
+    }
+    packet->requestTime = EventLoop::monotonicTime();
+    __atomic_add_fetch(&m_outstanding, 1, __ATOMIC_RELAXED);
+    if (m_breaker.isEnabled()) {
+        m_breaker.requestSent(packet->requestTime);
+    }
+
+    RedisServantShard* s = shard(packet->eventLoop);
+    if (m_option.multiplexed) {
+        //Requests of one pipeline stick to a connection to keep their order
+        int count = s->m_muxConns.size();
+        unsigned int index;
+        if (packet->pipeline) {
+            index = (unsigned int)(((size_t)packet->pipeline) >> 4);
         } else {
-            m_locker.unlock();
-            packet->setFinishedState(ClientPacket::RequestError);
+            index = s->m_muxIndex++;
         }
+        for (int i = 0; i < count; ++i) {
+            RedisMultiplexConnection* conn = s->m_muxConns.at((index + i) % count);
+            if (conn->post(packet)) {
+                return;
+            }
+        }
+        packet->setFinishedState(ClientPacket::RequestError);
+        return;
+    }
+
+    RedisConnection* sock = s->m_connPool.select();
+    if (sock == NULL) {
+        if (m_option.maxQueueSize > 0 && s->m_requestCount >= m_option.maxQueueSize) {
+            reject(packet);
+            return;
+        }
+        s->m_requests.append(packet);
+        ++s->m_requestCount;
+        if (m_option.queueTimeout > 0 && !s->m_queueTimer.isActive()) {
+            s->m_queueTimer.setHandler(onQueueTimeout, s);
+            s->m_loop->timingWheel()->start(&s->m_queueTimer, m_option.queueTimeout);
+        }
+        s->dropStalledRequests();
     } else {
-        packet->redisSocket = sock;
-        onSendRequest(sock->m_socket.socket(), 0, packet);
+        sendRequest(packet, sock);
     }
 }
 
-void RedisServant::onRedisSocketUseCompleted(RedisConnection* sock)
+void RedisServant::sendRequest(ClientPacket* packet, RedisConnection* sock)
 {
-    m_locker.lock();
-    ClientPacket* packet = m_requests.take(NULL);
-    m_locker.unlock();
+    packet->redisSocket = sock;
+    if (m_option.requestTimeout > 0) {
+        packet->timer.setHandler(onRequestTimeout, packet);
+        packet->eventLoop->timingWheel()->start(&packet->timer, m_option.requestTimeout);
+    }
+    onSendRequest(sock->m_socket.socket(), 0, packet);
+}
+
+void RedisServant::onRedisSocketUseCompleted(RedisServantShard* s, RedisConnection* sock)
+{
+    //The requests waiting are served by the connections of the new pool
+    if (s->m_connPool.isStale(sock)) {
+        s->m_connPool.free(sock);
+        s->dropStalledRequests();
+        return;
+    }
+
+    ClientPacket* packet = s->m_requests.take(NULL);
     if (!packet) {
-        m_connPool.unSelect(sock);
+        s->m_connPool.unSelect(sock);
     } else {
-        packet->redisSocket = sock;
-        onSendRequest(sock->m_socket.socket(), 0, packet);
+        --s->m_requestCount;
+        sendRequest(packet, sock);
+    }
+}
+
+//Requests wait in arrival order, so only the oldest one is watched
+void RedisServant::onQueueTimeout(void* arg)
+{
+    RedisServantShard* s = (RedisServantShard*)arg;
+    int timeout = s->m_servant->m_option.queueTimeout;
+    long long now = EventLoop::monotonicTime();
+    while (1) {
+        ClientPacket* packet = s->m_requests.head(NULL);
+        if (packet == NULL) {
+            break;
+        }
+        int waited = (int)((now - packet->requestTime) / 1000);
+        if (waited < timeout) {
+            s->m_loop->timingWheel()->start(&s->m_queueTimer, timeout - waited);
+            break;
+        }
+        s->m_requests.take(NULL);
+        --s->m_requestCount;
+        packet->setFinishedState(ClientPacket::RequestTimeout);
+    }
+}
+
+//The late reply may still come, so the connection is opened again
+void RedisServant::onRequestTimeout(void* arg)
+{
+    ClientPacket* packet = (ClientPacket*)arg;
+    RedisConnection* redisSocket = packet->redisSocket;
+    RedisServantShard* shard = packet->requestServant->shard(packet->eventLoop);
+    RedisConnectionPool* pool = shard->connectionPool();
+    Logger::log(Logger::Warning, "Request to redis (%s:%d) timed out",
+                pool->redisAddress().ip(), pool->redisAddress().port());
+    packet->_event.remove();
+    if (!pool->repairSocket(redisSocket)) {
+        pool->free(redisSocket);
+        shard->dropStalledRequests();
     }
+    packet->setFinishedState(ClientPacket::RequestTimeout);
+}
+
+void RedisServant::onStreamTimeout(void* arg)
+{
+    ClientPacket* packet = (ClientPacket*)arg;
+    packet->_event.remove();
+    abortStreamReply(packet);
+}
+
+void RedisServant::onConnectionReady(RedisConnection* sock, void* arg)
+{
+    RedisServantShard* s = (RedisServantShard*)arg;
+    if (sock != NULL) {
+        s->m_servant->onRedisSocketUseCompleted(s, sock);
+        return;
+    }
+
+    s->dropStalledRequests();
+}
+
+void RedisServant::onListenerConnected(socket_t sock, short flags, void* arg)
+{
+    RedisServant* servant = (RedisServant*)arg;
+    if ((flags & EV_TIMEOUT) || !servant->m_connListener.connectFinished()) {
+        Logger::log(Logger::Warning, "Connect to redis (%s:%d) failed",
+                    servant->redisAddress().ip(),
+                    servant->redisAddress().port());
+        servant->m_connListener.disconnect();
+        servant->reconnectLater();
+        return;
+    }
+
+    servant->m_connEvent.set(servant->m_loop, sock, EV_READ, onDisconnected, servant);
+    servant->m_connEvent.active();
+
+    servant->createShards();
+    ++servant->m_generation;
+    servant->m_reconnCount = 0;
+    servant->m_actived = true;
+    servant->syncShards();
+}
+
+void RedisServant::reconnectLater(void)
+{
+    if (!m_reconnectEnabled) {
+        return;
+    }
+    m_connEvent.setTimer(m_loop, onReconnect, this);
+    m_connEvent.active(m_option.reconnInterval * 1000);
+    Logger::log(Logger::Message, "After %d second(s) reconnection...", m_option.reconnInterval);
 }
 
 void RedisServant::onReconnect(socket_t, short, void* arg)
@@ -265,11 +1284,7 @@ void RedisServant::onReconnect(socket_t, short, void* arg)
     ++servant->m_reconnCount;
     Logger::log(Logger::Message, "(%d) Reconnect to redis...", servant->m_reconnCount);
     if (!servant->start()) {
-        servant->m_connEvent.setTimer(servant->m_loop, onReconnect, servant);
-        servant->m_connEvent.active(opt.reconnInterval * 1000);
-        Logger::log(Logger::Message, "After %d second(s) reconnection...", opt.reconnInterval);
-    } else {
-        servant->m_reconnCount = 0;
+        servant->reconnectLater();
     }
 }
 
@@ -295,12 +1310,15 @@ void RedisServant::onSendRequest(socket_t sock, short, void *arg)
     ClientPacket* packet = (ClientPacket*)arg;
     RedisConnection* redisSocket = packet->redisSocket;
     RedisServant* redisServant = packet->requestServant;
+    RedisServantShard* shard = redisServant->shard(packet->eventLoop);
+    RedisConnectionPool* pool = shard->connectionPool();
 
-    char* sendBuff = packet->recvParseResult.protoBuff + packet->sendToRedisBytes;
-    int sendSize = packet->recvParseResult.protoBuffLen - packet->sendToRedisBytes;
+    IOSegment segs[TcpSocket::MaxSendSegments];
+    int count = packet->fillRequestSegments(packet->sendToRedisBytes, segs,
+                                            TcpSocket::MaxSendSegments);
 
     TcpSocket socket(sock);
-    int ret = socket.nonblocking_send(sendBuff, sendSize);
+    int ret = socket.nonblocking_sendv(segs, count);
     switch (ret) {
     default:
         packet->sendToRedisBytes += ret;
@@ -316,10 +1334,9 @@ void RedisServant::onSendRequest(socket_t sock, short, void *arg)
         packet->_event.active();
         break;
     case TcpSocket::IOError:
-        if (!redisServant->m_connPool.repairSocket(redisSocket)) {
-            redisServant->m_connPool.free(redisSocket);
-        } else {
-            redisServant->onRedisSocketUseCompleted(redisSocket);
+        if (!pool->repairSocket(redisSocket)) {
+            pool->free(redisSocket);
+            shard->dropStalledRequests();
         }
         packet->setFinishedState(ClientPacket::RequestError);
         break;
@@ -331,6 +1348,8 @@ void RedisServant::onRecvReply(socket_t sock, short, void *arg)
     ClientPacket* packet = (ClientPacket*)arg;
     RedisConnection* redisSocket = packet->redisSocket;
     RedisServant* redisServant = packet->requestServant;
+    RedisServantShard* shard = redisServant->shard(packet->eventLoop);
+    RedisConnectionPool* pool = shard->connectionPool();
     IOBuffer& sendbuf = packet->sendBuff;
     IOBuffer::DirectCopy cp = sendbuf.beginCopy();
     TcpSocket socket(sock);
@@ -340,14 +1359,25 @@ void RedisServant::onRecvReply(socket_t sock, short, void *arg)
         sendbuf.endCopy(ret);
         switch (packet->parseSendBuffer()) {
         case RedisProto::ProtoError:
-            redisServant->onRedisSocketUseCompleted(redisSocket);
+            redisServant->onRedisSocketUseCompleted(shard, redisSocket);
             packet->setFinishedState(ClientPacket::RequestError);
             break;
         case RedisProto::ProtoIncomplete:
-            onRecvReply(sock, 0, packet);
+            //A large reply to a plain client request is passed on while
+            //it is received instead of being buffered as a whole, unless
+            //other requests wait for it
+            if (sendbuf.size() >= StreamReplySize &&
+                    packet->finished_func == ClientPacket::defaultFinishedHandler &&
+                    packet->pipeline == NULL && !packet->clientSocket.isNull() &&
+                    SingleFlight::release(packet)) {
+                packet->sendBytes = 0;
+                onStreamReply(sock, 0, packet);
+            } else {
+                onRecvReply(sock, 0, packet);
+            }
             break;
         case RedisProto::ProtoOK:
-            redisServant->onRedisSocketUseCompleted(redisSocket);
+            redisServant->onRedisSocketUseCompleted(shard, redisSocket);
             packet->setFinishedState(ClientPacket::RequestFinished);
             break;
         default:
@@ -359,13 +1389,135 @@ void RedisServant::onRecvReply(socket_t sock, short, void *arg)
         packet->_event.active();
         break;
     case TcpSocket::IOError:
-        if (!redisServant->m_connPool.repairSocket(redisSocket)) {
-            redisServant->m_connPool.free(redisSocket);
-        } else {
-            redisServant->onRedisSocketUseCompleted(redisSocket);
+        if (!pool->repairSocket(redisSocket)) {
+            pool->free(redisSocket);
+            shard->dropStalledRequests();
         }
         packet->setFinishedState(ClientPacket::RequestError);
         break;
     }
 }
 
+//Passes a large reply on to the client while it is received. sendBuff
+//holds the received bytes not yet written to the client, the bulk data
+//of the reply is spliced from the redis socket to the client on Linux
+void RedisServant::onStreamReply(socket_t, short, void* arg)
+{
+    ClientPacket* packet = (ClientPacket*)arg;
+    RedisServant* servant = packet->requestServant;
+    if (servant->m_option.requestTimeout > 0) {
+        //The reply may be long, only a stall is a timeout
+        packet->timer.setHandler(onStreamTimeout, packet);
+        packet->eventLoop->timingWheel()->start(&packet->timer, servant->m_option.requestTimeout);
+    }
+    RedisConnection* redisSocket = packet->redisSocket;
+    RedisProtoFrameScanner& scanner = packet->sendScanner;
+    TcpSocket& client = packet->clientSocket;
+    TcpSocket& redis = redisSocket->m_socket;
+    IOBuffer& buf = packet->sendBuff;
+    while (1) {
+        if (packet->sendBytes < buf.size()) {
+            IOSegment segs[TcpSocket::MaxSendSegments];
+            int count = buf.segments(packet->sendBytes, segs, TcpSocket::MaxSendSegments);
+            int ret = client.nonblocking_sendv(segs, count);
+            if (ret == TcpSocket::IOAgain) {
+                packet->_event.set(packet->eventLoop, client.socket(), EV_WRITE, onStreamReply, packet);
+                packet->_event.active();
+                return;
+            } else if (ret == TcpSocket::IOError) {
+                abortStreamReply(packet);
+                return;
+            }
+            packet->sendBytes += ret;
+            continue;
+        }
+
+#ifdef __linux__
+        if (redisSocket->m_pipeBytes > 0) {
+            ssize_t ret = splice(redisSocket->m_pipe[0], NULL, client.socket(), NULL,
+                                 redisSocket->m_pipeBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret < 0 && errno == EAGAIN) {
+                packet->_event.set(packet->eventLoop, client.socket(), EV_WRITE, onStreamReply, packet);
+                packet->_event.active();
+                return;
+            } else if (ret <= 0) {
+                abortStreamReply(packet);
+                return;
+            }
+            redisSocket->m_pipeBytes -= (int)ret;
+            continue;
+        }
+#endif
+
+        if (scanner.isFinished()) {
+            RedisServantShard* shard = packet->requestServant->shard(packet->eventLoop);
+            buf.clear();
+            packet->sendBytes = 0;
+            scanner.reset();
+            packet->sendBufferOffset = 0;
+            packet->requestServant->onRedisSocketUseCompleted(shard, redisSocket);
+            packet->setFinishedState(ClientPacket::RequestFinished);
+            return;
+        }
+
+        //The memory is kept for the next piece of the reply
+        buf.remove(buf.size());
+        packet->sendBytes = 0;
+
+#ifdef __linux__
+        if (scanner.bulkBytesLeft() >= StreamReplySize && redisSocket->openPipe()) {
+            long long size = scanner.bulkBytesLeft();
+            if (size > redisSocket->m_pipeSize) {
+                size = redisSocket->m_pipeSize;
+            }
+            ssize_t ret = splice(redis.socket(), NULL, redisSocket->m_pipe[1], NULL,
+                                 size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret < 0 && errno == EAGAIN) {
+                packet->_event.set(packet->eventLoop, redis.socket(), EV_READ, onStreamReply, packet);
+                packet->_event.active();
+                return;
+            } else if (ret <= 0) {
+                abortStreamReply(packet);
+                return;
+            }
+            scanner.skipBulk(ret);
+            redisSocket->m_pipeBytes += (int)ret;
+            continue;
+        }
+#endif
+
+        IOBuffer::DirectCopy cp = buf.beginCopy();
+        int ret = redis.nonblocking_recv(cp.address, cp.maxsize);
+        if (ret == TcpSocket::IOAgain) {
+            packet->_event.set(packet->eventLoop, redis.socket(), EV_READ, onStreamReply, packet);
+            packet->_event.active();
+            return;
+        } else if (ret == TcpSocket::IOError) {
+            abortStreamReply(packet);
+            return;
+        }
+        int size = scanner.scan(cp.address, ret);
+        if (size < 0) {
+            abortStreamReply(packet);
+            return;
+        }
+        buf.endCopy(size);
+    }
+}
+
+//Part of the reply has already been written, so neither connection can
+//be used for other requests
+void RedisServant::abortStreamReply(ClientPacket* packet)
+{
+    RedisConnection* redisSocket = packet->redisSocket;
+    RedisServantShard* shard = packet->requestServant->shard(packet->eventLoop);
+    RedisConnectionPool* pool = shard->connectionPool();
+    Logger::log(Logger::Warning, "Streaming a reply from redis(%s:%d) to client(%s:%d) failed",
+                pool->redisAddress().ip(), pool->redisAddress().port(),
+                packet->clientAddress.ip(), packet->clientAddress.port());
+    if (!pool->repairSocket(redisSocket)) {
+        pool->free(redisSocket);
+        shard->dropStalledRequests();
+    }
+    packet->server->closeConnection(packet);
+}
@@ -22,39 +22,141 @@
 
 #include "util/vector.h"
 #include "util/queue.h"
-#include "util/locker.h"
 #include "util/tcpsocket.h"
+#include "util/iobuffer.h"
 
 #include "eventloop.h"
+#include "timingwheel.h"
+#include "redisproto.h"
 
 class ClientPacket;
+class RedisServant;
+class RedisServantGroup;
+class RedisConnectionPool;
 class RedisConnection
 {
 public:
+    enum {
+        ConnectTimeout = 1000,      //Handshake timeout (msec)
+        PipeSize = 1024 * 256       //Pipe of spliced reply bytes
+    };
+
     RedisConnection(void);
     ~RedisConnection(void);
 
+    //Start a non-blocking connect. The connection is connecting until
+    //connectFinished() is called once the socket becomes writable
     bool connect(const HostAddress& addr);
+    bool connectFinished(void);
+    bool isConnecting(void) const { return m_connecting; }
+    long long connectTime(void) const;
     bool isActived(void) const { return !m_socket.isNull(); }
     void disconnect(void);
 
+private:
+    bool openPipe(void);
+    void closePipe(void);
+
 private:
     TcpSocket m_socket;
+    bool m_connecting;
+    long long m_connectBegin;
+    RedisConnectionPool* m_pool;
+    int m_generation;                       //Pool generation it was connected in
+    Event m_connEvent;
+    int m_pipe[2];                          //Bytes spliced to the client
+    int m_pipeSize;
+    int m_pipeBytes;
     friend class RedisConnectionPool;
     friend class RedisServant;
+    friend class RedisMultiplexConnection;
+};
+
+
+//Handshake counters of the connections to one redis
+struct RedisConnectStats
+{
+    RedisConnectStats(void) : succeeded(0), failed(0), totalTime(0) {}
+
+    void add(const RedisConnectStats& other) {
+        succeeded += other.succeeded;
+        failed += other.failed;
+        totalTime += other.totalTime;
+    }
+
+    int succeeded;
+    int failed;
+    long long totalTime;        //Microseconds spent in successful handshakes
 };
 
 
+//Long-lived connection shared by many clients. Requests are written
+//back-to-back and replies are matched through a FIFO of pending packets.
+//The connection belongs to one event loop and is only used from its thread
+class RedisMultiplexConnection
+{
+public:
+    RedisMultiplexConnection(RedisServant* servant, EventLoop* loop);
+    ~RedisMultiplexConnection(void);
+
+    bool open(const HostAddress& addr);
+    void close(void);
+    bool isActived(void) const { return m_conn.isActived() && !m_conn.isConnecting(); }
+    int pendingCount(void) const { return m_pendingCount; }
+    const RedisConnectStats& connectStats(void) const { return m_stats; }
+
+    bool post(ClientPacket* packet);
+
+private:
+    void reset(Vector<ClientPacket*>& failed);
+    static void onWritable(socket_t sock, short flags, void* arg);
+    static void onReadable(socket_t sock, short, void* arg);
+    static void onTimeout(void* arg);
+
+private:
+    RedisServant* m_servant;
+    EventLoop* m_loop;
+    RedisConnection m_conn;
+    IOBuffer m_sendBuff;
+    int m_sendBytes;
+    IOBuffer m_recvBuff;
+    int m_recvOffset;
+    Queue<ClientPacket*> m_pending;
+    int m_pendingCount;
+    bool m_writing;
+    RedisProtoFrameScanner m_scanner;
+    RedisConnectStats m_stats;
+    Event m_readEvent;
+    Event m_writeEvent;
+    WheelTimer m_timer;                 //Deadline of the oldest pending request
+
+private:
+    RedisMultiplexConnection(const RedisMultiplexConnection&);
+    RedisMultiplexConnection& operator =(const RedisMultiplexConnection&);
+};
+
+
+//Connections are opened in the background. Once a handshake finishes the
+//connected handler gets the connection, already counted as active, and
+//has to use or unSelect() it. A failed handshake calls it with NULL
 class RedisConnectionPool
 {
 public:
+    typedef void (*ConnectedHandler)(RedisConnection* sock, void* arg);
+
     RedisConnectionPool(void);
     ~RedisConnectionPool(void);
 
+    void setEventLoop(EventLoop* loop) { m_loop = loop; }
+    void setConnectedHandler(ConnectedHandler func, void* arg)
+    { m_connectedFunc = func; m_connectedArg = arg; }
+
     const HostAddress& redisAddress(void) const { return m_redisAddress; }
     int capacity(void) const { return m_capacity; }
     int activeConnectionNums(void) const { return m_activeConnNums; }
     int unActiveConnectionNums(void) const { return m_pool.size(); }
+    int connectingNums(void) const { return m_connecting.size(); }
+    const RedisConnectStats& connectStats(void) const { return m_stats; }
 
     bool open(const HostAddress& addr, int capacity);
     RedisConnection* select(void);
@@ -63,23 +165,156 @@ public:
     void free(RedisConnection* sock);
     void close(void);
 
+    //Connected before the last close(), in use while the pool restarted
+    bool isStale(RedisConnection* sock) const { return sock->m_generation != m_generation; }
+
+private:
+    bool startConnect(RedisConnection* sock);
+    void removeConnecting(RedisConnection* sock);
+    static void onConnected(socket_t sock, short flags, void* arg);
+
 private:
     HostAddress m_redisAddress;
-    SpinLocker m_locker;
+    EventLoop* m_loop;
+    ConnectedHandler m_connectedFunc;
+    void* m_connectedArg;
     int m_capacity;
     int m_activeConnNums;
+    int m_generation;                   //Bumped by close()
     Vector<RedisConnection*> m_pool;
+    Vector<RedisConnection*> m_connecting;
+    RedisConnectStats m_stats;
+};
+
+
+//Backend connections and waiting requests of one servant owned by one
+//event loop. Only the owning loop thread touches them, so no lock is needed
+class RedisServantShard
+{
+public:
+    RedisServantShard(RedisServant* servant, EventLoop* loop);
+    ~RedisServantShard(void);
+
+    EventLoop* eventLoop(void) const { return m_loop; }
+    RedisConnectionPool* connectionPool(void) const
+    { return (RedisConnectionPool*)&m_connPool; }
+    int multiplexConnectionNums(void) const;
+    int pendingRequestNums(void) const;
+    int queuedRequestNums(void) const { return m_requestCount; }
+    RedisConnectStats connectStats(void) const;
+
+private:
+    void open(void);
+    void close(void);
+    void failRequests(void);
+    void dropStalledRequests(void);
+
+private:
+    RedisServant* m_servant;
+    EventLoop* m_loop;
+    unsigned int m_generation;
+    RedisConnectionPool m_connPool;
+    Queue<ClientPacket*> m_requests;
+    int m_requestCount;
+    Vector<RedisMultiplexConnection*> m_muxConns;
+    unsigned int m_muxIndex;
+    Event m_syncEvent;
+    WheelTimer m_queueTimer;            //Deadline of the oldest waiting request
+    friend class RedisServant;
+
+private:
+    RedisServantShard(const RedisServantShard&);
+    RedisServantShard& operator =(const RedisServantShard&);
+};
+
+
+//Takes a servant out of the selection while too many of its requests fail,
+//time out or are slow. A redis error reply is an answer, it doesn't fail.
+//The requests are counted in windows of WindowTime. Once the ejection is
+//over one request is let through as a probe: its success closes the
+//breaker, its failure ejects the servant again for a longer time. The
+//breaker is shared by the loops, it works with relaxed atomics and a
+//transition is won by one thread only
+class CircuitBreaker
+{
+public:
+    enum State {
+        Closed = 0,
+        Open,
+        HalfOpen
+    };
+
+    enum {
+        WindowTime = 1000000,       //Microseconds
+        MaxEjectFactor = 8          //Ejections get longer up to this factor
+    };
+
+    enum Result {
+        Ignored = 0,
+        Passed,
+        Failed,
+        TripWanted,                 //Failed and over the error rate
+        Restored                    //The probe passed, the breaker is closed
+    };
+
+    CircuitBreaker(void);
+    ~CircuitBreaker(void);
+
+    //errorRate is in percent of the requests of a window, 0 to disable
+    void setOption(int errorRate, int minRequests, int ejectTime);
+    bool isEnabled(void) const { return m_errorRate > 0; }
+
+    int state(void) const { return __atomic_load_n(&m_state, __ATOMIC_RELAXED); }
+    long long ejections(void) const { return __atomic_load_n(&m_ejections, __ATOMIC_RELAXED); }
+    //Closed, or ejected long enough to be probed
+    bool isAvailable(void) const;
+
+    void requestSent(long long now);
+    Result requestFinished(long long sentTime, long long now, bool failed);
+    bool trip(long long now);
+
+private:
+    void resetWindow(long long now);
+
+private:
+    int m_errorRate;
+    int m_minRequests;
+    int m_ejectTime;                //Milliseconds
+    int m_state;
+    int m_ejectFactor;
+    long long m_openUntil;
+    long long m_probeTime;          //When the last probe was sent
+    long long m_windowStart;
+    int m_requests;
+    int m_failures;
+    long long m_ejections;
 };
 
 class RedisServant
 {
 public:
+    enum {
+        StreamReplySize = 1024 * 64,    //Larger replies are streamed to the client
+        LatencyDecayTime = 1000000,     //Microseconds for the latency to fall by 1/e
+        MinConcurrencyLimit = 4         //The adaptive limit never falls below
+    };
+
     struct Option {
         Option(void) {
             name[0] = 0;
             maxReconnCount = 100;
             reconnInterval = 1;
             poolSize = 50;
+            multiplexed = false;
+            maxConcurrency = 0;
+            maxLatency = 0;
+            maxQueueSize = 0;
+            requestTimeout = 0;
+            queueTimeout = 0;
+            breakerErrorRate = 0;
+            breakerMinRequests = 20;
+            breakerSlowTime = 0;
+            breakerEjectTime = 5000;
         }
         ~Option(void) {}
 
@@ -87,6 +322,16 @@ public:
         int reconnInterval;
         int maxReconnCount;
         int poolSize;
+        bool multiplexed;
+        int maxConcurrency;     //Requests in flight or waiting, 0 for no limit
+        int maxLatency;         //Reply time (msec) the limit adapts to, 0 for a fixed limit
+        int maxQueueSize;       //Requests waiting for a connection per loop, 0 for no limit
+        int requestTimeout;     //Msec to wait for a reply once sent, 0 for no timeout
+        int queueTimeout;       //Msec to wait for a connection, 0 for no timeout
+        int breakerErrorRate;   //Percent failed to eject at (see CircuitBreaker), 0 is off
+        int breakerMinRequests; //Requests a window needs before it is judged
+        int breakerSlowTime;    //Msec after which a reply counts as failed, 0 for never
+        int breakerEjectTime;   //Msec of the first ejection
     };
 
     RedisServant(void);
@@ -96,7 +341,7 @@ public:
     void setRedisAddress(const HostAddress& addr) { m_redisAddress = addr; }
     const HostAddress& redisAddress(void) const { return m_redisAddress; }
 
-    void setOption(const Option& opt) { m_option = opt; }
+    void setOption(const Option& opt);
     Option option(void) const { return m_option; }
 
     void setReconnectEnabled(bool b) { m_reconnectEnabled = b; }
@@ -105,21 +350,74 @@ public:
     void setEventLoop(EventLoop* loop) { m_loop = loop; }
     EventLoop* eventLoop(void) const { return m_loop; }
 
-    RedisConnectionPool* connectionPool(void) const
-    { return (RedisConnectionPool*)&m_connPool; }
+    void setGroup(RedisServantGroup* group) { m_group = group; }
+    RedisServantGroup* group(void) const { return m_group; }
+
+    void setEventLoopThreadPool(EventLoopThreadPool* pool) { m_loopPool = pool; }
+    EventLoopThreadPool* eventLoopThreadPool(void) const { return m_loopPool; }
+
+    bool isMultiplexed(void) const { return m_option.multiplexed; }
+    int requestTimeout(void) const { return m_option.requestTimeout; }
+    int shardCount(void) const { return m_shards.size(); }
+    RedisServantShard* shard(int index) const { return m_shards.at(index); }
+    RedisServantShard* shard(EventLoop* loop) const;
+
+    int connectionNums(void) const;
+    int activeConnectionNums(void) const;
+    int pendingRequestNums(void) const;
+    int queuedRequestNums(void) const;
+    RedisConnectStats connectStats(void) const;
+
+    //Load seen by the policies. The counters are shared by the loops,
+    //they are updated without a lock and are only estimates
+    int outstandingRequests(void) const
+    { return __atomic_load_n(&m_outstanding, __ATOMIC_RELAXED); }
+    //Peak EWMA of the reply time in microseconds: a slower reply is taken
+    //at once, faster ones and idle time bring it down slowly
+    double latency(long long now) const;
+    //Expected wait of one more request, latency times outstanding requests
+    double loadCost(long long now) const
+    { return (latency(now) + 1) * (outstandingRequests() + 1); }
+    void requestFinished(ClientPacket* packet);
+
+    //Requests over the limit or finding the queue full are rejected at
+    //once. The limit grows by one per round of fast replies and is cut by
+    //a tenth when the replies get slower than Option::maxLatency
+    int concurrencyLimit(void) const;
+    long long rejectedRequests(void) const
+    { return __atomic_load_n(&m_rejected, __ATOMIC_RELAXED); }
 
     bool isActived(void) const { return m_actived; }
+    //Connected and not ejected by the circuit breaker
+    bool isUsable(void) const { return m_actived && m_breaker.isAvailable(); }
+    const CircuitBreaker& circuitBreaker(void) const { return m_breaker; }
     bool start(void);
     void stop(void);
 
     void handle(ClientPacket* packet);
 
 private:
-    void onRedisSocketUseCompleted(RedisConnection* sock);
+    void createShards(void);
+    void syncShards(void);
+    int shardConnectionNums(void) const;
+    void reconnectLater(void);
+    void onRedisSocketUseCompleted(RedisServantShard* shard, RedisConnection* sock);
+    void sendRequest(ClientPacket* packet, RedisConnection* sock);
+    static void onQueueTimeout(void* arg);
+    static void onRequestTimeout(void* arg);
+    static void onStreamTimeout(void* arg);
+    static void onConnectionReady(RedisConnection* sock, void* arg);
+    static void onSyncShard(socket_t, short, void* arg);
+    static void onListenerConnected(socket_t sock, short flags, void* arg);
     static void onDisconnected(socket_t sock, short, void* arg);
     static void onReconnect(socket_t sock, short, void* arg);
     static void onSendRequest(socket_t sock, short, void* arg);
     static void onRecvReply(socket_t sock, short, void* arg);
+    static void onStreamReply(socket_t, short, void* arg);
+    static void abortStreamReply(ClientPacket* packet);
+    void adaptConcurrencyLimit(long long now, double rtt);
+    void judgeRequest(long long sentTime, long long now, bool failed);
+    void reject(ClientPacket* packet);
 
 private:
     HostAddress m_redisAddress;
@@ -128,11 +426,19 @@ private:
     RedisConnection m_connListener;
     EventLoop* m_loop;
     Option m_option;
-    Queue<ClientPacket*> m_requests;
-    SpinLocker m_locker;
     bool m_actived;
     bool m_reconnectEnabled;
-    RedisConnectionPool m_connPool;
+    unsigned int m_generation;
+    EventLoopThreadPool* m_loopPool;
+    Vector<RedisServantShard*> m_shards;
+    int m_outstanding;
+    unsigned long long m_latency;       //Latency and its time, see packLatency()
+    double m_limit;
+    long long m_limitTime;              //When m_limit was last cut
+    long long m_rejected;
+    RedisServantGroup* m_group;
+    CircuitBreaker m_breaker;
+    friend class RedisServantShard;
 
 private:
     RedisServant(const RedisServant&);
@@ -46,6 +46,12 @@ RedisServantGroupPolicy *RedisServantGroupPolicy::createPolicy(const char *name)
         return new MasterOnlyPolicy;
     } else if (strcmp(name, POLICY_READ_BALANCE) == 0) {
         return new ReadBalancePolicy;
+    } else if (strcmp(name, POLICY_LEAST_OUTSTANDING) == 0) {
+        return new LeastOutstandingPolicy;
+    } else if (strcmp(name, POLICY_PEAK_EWMA) == 0) {
+        return new PeakEwmaPolicy;
+    } else if (strcmp(name, POLICY_P2C) == 0) {
+        return new PowerOfTwoChoicesPolicy;
     } else {
         return new MasterOnlyPolicy;
     }
@@ -57,6 +63,7 @@ RedisServantGroupPolicy *RedisServantGroupPolicy::createPolicy(const char *name)
 RedisServantGroup::RedisServantGroup(void)
 {
     m_groupId = -1;
+    m_weight = 1;
     m_masterCount = 0;
     m_slaveCount = 0;
     m_policy = NULL;
@@ -102,6 +109,7 @@ void RedisServantGroup::addMasterRedisServant(RedisServant *servant)
         }
         m_master[m_masterCount] = servant;
         ++m_masterCount;
+        servant->setGroup(this);
     }
 }
 
@@ -113,6 +121,7 @@ void RedisServantGroup::addSlaveRedisServant(RedisServant *servant)
         }
         m_slaver[m_slaveCount] = servant;
         ++m_slaveCount;
+        servant->setGroup(this);
     }
 }
 
@@ -135,6 +144,28 @@ void RedisServantGroup::setEnabled(bool b)
     }
 }
 
+bool RedisServantGroup::canEject(RedisServant* servant) const
+{
+    bool master = false;
+    for (int i = 0; i < m_masterCount; ++i) {
+        if (m_master[i] == servant) {
+            master = true;
+        } else if (m_master[i]->isUsable()) {
+            return true;
+        }
+    }
+    if (master) {
+        return false;
+    }
+
+    for (int i = 0; i < m_slaveCount; ++i) {
+        if (m_slaver[i] != servant && m_slaver[i]->isUsable()) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool RedisServantGroup::isEnabled(void) const
 {
     for (int i = 0; i < m_masterCount; ++i) {
@@ -52,6 +52,10 @@ public:
     void setGroupName(const char* name);
     const char* groupName(void) const { return m_name; }
 
+    //Share of the hash values the group gets from a ketama ring
+    void setWeight(int weight) { m_weight = weight; }
+    int weight(void) const { return m_weight; }
+
     void setPolicy(RedisServantGroupPolicy* policy);
     RedisServantGroupPolicy* policy(void) const { return m_policy; }
 
@@ -70,9 +74,13 @@ public:
     RedisServant* findUsableServant(ClientPacket* packet)
     { return m_policy->selectServant(this, packet); }
 
+    //Whether the other servants can take the requests of servant
+    bool canEject(RedisServant* servant) const;
+
 private:
     int m_groupId;
     char m_name[256];
+    int m_weight;
     int m_masterCount;
     int m_slaveCount;
     RedisServant* m_master[MaxServantCount];
@@ -0,0 +1,78 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+
+#include <string.h>
+
+#include "routingtable.h"
+
+RoutingTable::RoutingTable(void)
+{
+    retiredEpoch = 0;
+    nextRetired = NULL;
+    m_migratingHashValue = -1;
+    m_migrationSource = NULL;
+    for (int i = 0; i < MaxHashValue; ++i) {
+        m_hashMapping[i] = NULL;
+    }
+}
+
+RoutingTable::RoutingTable(const RoutingTable& other) :
+    m_keyMapping(other.m_keyMapping)
+{
+    retiredEpoch = 0;
+    nextRetired = NULL;
+    m_migratingHashValue = other.m_migratingHashValue;
+    m_migrationSource = other.m_migrationSource;
+    memcpy(m_hashMapping, other.m_hashMapping, sizeof(m_hashMapping));
+}
+
+RoutingTable::~RoutingTable(void)
+{
+}
+
+RedisServantGroup* RoutingTable::keyForGroup(const char* key, int len) const
+{
+    if (m_keyMapping.empty()) {
+        return NULL;
+    }
+    String _key(key, len, false);
+    StringMap<RedisServantGroup*>::const_iterator it = m_keyMapping.find(_key);
+    if (it != m_keyMapping.end()) {
+        return it->second;
+    }
+    return NULL;
+}
+
+void RoutingTable::addKeyMapping(const char* key, int len, RedisServantGroup* group)
+{
+    m_keyMapping.insert(StringMap<RedisServantGroup*>::value_type(String(key, len, true), group));
+}
+
+void RoutingTable::removeKeyMapping(const char* key, int len)
+{
+    m_keyMapping.erase(String(key, len));
+}
+
+void RoutingTable::setMigration(int hashValue, RedisServantGroup* source)
+{
+    m_migratingHashValue = hashValue;
+    m_migrationSource = source;
+}
@@ -0,0 +1,73 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+#ifndef ROUTINGTABLE_H
+#define ROUTINGTABLE_H
+
+#include "util/hash.h"
+
+class RedisServantGroup;
+
+//Hash value and key mappings of the proxy. A published table is never
+//changed: an update is made on a copy, which then replaces the table as a
+//whole. Readers load the current table and need no lock
+class RoutingTable
+{
+public:
+    enum {
+        MaxHashValue = 16384
+    };
+
+    RoutingTable(void);
+    RoutingTable(const RoutingTable& other);
+    ~RoutingTable(void);
+
+    RedisServantGroup* hashForGroup(int hashValue) const { return m_hashMapping[hashValue]; }
+    void setHashForGroup(int hashValue, RedisServantGroup* group) { m_hashMapping[hashValue] = group; }
+
+    //The group of a key mapped by name, NULL if none
+    RedisServantGroup* keyForGroup(const char* key, int len) const;
+    void addKeyMapping(const char* key, int len, RedisServantGroup* group);
+    void removeKeyMapping(const char* key, int len);
+    const StringMap<RedisServantGroup*>& keyMapping(void) const { return m_keyMapping; }
+
+    //A hash value being moved to its group keeps its old group as the
+    //source of the keys not moved yet. One hash value moves at a time
+    int migratingHashValue(void) const { return m_migratingHashValue; }
+    RedisServantGroup* migrationSource(int hashValue) const
+    { return (hashValue == m_migratingHashValue) ? m_migrationSource : NULL; }
+    void setMigration(int hashValue, RedisServantGroup* source);
+    void clearMigration(void) { setMigration(-1, NULL); }
+
+public:
+    //Set when the table is replaced, it is freed once no reader can use it
+    unsigned long long retiredEpoch;
+    RoutingTable* nextRetired;
+
+private:
+    RedisServantGroup* m_hashMapping[MaxHashValue];
+    StringMap<RedisServantGroup*> m_keyMapping;
+    int m_migratingHashValue;
+    RedisServantGroup* m_migrationSource;
+
+private:
+    RoutingTable& operator =(const RoutingTable&);
+};
+
+#endif
@@ -0,0 +1,152 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#include "redisproxy.h"
+#include "singleflight.h"
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+//Leaders in flight, chained by flightNext
+static THREAD_LOCAL ClientPacket* t_leaders[SingleFlight::BucketCount];
+//Bumped by each write on a key of the slot
+static THREAD_LOCAL unsigned int t_generations[SingleFlight::GenerationSlots];
+
+static void keysChanged(ClientPacket* packet)
+{
+    const RedisCommand* command = packet->command;
+    RedisProtoParseResult& r = packet->recvParseResult;
+    int first = command->firstKey;
+    if (first <= 0) {
+        return;
+    }
+    int last = command->lastKeyIndex(r.tokenCount);
+    int step = (command->keyStep > 0 ? command->keyStep : 1);
+    for (int i = first; i <= last && i < r.tokenCount; i += step) {
+        ++t_generations[hashForBytes(r.tokens[i].s, r.tokens[i].len) % SingleFlight::GenerationSlots];
+    }
+}
+
+static void removeLeader(ClientPacket* packet)
+{
+    ClientPacket** link = &t_leaders[packet->flightHash % SingleFlight::BucketCount];
+    while (*link) {
+        if (*link == packet) {
+            *link = packet->flightNext;
+            break;
+        }
+        link = &(*link)->flightNext;
+    }
+    packet->flightNext = NULL;
+}
+
+bool SingleFlight::join(RedisServantGroup* group, const char* key, int len, ClientPacket* packet)
+{
+    const RedisCommand* command = packet->command;
+    if (command->isWrite()) {
+        keysChanged(packet);
+        packet->flightState = Writer;
+        return false;
+    }
+
+    //Requests built from pieces (multi-key batches) are not shared, nor
+    //reads of several keys, the generation only follows the first one
+    RedisProtoParseResult& r = packet->recvParseResult;
+    if (!command->isRead() || command->lastKey != command->firstKey || !r.protoBuff ||
+            r.protoBuffLen > MaxRequestSize || !packet->requestSegments.isEmpty()) {
+        return false;
+    }
+
+    unsigned int hash = hashForBytes(r.protoBuff, r.protoBuffLen);
+    unsigned int generation = t_generations[hashForBytes(key, len) % GenerationSlots];
+    ClientPacket* leader = t_leaders[hash % BucketCount];
+    for (; leader; leader = leader->flightNext) {
+        RedisProtoParseResult& lr = leader->recvParseResult;
+        if (leader->flightHash == hash && leader->flightGroup == group &&
+                leader->flightGeneration == generation && lr.protoBuffLen == r.protoBuffLen &&
+                memcmp(lr.protoBuff, r.protoBuff, r.protoBuffLen) == 0) {
+            packet->flightState = Waiter;
+            packet->flightNext = leader->flightWaiters;
+            leader->flightWaiters = packet;
+            return true;
+        }
+    }
+
+    packet->flightState = Leader;
+    packet->flightHash = hash;
+    packet->flightGroup = group;
+    packet->flightGeneration = generation;
+    packet->flightWaiters = NULL;
+    packet->flightNext = t_leaders[hash % BucketCount];
+    t_leaders[hash % BucketCount] = packet;
+    return false;
+}
+
+void SingleFlight::finished(ClientPacket* packet)
+{
+    int state = packet->flightState;
+    packet->flightState = None;
+    if (state == Writer) {
+        keysChanged(packet);
+        return;
+    }
+    removeLeader(packet);
+
+    ClientPacket* waiter = packet->flightWaiters;
+    packet->flightWaiters = NULL;
+    if (!waiter) {
+        return;
+    }
+
+    int len = packet->sendParseResult.protoBuffLen;
+    int offset = packet->sendBufferOffset - len;
+    bool replied = (packet->finishedState == ClientPacket::RequestFinished && len > 0 &&
+                    offset >= 0 && offset + len <= packet->sendBuff.size());
+    while (waiter) {
+        ClientPacket* next = waiter->flightNext;
+        waiter->flightNext = NULL;
+        waiter->flightState = None;
+        if (replied) {
+            waiter->appendRedisReply(packet->sendBuff, offset, len);
+            waiter->setFinishedState(ClientPacket::RequestFinished);
+        } else if (packet->finishedState == ClientPacket::RequestFinished) {
+            waiter->setFinishedState(ClientPacket::RequestError);
+        } else {
+            waiter->setFinishedState((ClientPacket::State)packet->finishedState);
+        }
+        waiter = next;
+    }
+}
+
+bool SingleFlight::release(ClientPacket* packet)
+{
+    if (packet->flightState != Leader) {
+        return true;
+    }
+    if (packet->flightWaiters) {
+        return false;
+    }
+    removeLeader(packet);
+    packet->flightState = None;
+    return true;
+}
@@ -0,0 +1,61 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+class ClientPacket;
+class RedisServantGroup;
+
+//Identical reads in flight at the same time are sent to redis once. The
+//first request (the leader) is sent, the others wait for its reply and get
+//a copy of it. A client is served by the thread of its connection, so each
+//thread has its own table and the replies are passed on in that thread
+class SingleFlight
+{
+public:
+    enum {
+        BucketCount = 4096,
+        GenerationSlots = 256,
+        MaxRequestSize = 1024       //Larger requests are sent as they are
+    };
+
+    enum State {
+        None,
+        Leader,                     //Sent, its reply is shared
+        Waiter,                     //Waits for the reply of a leader
+        Writer                      //A write on keys read by others
+    };
+
+    //Returns true if the packet waits for the reply of an identical read.
+    //A write makes the reads in flight on its keys unshareable when it is
+    //sent and again when it is finished, they may have read the old value
+    static bool join(RedisServantGroup* group, const char* key, int len, ClientPacket* packet);
+
+    //Called when a leader or a write is finished. The reply of a leader is
+    //passed on to its waiters
+    static void finished(ClientPacket* packet);
+
+    //Stops sharing the reply of a leader, false if some requests already
+    //wait for it
+    static bool release(ClientPacket* packet);
+};
+
+#endif
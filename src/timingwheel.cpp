@@ -0,0 +1,204 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+
+#include "timingwheel.h"
+
+//Slots are circular lists headed by a timer that is never started
+WheelTimer::WheelTimer(void)
+{
+    m_wheel = NULL;
+    m_prev = this;
+    m_next = this;
+    m_expire = 0;
+    m_func = NULL;
+    m_arg = NULL;
+}
+
+WheelTimer::~WheelTimer(void)
+{
+    stop();
+}
+
+void WheelTimer::stop(void)
+{
+    if (m_wheel) {
+        m_wheel->stop(this);
+    }
+}
+
+
+
+TimingWheel::TimingWheel(EventLoop* loop)
+{
+    m_loop = loop;
+    m_startTime = EventLoop::monotonicTime();
+    m_tick = 0;
+    m_count = 0;
+    m_ticking = false;
+    m_tickEvent.set(loop, -1, EV_PERSIST, onTick, this);
+}
+
+//Loops are destroyed after the objects using them, the timers still kept
+//are only detached
+TimingWheel::~TimingWheel(void)
+{
+    if (m_ticking) {
+        m_tickEvent.remove();
+    }
+    for (int i = 0; i < LevelCount; ++i) {
+        for (int j = 0; j < SlotCount; ++j) {
+            WheelTimer* head = &m_slots[i][j];
+            while (head->m_next != head) {
+                WheelTimer* timer = head->m_next;
+                head->m_next = timer->m_next;
+                timer->m_wheel = NULL;
+                timer->m_prev = timer;
+                timer->m_next = timer;
+            }
+            head->m_prev = head;
+        }
+    }
+}
+
+unsigned long long TimingWheel::currentTick(void) const
+{
+    long long elapsed = EventLoop::monotonicTime() - m_startTime;
+    return (unsigned long long)(elapsed / (TickInterval * 1000));
+}
+
+void TimingWheel::start(WheelTimer* timer, int msec)
+{
+    if (timer->m_wheel) {
+        stop(timer);
+    }
+
+    //A tick is added as the current one has partly gone by
+    unsigned long long ticks = (msec + TickInterval - 1) / TickInterval + 1;
+    unsigned long long now = currentTick();
+    if (now < m_tick) {
+        now = m_tick;
+    }
+    if (!m_ticking) {
+        //Ticks passed while the wheel was idle have nothing to expire
+        m_tick = now;
+        m_ticking = true;
+        m_tickEvent.active(TickInterval);
+    }
+
+    timer->m_expire = now + ticks;
+    timer->m_wheel = this;
+    insert(timer);
+    ++m_count;
+}
+
+void TimingWheel::stop(WheelTimer* timer)
+{
+    if (timer->m_wheel != this) {
+        return;
+    }
+    timer->m_prev->m_next = timer->m_next;
+    timer->m_next->m_prev = timer->m_prev;
+    timer->m_prev = timer;
+    timer->m_next = timer;
+    timer->m_wheel = NULL;
+    --m_count;
+}
+
+void TimingWheel::insert(WheelTimer* timer)
+{
+    unsigned long long delta = 0;
+    if (timer->m_expire > m_tick) {
+        delta = timer->m_expire - m_tick;
+    }
+
+    int level = 0;
+    while (level < LevelCount - 1 && delta >= (1ULL << (SlotBits * (level + 1)))) {
+        ++level;
+    }
+    unsigned long long maxDelta = (1ULL << (SlotBits * LevelCount)) - 1;
+    if (delta > maxDelta) {
+        timer->m_expire = m_tick + maxDelta;
+    }
+    if (timer->m_expire < m_tick) {
+        timer->m_expire = m_tick;
+    }
+
+    int index = (int)((timer->m_expire >> (SlotBits * level)) & (SlotCount - 1));
+    WheelTimer* head = &m_slots[level][index];
+    timer->m_prev = head->m_prev;
+    timer->m_next = head;
+    head->m_prev->m_next = timer;
+    head->m_prev = timer;
+}
+
+//Expires the timers of one tick. The timers of a higher level slot are
+//placed again when the level below starts a new turn
+void TimingWheel::expire(unsigned long long tick)
+{
+    int index = (int)(tick & (SlotCount - 1));
+    for (int level = 1; index == 0 && level < LevelCount; ++level) {
+        int slot = (int)((tick >> (SlotBits * level)) & (SlotCount - 1));
+        WheelTimer* head = &m_slots[level][slot];
+        WheelTimer* timer = head->m_next;
+        head->m_prev = head;
+        head->m_next = head;
+        while (timer != head) {
+            WheelTimer* next = timer->m_next;
+            insert(timer);
+            timer = next;
+        }
+        index = slot;
+    }
+
+    //The slot is emptied first, handlers may start timers again
+    WheelTimer* head = &m_slots[0][tick & (SlotCount - 1)];
+    WheelTimer expired;
+    if (head->m_next != head) {
+        expired.m_next = head->m_next;
+        expired.m_prev = head->m_prev;
+        expired.m_next->m_prev = &expired;
+        expired.m_prev->m_next = &expired;
+        head->m_prev = head;
+        head->m_next = head;
+    }
+    m_tick = tick + 1;
+
+    while (expired.m_next != &expired) {
+        WheelTimer* timer = expired.m_next;
+        stop(timer);
+        if (timer->m_func) {
+            timer->m_func(timer->m_arg);
+        }
+    }
+}
+
+void TimingWheel::onTick(evutil_socket_t, short, void* arg)
+{
+    TimingWheel* wheel = (TimingWheel*)arg;
+    unsigned long long now = wheel->currentTick();
+    while (wheel->m_tick <= now && wheel->m_count > 0) {
+        wheel->expire(wheel->m_tick);
+    }
+    if (wheel->m_count == 0) {
+        wheel->m_ticking = false;
+        wheel->m_tickEvent.remove();
+    }
+}
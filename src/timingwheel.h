@@ -0,0 +1,105 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+
+
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include "eventloop.h"
+
+class TimingWheel;
+
+//Timeout kept by the timing wheel of an event loop. It is only started and
+//stopped from the thread of that loop. A timer may be restarted or destroyed
+//in its own handler
+class WheelTimer
+{
+public:
+    typedef void (*TimeoutHandler)(void* arg);
+
+    WheelTimer(void);
+    ~WheelTimer(void);
+
+    void setHandler(TimeoutHandler func, void* arg)
+    { m_func = func; m_arg = arg; }
+    bool isActive(void) const { return m_wheel != NULL; }
+    void stop(void);
+
+private:
+    TimingWheel* m_wheel;
+    WheelTimer* m_prev;
+    WheelTimer* m_next;
+    unsigned long long m_expire;        //Tick the timer expires at
+    TimeoutHandler m_func;
+    void* m_arg;
+    friend class TimingWheel;
+
+private:
+    WheelTimer(const WheelTimer&);
+    WheelTimer& operator =(const WheelTimer&);
+};
+
+
+//Hierarchical timing wheel. The first level has a slot per tick, each
+//further level a slot per turn of the level below, and the timers of a
+//slot move down a level when the level below reaches it. Starting and
+//stopping a timer is O(1) whatever the number of timers, so every request
+//and every client can have one. The tick event only runs while timers
+//are kept
+class TimingWheel
+{
+public:
+    enum {
+        TickInterval = 10,          //Milliseconds
+        SlotBits = 6,
+        SlotCount = 1 << SlotBits,
+        LevelCount = 4              //Up to 64^4 ticks, later timeouts are cut
+    };
+
+    TimingWheel(EventLoop* loop);
+    ~TimingWheel(void);
+
+    int timerCount(void) const { return m_count; }
+
+    //Restarts the timer if it is active
+    void start(WheelTimer* timer, int msec);
+    void stop(WheelTimer* timer);
+
+private:
+    unsigned long long currentTick(void) const;
+    void insert(WheelTimer* timer);
+    void expire(unsigned long long tick);
+    static void onTick(evutil_socket_t, short, void* arg);
+
+private:
+    EventLoop* m_loop;
+    long long m_startTime;
+    unsigned long long m_tick;          //Next tick to expire
+    int m_count;
+    bool m_ticking;
+    Event m_tickEvent;
+    WheelTimer m_slots[LevelCount][SlotCount];
+
+private:
+    TimingWheel(const TimingWheel&);
+    TimingWheel& operator =(const TimingWheel&);
+};
+
+#endif
@@ -28,6 +28,13 @@
 typedef unsigned int (*HashFunc)(const char* s, int len);
 unsigned int hashForBytes(const char *key, int len);
 
+//CRC16-CCITT (XMODEM) as Redis Cluster uses for its 16384 slots
+unsigned int crc16ForBytes(const char *key, int len);
+
+//Maps the key to one of the buckets, growing the buckets from n to n+1
+//moves only 1/(n+1) of the keys (Lamping & Veach)
+int jumpConsistentHash(unsigned long long key, int buckets);
+
 struct StringHashFunc {
     unsigned int operator()(const String& str) const {
         return hashForBytes(str.data(), str.length());
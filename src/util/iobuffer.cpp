@@ -22,17 +22,23 @@
 #include <stdio.h>
 
 #include "util/string.h"
+#include "util/slab.h"
 #include "iobuffer.h"
 
 IOBuffer::IOBuffer(void)
 {
-    m_capacity = sizeof(m_data);
-    m_offset = 0;
-    m_ptr = m_data;
+    m_head = NULL;
+    m_tail = NULL;
+    m_start = 0;
+    m_size = 0;
 }
 
 IOBuffer::IOBuffer(const IOBuffer &rhs)
 {
+    m_head = NULL;
+    m_tail = NULL;
+    m_start = 0;
+    m_size = 0;
     *this = rhs;
 }
 
@@ -45,25 +51,18 @@ IOBuffer &IOBuffer::operator=(const IOBuffer &rhs)
 {
     if (this != &rhs) {
         clear();
-
-        m_capacity = rhs.m_capacity;
-        m_offset = rhs.m_offset;
-        if (m_offset > ChunkSize) {
-            m_ptr = new char[m_capacity];
-        }
-        memcpy(m_ptr, rhs.m_ptr, m_offset);
+        append(rhs);
     }
     return *this;
 }
 
 void IOBuffer::reserve(int size)
 {
-    if (size <= m_capacity) {
-        return;
+    if (m_head == NULL) {
+        appendChunk(size);
+    } else if (m_head != m_tail || m_start + size > m_head->capacity) {
+        join(size);
     }
-
-    int append_chunk_cnt = size / ChunkSize + 1;
-    appendChunk(append_chunk_cnt);
 }
 
 void IOBuffer::appendFormatString(const char *format, ...)
@@ -87,64 +86,225 @@ void IOBuffer::append(const char *data, int size)
         size = strlen(data);
     }
 
-    int need_size = m_offset + size;
-    if (need_size > m_capacity) {
-        int append_chunk_cnt = (need_size - m_capacity) / ChunkSize + 1;
-        appendChunk(append_chunk_cnt);
-        append(data, size);
-    } else {
-        memcpy(m_ptr + m_offset, data, size);
-        m_offset += size;
+    while (size > 0) {
+        Chunk* chunk = m_tail;
+        if (chunk == NULL || chunk->size == chunk->capacity) {
+            chunk = appendChunk(size);
+        }
+        int n = chunk->capacity - chunk->size;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(chunk->data() + chunk->size, data, n);
+        chunk->size += n;
+        m_size += n;
+        data += n;
+        size -= n;
     }
 }
 
 void IOBuffer::append(const IOBuffer &rhs)
 {
-    append(rhs.data(), rhs.size());
+    append(rhs, 0, rhs.size());
+}
+
+void IOBuffer::append(const IOBuffer &rhs, int offset, int size)
+{
+    IOSegment segs[16];
+    int end = offset + size;
+    while (offset < end) {
+        int count = rhs.segments(offset, segs, 16);
+        if (count == 0) {
+            break;
+        }
+        for (int i = 0; i < count && offset < end; ++i) {
+            int n = (segs[i].size < end - offset) ? segs[i].size : end - offset;
+            append(segs[i].data, n);
+            offset += n;
+        }
+    }
+}
+
+void IOBuffer::remove(int size)
+{
+    if (size <= 0 || m_head == NULL) {
+        return;
+    }
+    if (size >= m_size) {
+        //Only the last chunk is kept for the next data
+        while (m_head != m_tail) {
+            Chunk* next = m_head->next;
+            freeChunk(m_head);
+            m_head = next;
+        }
+        m_tail->size = 0;
+        m_start = 0;
+        m_size = 0;
+        return;
+    }
+    m_size -= size;
+    while (m_start + size >= m_head->size && m_head != m_tail) {
+        size -= (m_head->size - m_start);
+        Chunk* next = m_head->next;
+        freeChunk(m_head);
+        m_head = next;
+        m_start = 0;
+    }
+    m_start += size;
 }
 
 void IOBuffer::clear(void)
 {
-    if (m_capacity > ChunkSize) {
-        delete []m_ptr;
+    while (m_head) {
+        Chunk* next = m_head->next;
+        freeChunk(m_head);
+        m_head = next;
     }
-    m_capacity = sizeof(m_data);
-    m_offset = 0;
-    m_ptr = m_data;
+    m_tail = NULL;
+    m_start = 0;
+    m_size = 0;
+}
+
+char* IOBuffer::data(void)
+{
+    if (m_head != m_tail) {
+        join(m_size);
+    }
+    return (m_head ? m_head->data() + m_start : NULL);
+}
+
+const char* IOBuffer::data(void) const
+{
+    return const_cast<IOBuffer*>(this)->data();
+}
+
+int IOBuffer::chunkCount(void) const
+{
+    int count = 0;
+    for (Chunk* chunk = m_head; chunk; chunk = chunk->next) {
+        ++count;
+    }
+    return count;
+}
+
+int IOBuffer::segments(int offset, IOSegment* segs, int maxCount) const
+{
+    int count = 0;
+    int start = m_start;
+    for (Chunk* chunk = m_head; chunk && count < maxCount; chunk = chunk->next) {
+        int size = chunk->size - start;
+        if (offset >= size) {
+            offset -= size;
+        } else if (size > 0) {
+            segs[count].data = chunk->data() + start + offset;
+            segs[count].size = size - offset;
+            ++count;
+            offset = 0;
+        }
+        start = 0;
+    }
+    return count;
+}
+
+int IOBuffer::copy(int offset, char* out, int size) const
+{
+    IOSegment segs[16];
+    int copied = 0;
+    while (copied < size) {
+        int count = segments(offset + copied, segs, 16);
+        if (count == 0) {
+            break;
+        }
+        for (int i = 0; i < count && copied < size; ++i) {
+            int n = (segs[i].size < size - copied) ? segs[i].size : size - copied;
+            memcpy(out + copied, segs[i].data, n);
+            copied += n;
+        }
+    }
+    return copied;
 }
 
 IOBuffer::DirectCopy IOBuffer::beginCopy(void)
 {
-    int freeSize = m_capacity - m_offset;
-    if (freeSize < (ChunkSize * 0.01)) {
-        appendChunk(1);
-        freeSize = m_capacity - m_offset;
+    Chunk* chunk = m_tail;
+    if (chunk == NULL || chunk->capacity - chunk->size < MinCopySize) {
+        chunk = appendChunk(0);
     }
     DirectCopy cp;
-    cp.address = m_ptr + m_offset;
-    cp.maxsize = freeSize;
+    cp.address = chunk->data() + chunk->size;
+    cp.maxsize = chunk->capacity - chunk->size;
     return cp;
 }
 
 void IOBuffer::endCopy(int cpsize)
 {
-    if (cpsize > 0 && cpsize <= (m_capacity - m_offset)) {
-        m_offset += cpsize;
+    if (m_tail && cpsize > 0 && cpsize <= (m_tail->capacity - m_tail->size)) {
+        m_tail->size += cpsize;
+        m_size += cpsize;
     }
 }
 
-void IOBuffer::appendChunk(int nums)
+//A new chunk is as large as the data stored, from MinChunkSize up to
+//MaxChunkSize, so a growing buffer needs few chunks
+IOBuffer::Chunk* IOBuffer::appendChunk(int size)
 {
-    if (nums <= 0) {
-        return;
+    int capacity = m_size;
+    if (capacity < size) {
+        capacity = size;
     }
-    int new_size = m_capacity + nums * ChunkSize;
-    char* tmp = new char[new_size];
-    memcpy(tmp, m_ptr, m_offset);
-    if (m_capacity > ChunkSize) {
-        delete []m_ptr;
+    int block = capacity + (int)sizeof(Chunk);
+    if (block < MinChunkSize) {
+        block = MinChunkSize;
+    } else if (block > MaxChunkSize) {
+        block = MaxChunkSize;
     }
-    m_ptr = tmp;
-    m_capacity = new_size;
+    block = Slab::blockSize(block);
+
+    Chunk* chunk = (Chunk*)Slab::alloc(block);
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->capacity = block - (int)sizeof(Chunk);
+    if (m_tail) {
+        m_tail->next = chunk;
+    } else {
+        m_head = chunk;
+    }
+    m_tail = chunk;
+    return chunk;
+}
+
+//Moves the data to one chunk with room for at least capacity bytes and
+//as much again as stored, so a buffer read with data() after each read
+//from a socket is joined a logarithmic number of times
+void IOBuffer::join(int capacity)
+{
+    if (capacity < m_size * 2) {
+        capacity = m_size * 2;
+    }
+    int block = capacity + (int)sizeof(Chunk);
+    if (block <= Slab::MaxBlockSize) {
+        block = Slab::blockSize(block);
+    } else {
+        block = (block + ChunkSize - 1) / ChunkSize * ChunkSize;
+    }
+
+    Chunk* chunk = (Chunk*)Slab::alloc(block);
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->capacity = block - (int)sizeof(Chunk);
+    for (Chunk* p = m_head; p; p = p->next) {
+        int start = (p == m_head) ? m_start : 0;
+        memcpy(chunk->data() + chunk->size, p->data() + start, p->size - start);
+        chunk->size += p->size - start;
+    }
+    int size = m_size;
+    clear();
+    m_head = chunk;
+    m_tail = chunk;
+    m_size = size;
 }
 
+void IOBuffer::freeChunk(Chunk* chunk)
+{
+    Slab::free(chunk, chunk->capacity + (int)sizeof(Chunk));
+}
@@ -20,6 +20,17 @@
 #ifndef IOBUFFER_H
 #define IOBUFFER_H
 
+//A piece of data sent by one vectored send
+struct IOSegment
+{
+    const char* data;
+    int size;
+};
+
+//Byte buffer kept as a chain of chunks. Appending and reading from a
+//socket fill the last chunk and add new ones, the data already stored
+//never moves. data() gives a contiguous view and joins the chunks when
+//the data spans several of them
 class IOBuffer
 {
 public:
@@ -28,37 +39,65 @@ public:
         int maxsize;
     };
 
-    enum { ChunkSize = 1024 * 64 };
+    enum {
+        MinChunkSize = 1024 * 4,    //Chunks are slab blocks of these sizes
+        MaxChunkSize = 1024 * 64,
+        ChunkSize = MaxChunkSize,   //Growth step of a joined buffer
+        MinCopySize = 1024          //Least free space offered to a direct copy
+    };
     IOBuffer(void);
     IOBuffer(const IOBuffer& rhs);
     ~IOBuffer(void);
     IOBuffer& operator=(const IOBuffer& rhs);
 
+    //Makes room for size bytes of contiguous data
     void reserve(int size);
 
     void appendFormatString(const char* format, ...);
     void append(const char* data, int size = -1);
     void append(const IOBuffer& rhs);
+    void append(const IOBuffer& rhs, int offset, int size);
+    //Drops data from the front, the memory of the last chunk is kept
+    void remove(int size);
+    //Drops the data and releases the memory
     void clear(void);
 
-    char* data(void) { return m_ptr; }
-    const char* data(void) const { return m_ptr; }
-    int size(void) const { return m_offset; }
+    //Contiguous view of the data, the chunks are joined if needed
+    char* data(void);
+    const char* data(void) const;
+    int size(void) const { return m_size; }
+    int chunkCount(void) const;
 
-    bool isEmpty(void) const { return (m_offset == 0); }
+    bool isEmpty(void) const { return (m_size == 0); }
+
+    //Fills segments with the data from offset on, one per chunk, without
+    //joining. Returns the number of segments filled
+    int segments(int offset, IOSegment* segs, int maxCount) const;
+
+    //Copies up to size bytes from offset on, returns the bytes copied
+    int copy(int offset, char* out, int size) const;
 
     //Fast copy
     DirectCopy beginCopy(void);
     void endCopy(int cpsize);
 
 private:
-    void appendChunk(int nums);
+    struct Chunk {
+        Chunk* next;
+        int size;           //Bytes stored
+        int capacity;       //Bytes of data
+        char* data(void) { return (char*)(this + 1); }
+    };
+
+    Chunk* appendChunk(int size);
+    void join(int capacity);
+    static void freeChunk(Chunk* chunk);
 
 private:
-    int m_capacity;
-    int m_offset;
-    char m_data[ChunkSize];
-    char* m_ptr;
+    Chunk* m_head;          //Allocated on first use
+    Chunk* m_tail;
+    int m_start;            //Offset of the data in the head chunk
+    int m_size;
 };
 
 
@@ -64,6 +64,11 @@ public:
         return ret;
     }
 
+    //The oldest object, left in the queue
+    T head(const T& defaultVal) const {
+        return m_entry ? m_entry->item : defaultVal;
+    }
+
     void clear(void) {
         for (Node* node = m_entry; node != NULL;) {
             Node* next = node->next;
@@ -0,0 +1,86 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+#include "slab.h"
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+static THREAD_LOCAL FreeBlock* t_freeBlocks[Slab::ClassCount];
+static THREAD_LOCAL int t_cacheBytes[Slab::ClassCount];
+
+static int sizeClass(int size)
+{
+    int index = 0;
+    while ((Slab::MinBlockSize << index) < size) {
+        ++index;
+    }
+    return index;
+}
+
+int Slab::blockSize(int size)
+{
+    if (size > MaxBlockSize) {
+        return size;
+    }
+    return MinBlockSize << sizeClass(size);
+}
+
+void* Slab::alloc(int size)
+{
+    if (size > MaxBlockSize) {
+        return new char[size];
+    }
+    int index = sizeClass(size);
+    FreeBlock* block = t_freeBlocks[index];
+    if (block) {
+        t_freeBlocks[index] = block->next;
+        t_cacheBytes[index] -= (MinBlockSize << index);
+        return block;
+    }
+    return new char[MinBlockSize << index];
+}
+
+void Slab::free(void* block, int size)
+{
+    if (!block) {
+        return;
+    }
+    if (size > MaxBlockSize) {
+        delete [](char*)block;
+        return;
+    }
+    int index = sizeClass(size);
+    int bytes = (MinBlockSize << index);
+    if (t_cacheBytes[index] + bytes > MaxCacheBytes) {
+        delete [](char*)block;
+        return;
+    }
+    FreeBlock* freeBlock = (FreeBlock*)block;
+    freeBlock->next = t_freeBlocks[index];
+    t_freeBlocks[index] = freeBlock;
+    t_cacheBytes[index] += bytes;
+}
@@ -0,0 +1,52 @@
+﻿/*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+//Per-thread caches of memory blocks in power of two sizes, used for the
+//buffers and packets of the client connections. A block may be released
+//by another thread than the one that allocated it, it then goes to the
+//cache of the releasing thread
+class Slab
+{
+public:
+    enum {
+        MinBlockShift = 7,
+        MaxBlockShift = 16,
+        MinBlockSize = 1 << MinBlockShift,  //128 bytes
+        MaxBlockSize = 1 << MaxBlockShift,  //64KB
+        ClassCount = MaxBlockShift - MinBlockShift + 1,
+        MaxCacheBytes = 1024 * 1024         //Cached per size and thread
+    };
+
+    //Size of the block returned by alloc(size), sizes beyond MaxBlockSize
+    //are not rounded
+    static int blockSize(int size);
+
+    static void* alloc(int size);
+
+    //size is the one passed to alloc()
+    static void free(void* block, int size);
+
+private:
+    Slab(void);
+};
+
+#endif
@@ -52,12 +52,48 @@ void onReadClientHandler(socket_t, short, void* arg)
     }
 }
 
+//Collects the unsent part of the reply, the chunks of sendBuff first and
+//then the segments
+static int unsentSegments(Context* c, IOSegment* segments, int maxCount)
+{
+    int count = 0;
+    int skip = c->sendBytes;
+    if (skip < c->sendBuff.size()) {
+        count = c->sendBuff.segments(skip, segments, maxCount);
+        skip = 0;
+    } else {
+        skip -= c->sendBuff.size();
+    }
+    for (int i = 0; i < c->sendSegments.size() && count < maxCount; ++i) {
+        const IOSegment& seg = c->sendSegments.at(i);
+        if (skip >= seg.size) {
+            skip -= seg.size;
+            continue;
+        }
+        segments[count].data = seg.data + skip;
+        segments[count].size = seg.size - skip;
+        ++count;
+        skip = 0;
+    }
+    return count;
+}
+
 void onWriteClientHandler(socket_t, short, void* arg)
 {
     Context* c = (Context*)arg;
-    char* data = c->sendBuff.data() + c->sendBytes;
-    int size = c->sendBuff.size() - c->sendBytes;
-    int ret = c->clientSocket.nonblocking_send(data, size);
+    IOSegment segments[TcpSocket::MaxSendSegments];
+    int count = unsentSegments(c, segments, TcpSocket::MaxSendSegments);
+    if (count == 0) {
+        c->server->writeReplyFinished(c);
+        return;
+    }
+
+    int ret;
+    if (count == 1) {
+        ret = c->clientSocket.nonblocking_send(segments[0].data, segments[0].size);
+    } else {
+        ret = c->clientSocket.nonblocking_sendv(segments, count);
+    }
     switch (ret) {
     case TcpSocket::IOAgain:
         c->_event.set(c->eventLoop, c->clientSocket.socket(), EV_WRITE, onWriteClientHandler, c);
@@ -68,7 +104,7 @@ void onWriteClientHandler(socket_t, short, void* arg)
         break;
     default:
         c->sendBytes += ret;
-        if (c->sendBytes != c->sendBuff.size()) {
+        if (c->sendBytes != c->replySize()) {
             onWriteClientHandler(0, 0, c);
         } else {
             c->server->writeReplyFinished(c);
@@ -78,6 +114,13 @@ void onWriteClientHandler(socket_t, short, void* arg)
 }
 
 
+//The client is handled by the thread of its loop from now on
+static void onClientAccepted(evutil_socket_t, short, void* arg)
+{
+    Context* c = (Context*)arg;
+    c->server->waitRequest(c);
+}
+
 void TcpServer::onAcceptHandler(evutil_socket_t sock, short, void* arg)
 {
     sockaddr_in clientAddr;
@@ -102,7 +145,8 @@ void TcpServer::onAcceptHandler(evutil_socket_t sock, short, void* arg)
             c->eventLoop = srv->eventLoop();
         }
         srv->clientConnected(c);
-        srv->waitRequest(c);
+        c->_event.setTimer(c->eventLoop, onClientAccepted, c);
+        c->_event.trigger();
     } else {
         socket.close();
     }
@@ -20,6 +20,7 @@
 #ifndef TCPSERVER_H
 #define TCPSERVER_H
 
+#include "vector.h"
 #include "iobuffer.h"
 #include "eventloop.h"
 #include "tcpsocket.h"
@@ -37,10 +38,20 @@ public:
 
     virtual ~Context(void) {}
 
+    //Size of the whole reply, sendBuff and sendSegments
+    int replySize(void) const {
+        int size = sendBuff.size();
+        for (int i = 0; i < sendSegments.size(); ++i) {
+            size += sendSegments.at(i).size;
+        }
+        return size;
+    }
+
     TcpSocket clientSocket;     //Client socket
     HostAddress clientAddress;  //Client address
     TcpServer* server;          //The Connected server
     IOBuffer sendBuff;          //Send buffer
+    Vector<IOSegment> sendSegments; //Reply data sent after sendBuff
     IOBuffer recvBuff;          //Recv buffer
     int sendBytes;              //Current send bytes
     int recvBytes;              //Current recv bytes
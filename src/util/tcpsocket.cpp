@@ -24,10 +24,12 @@
 #pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "advapi32.lib")
 #define SOCK_EAGAIN WSAEWOULDBLOCK
+#define SOCK_EINPROGRESS WSAEWOULDBLOCK
 #define SOCKET_ERRNO WSAGetLastError()
 #else
 #define closesocket close
 #define SOCK_EAGAIN EAGAIN
+#define SOCK_EINPROGRESS EINPROGRESS
 #define SOCKET_ERRNO (errno)
 #endif
 
@@ -254,6 +256,30 @@ bool TcpSocket::connect(const HostAddress &addr)
     return true;
 }
 
+int TcpSocket::nonblocking_connect(const HostAddress &addr)
+{
+    if (::connect(m_socket, (sockaddr*)addr._sockaddr(), sizeof(sockaddr_in)) == 0) {
+        return 0;
+    }
+
+    switch (SOCKET_ERRNO) {
+    case SOCK_EINPROGRESS:
+        return IOAgain;
+    default:
+        return IOError;
+    }
+}
+
+int TcpSocket::pendingError(void)
+{
+    int err = 0;
+    socketlen_t len = sizeof(err);
+    if (option(SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) {
+        return SOCKET_ERRNO;
+    }
+    return err;
+}
+
 int TcpSocket::nonblocking_send(const char *buff, int size, int flag)
 {
     int ret = ::send(m_socket, buff, size, flag);
@@ -271,6 +297,44 @@ int TcpSocket::nonblocking_send(const char *buff, int size, int flag)
     }
 }
 
+int TcpSocket::nonblocking_sendv(const IOSegment* segments, int count)
+{
+    if (count > MaxSendSegments) {
+        count = MaxSendSegments;
+    }
+#ifdef WIN32
+    WSABUF bufs[MaxSendSegments];
+    for (int i = 0; i < count; ++i) {
+        bufs[i].buf = (char*)segments[i].data;
+        bufs[i].len = segments[i].size;
+    }
+    DWORD sent = 0;
+    int ret = WSASend(m_socket, bufs, count, &sent, 0, NULL, NULL);
+    if (ret == 0) {
+        ret = (int)sent;
+    }
+#else
+    iovec iov[MaxSendSegments];
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = (void*)segments[i].data;
+        iov[i].iov_len = segments[i].size;
+    }
+    int ret = ::writev(m_socket, iov, count);
+#endif
+    if (ret > 0) {
+        return ret;
+    } else if (ret == -1) {
+        switch(SOCKET_ERRNO) {
+        case SOCK_EAGAIN:
+            return IOAgain;
+        default:
+            return IOError;
+        }
+    } else {
+        return IOError;
+    }
+}
+
 int TcpSocket::nonblocking_recv(char *buff, int size, int flag)
 {
     int ret = ::recv(m_socket, buff, size, flag);
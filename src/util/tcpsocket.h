@@ -30,6 +30,7 @@ typedef int socketlen_t;
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -39,6 +40,7 @@ typedef socklen_t socketlen_t;
 #endif
 
 #include "util/string.h"
+#include "util/iobuffer.h"
 
 class HostAddress
 {
@@ -67,6 +69,8 @@ public:
         IOError = -2
     };
 
+    enum { MaxSendSegments = 64 };
+
     TcpSocket(socket_t sock = -1);
     ~TcpSocket(void);
 
@@ -94,6 +98,13 @@ public:
 
     bool connect(const HostAddress& addr);
 
+    //Returns 0 when connected at once, IOAgain when the handshake is
+    //in progress and the socket must be polled for writing, else IOError
+    int nonblocking_connect(const HostAddress& addr);
+
+    //Pending error of the socket (SO_ERROR), 0 if none
+    int pendingError(void);
+
     //Blocking
     int send(const char *buf, int len, int flags = 0) {
         return ::send(m_socket, buf, len, flags);
@@ -106,6 +117,9 @@ public:
     int nonblocking_send(const char* buff, int size, int flag = 0);
     int nonblocking_recv(char* buff, int size, int flag = 0);
 
+    //Sends up to MaxSendSegments segments with one system call
+    int nonblocking_sendv(const IOSegment* segments, int count);
+
     void close(void);
     bool isNull(void) const;
 
@@ -25,14 +25,17 @@ class Vector
 {
 public:
     enum { ChunkSize = 64 };
+    //Memory is allocated by the first append
     Vector(void) {
         buff = 0;
         curcnt = 0;
         capacity = 0;
-        resize(ChunkSize);
     }
 
     Vector(int n) {
+        buff = 0;
+        curcnt = 0;
+        capacity = 0;
         resize(n);
     }
 
@@ -90,7 +93,6 @@ public:
         buff = 0;
         curcnt = 0;
         capacity = 0;
-        resize(ChunkSize);
     }
 
 private: